@@ -0,0 +1,753 @@
+// Loopback load test for the sync core: one host plus N clients in a single process, each
+// client generating creates, moves and deletes at fixed rates through the same batching
+// path the editor uses. Prints one JSON object with throughput, bytes per edit and
+// edit-propagation latency (queued on one client -> popped from another's inbound ring).
+// It also counts heap allocations over the middle half of the run, when every engine is
+// warmed up, and fails (exit 1) when there are more per delivery than --alloc-budget. What
+// is left there is amortized growth (the level's maps, send buffers finding their size), so
+// the budget is a recorded ceiling rather than 0: runs of the default setup allocate about
+// 0.001 times per delivery, a single allocation per flush is about 0.01.
+//
+// --late-join has one more client join three quarters of the way in, downloading the whole level while
+// the others keep editing, and reports the latency of edits that arrived meanwhile.
+//
+// --record writes the host's session log, and --replay feeds a session log (from a bench
+// run or a real relay) back through the host at the recorded pace, or flat out with
+// --replay-speed 0, so the decode/apply path can be profiled with real editing sessions.
+//
+// --sim 1 runs the same session on a simulated network (see SimNetwork.hpp) instead of
+// loopback: one thread steps every engine in virtual time, with the given one-way latency,
+// jitter, per-link bandwidth, loss and reordering, and --sim-drop cuts the first client's
+// link that many seconds in so it has to resume. With --sim-resume-fail 1 the host keeps no
+// session to resume, so that client starts over and has to resend what the host never got;
+// drop it late in the run (--sim-drop 4.5 of 5 seconds) so no later move covers a lost one.
+// The numbers only depend on the options and --sim-seed, so two runs print the same JSON.
+// It also checks that every peer ends up with the same level, and the host with every edit
+// that was sent. It doesn't count allocations: the simulator queues every packet on the
+// same heap, so the count would mostly be its own.
+//
+//   devious-bench [--clients 4] [--duration 5] [--create-rate 200] [--move-rate 2000]
+//                 [--delete-rate 100] [--seed-objects 10000] [--tick-hz 60]
+//                 [--batch-max 256] [--batch-interval 0] [--port 56321]
+//                 [--late-join 0] [--record FILE] [--replay FILE] [--replay-speed 1]
+//                 [--alloc-budget 0.005]
+//                 [--sim 0] [--sim-seed 1] [--sim-latency MS] [--sim-jitter MS]
+//                 [--sim-bandwidth KB/S] [--sim-loss P] [--sim-reorder P] [--sim-drop S]
+//                 [--sim-resume-fail 0]
+
+#include "net/EditBatcher.hpp"
+#include "net/SessionLog.hpp"
+#include "net/SimNetwork.hpp"
+#include "net/SyncEngine.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using namespace devious;
+using Clock = std::chrono::steady_clock;
+
+// Every allocation in the process, on any thread. The aligned and array forms forward here.
+std::atomic<uint64_t> g_allocations = 0;
+
+#if defined(__GNUC__) && !defined(__clang__)
+    #pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void* operator new(size_t size) {
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+struct Options {
+    int clients = 4;
+    double duration = 5.0;
+    double createRate = 200.0;   // per client per second
+    double moveRate = 2000.0;
+    double deleteRate = 100.0;
+    uint32_t seedObjects = 10000;
+    double tickHz = 60.0;
+    size_t batchMax = 256;
+    float batchInterval = 0.f;
+    uint16_t port = 56321;
+    bool lateJoin = false;
+    std::string record;
+    std::string replay;
+    double replaySpeed = 1.0;   // 0 = as fast as the host takes it
+    double allocBudget = 0.005;  // steady allocations per delivery
+    bool sim = false;
+    uint64_t simSeed = 1;
+    double simLatencyMs = 0.0;
+    double simJitterMs = 0.0;
+    double simBandwidthKBps = 0.0;  // 0 = unlimited
+    double simLoss = 0.0;
+    double simReorder = 0.0;
+    double simDrop = 0.0;           // 0 = never
+    bool simResumeFail = false;
+};
+
+bool parseOptions(int argc, char** argv, Options& o) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 >= argc) return false;
+        char const* v = argv[++i];
+        if (arg == "--clients") o.clients = std::atoi(v);
+        else if (arg == "--duration") o.duration = std::atof(v);
+        else if (arg == "--create-rate") o.createRate = std::atof(v);
+        else if (arg == "--move-rate") o.moveRate = std::atof(v);
+        else if (arg == "--delete-rate") o.deleteRate = std::atof(v);
+        else if (arg == "--seed-objects") o.seedObjects = (uint32_t)std::atol(v);
+        else if (arg == "--tick-hz") o.tickHz = std::atof(v);
+        else if (arg == "--batch-max") o.batchMax = (size_t)std::atol(v);
+        else if (arg == "--batch-interval") o.batchInterval = (float)std::atof(v);
+        else if (arg == "--port") o.port = (uint16_t)std::atoi(v);
+        else if (arg == "--late-join") o.lateJoin = std::atoi(v) != 0;
+        else if (arg == "--record") o.record = v;
+        else if (arg == "--replay") o.replay = v;
+        else if (arg == "--replay-speed") o.replaySpeed = std::atof(v);
+        else if (arg == "--alloc-budget") o.allocBudget = std::atof(v);
+        else if (arg == "--sim") o.sim = std::atoi(v) != 0;
+        else if (arg == "--sim-seed") o.simSeed = std::strtoull(v, nullptr, 10);
+        else if (arg == "--sim-latency") o.simLatencyMs = std::atof(v);
+        else if (arg == "--sim-jitter") o.simJitterMs = std::atof(v);
+        else if (arg == "--sim-bandwidth") o.simBandwidthKBps = std::atof(v);
+        else if (arg == "--sim-loss") o.simLoss = std::atof(v);
+        else if (arg == "--sim-reorder") o.simReorder = std::atof(v);
+        else if (arg == "--sim-drop") o.simDrop = std::atof(v);
+        else if (arg == "--sim-resume-fail") o.simResumeFail = std::atoi(v) != 0;
+        else return false;
+    }
+    if (o.sim && !o.replay.empty()) return false;
+    return o.clients >= 2 && o.clients <= 250 && o.duration > 0 && o.tickHz > 0 && o.batchMax > 0 && o.replaySpeed >= 0 && o.allocBudget >= 0
+        && o.simLatencyMs >= 0 && o.simJitterMs >= 0 && o.simBandwidthKBps >= 0 && o.simLoss >= 0 && o.simLoss < 1 && o.simReorder >= 0 && o.simReorder <= 1;
+}
+
+Clock::time_point g_epoch = Clock::now();
+// Set for --sim: time is the simulation's.
+SimNetwork* g_sim = nullptr;
+
+int64_t nowNs() { return std::chrono::duration_cast<std::chrono::nanoseconds>((g_sim ? g_sim->now() : Clock::now()) - g_epoch).count(); }
+
+// Every edit carries a per-sender sequence number so receivers can look up when it was
+// queued: in `rotation` for creates and moves (exact as a float below 2^24, and through
+// a TransformBlock's 1/64 degree steps too), and through
+// deleteSeq (indexed by the object's net id counter) for deletes. The tables are
+// preallocated and each slot is written before its edit is handed to the engine, whose
+// mutex and ring publish it to the receiving thread.
+constexpr uint32_t kMaxSeq = 1u << 24;
+
+struct Client {
+    int index = 0;
+    std::unique_ptr<SyncEngine> engine;
+    EditBatcher<EditOp> batcher;
+    std::vector<uint8_t> buffer;
+    std::vector<uint32_t> live;
+    std::mt19937 rng;
+
+    double carry[3] = {};  // edits of each kind owed to the next frame
+
+    std::vector<int64_t> sentAt;
+    std::vector<uint32_t> deleteSeq;
+    uint32_t nextSeq = 0;
+    uint32_t nextCounter = 1;
+
+    std::vector<int64_t> latencies;
+    std::vector<int64_t> joinLatencies;  // received while the late joiner was downloading
+    std::atomic<uint64_t> received = 0;
+    std::atomic<bool> synced = false;
+    std::atomic<bool> sendingDone = false;
+    int64_t connectNs = 0;
+    std::atomic<int64_t> syncedNs = 0;
+};
+
+std::array<Client*, 256> g_byPeer{};
+std::atomic<bool> g_stop = false;
+std::atomic<int64_t> g_joinStartNs = INT64_MAX;
+std::atomic<int64_t> g_joinEndNs = INT64_MAX;
+// Set for --sim: every edit the clients sent, applied the way the host applies them. The
+// host's level has to end up the same, however the links between them fared.
+LevelState* g_sent = nullptr;
+
+void send(Client& c) {
+    if (g_sent) forEachFrame(c.buffer, [](Frame const& frame) { decodeEdits(frame, [](EditOp&& op) { g_sent->apply(op); }); });
+    c.engine->sendPacket(c.buffer);
+}
+
+void queue(Client& c, EditOp const& op) {
+    c.batcher.push(op.coalesceKey(), op);
+    if (c.batcher.full()) {
+        c.buffer.clear();
+        c.batcher.flush(c.buffer, c.engine->stamp());
+        send(c);
+    }
+}
+
+void generate(Client& c, int kind) {
+    if (c.nextSeq >= c.sentAt.size()) return;
+    uint32_t seq = c.nextSeq;
+    uint8_t peer = c.engine->localPeer();
+    std::uniform_real_distribution<float> pos(0.f, 10000.f);
+    if (kind == 0) {
+        if (c.nextCounter >= c.deleteSeq.size()) return;
+        ObjectRecord object;
+        object.netId = makeNetId(peer, c.nextCounter++);
+        object.objectId = 1;
+        object.x = pos(c.rng);
+        object.y = pos(c.rng);
+        object.rotation = float(seq);
+        c.live.push_back(object.netId);
+        c.sentAt[c.nextSeq++] = nowNs();
+        queue(c, {CreateObjectMsg{object}});
+        return;
+    }
+    if (c.live.empty()) return;
+    size_t pick = std::uniform_int_distribution<size_t>(0, c.live.size() - 1)(c.rng);
+    uint32_t netId = c.live[pick];
+    if (kind == 1) {
+        c.sentAt[c.nextSeq++] = nowNs();
+        queue(c, {TransformObjectMsg{netId, pos(c.rng), pos(c.rng), float(seq), 1.f, 1.f}});
+    }
+    else {
+        c.live[pick] = c.live.back();
+        c.live.pop_back();
+        c.deleteSeq[netId & 0xFFFFFF] = seq;
+        c.sentAt[c.nextSeq++] = nowNs();
+        queue(c, {DeleteObjectMsg{netId}});
+    }
+}
+
+void receive(Client& c, EditOp const& op) {
+    uint32_t netId = op.netId();
+    Client* sender = g_byPeer[netIdPeer(netId)];
+    if (!sender) return; // seeded objects from the host's snapshot
+    int64_t seq = std::visit([&](auto const& m) -> int64_t {
+        using M = std::decay_t<decltype(m)>;
+        if constexpr (std::is_same_v<M, CreateObjectMsg>) return (int64_t)m.object.rotation;
+        else if constexpr (std::is_same_v<M, TransformObjectMsg>) return (int64_t)m.rotation;
+        else if constexpr (std::is_same_v<M, DeleteObjectMsg>) return sender->deleteSeq[netId & 0xFFFFFF];
+        else return -1;
+    }, op.msg);
+    if (seq < 0 || seq >= (int64_t)sender->sentAt.size()) return;
+    int64_t now = nowNs();
+    c.latencies.push_back(now - sender->sentAt[seq]);
+    if (now >= g_joinStartNs.load(std::memory_order_relaxed) && now < g_joinEndNs.load(std::memory_order_relaxed)) c.joinLatencies.push_back(now - sender->sentAt[seq]);
+    c.received.fetch_add(1, std::memory_order_relaxed);
+}
+
+void drain(Client& c) {
+    c.engine->inbound().drain([&](EditOp& op) { receive(c, op); });
+}
+
+// One editor frame: generate this frame's edits, flush the batch when due, then drain
+// everything that arrived.
+void frame(Client& c, Options const& o) {
+    float dt = float(1.0 / o.tickHz);
+    double rates[3] = {o.createRate, o.moveRate, o.deleteRate};
+    for (int kind = 0; kind < 3; ++kind) {
+        c.carry[kind] += rates[kind] * dt;
+        for (; c.carry[kind] >= 1.0; c.carry[kind] -= 1.0) generate(c, kind);
+    }
+    if (c.batcher.tick(dt)) {
+        c.buffer.clear();
+        c.batcher.flush(c.buffer, c.engine->stamp());
+        send(c);
+    }
+    drain(c);
+}
+
+void finishSending(Client& c) {
+    c.buffer.clear();
+    c.batcher.flush(c.buffer, c.engine->stamp());
+    if (!c.buffer.empty()) send(c);
+    c.sendingDone = true;
+}
+
+// One editor-like frame loop per client.
+void runClient(Client& c, Options const& o, Clock::time_point start, Clock::time_point end) {
+    auto period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / o.tickHz));
+    auto next = start;
+    std::this_thread::sleep_until(start);
+    while (Clock::now() < end) {
+        frame(c, o);
+        next += period;
+        std::this_thread::sleep_until(next);
+    }
+    finishSending(c);
+    while (!g_stop) {
+        drain(c);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    drain(c);
+}
+
+// Replay only measures throughput: the recorded edits carry no send times.
+void runReplayClient(Client& c) {
+    auto drain = [&] {
+        c.engine->inbound().drain([&](EditOp&) { c.received.fetch_add(1, std::memory_order_relaxed); });
+    };
+    while (!g_stop) {
+        drain();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    drain();
+}
+
+double percentile(std::vector<int64_t> const& sorted, double p) {
+    if (sorted.empty()) return 0.0;
+    size_t i = std::min(sorted.size() - 1, (size_t)(p * (double)sorted.size()));
+    return (double)sorted[i] / 1000.0;
+}
+
+template <class F>
+bool waitFor(F&& done, std::chrono::milliseconds timeout) {
+    auto deadline = Clock::now() + timeout;
+    while (!done()) {
+        if (Clock::now() >= deadline) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+std::unique_ptr<Client> makeClient(int index, Options const& o, SyncConfig const& config, std::shared_ptr<Transport> transport) {
+    size_t perSenderEdits = std::min<size_t>(kMaxSeq, size_t((o.createRate + o.moveRate + o.deleteRate) * o.duration * 1.25) + 1024);
+    size_t perSenderObjects = std::min<size_t>(0xFFFFFF, size_t(o.createRate * o.duration * 1.25) + 1024);
+    auto c = std::make_unique<Client>();
+    c->index = index;
+    c->rng.seed(1234 + index);
+    c->engine = std::make_unique<SyncEngine>(config, std::move(transport));
+    c->batcher.maxEdits = o.batchMax;
+    c->batcher.interval = o.batchInterval;
+    c->sentAt.resize(perSenderEdits);
+    c->deleteSeq.resize(perSenderObjects);
+    c->latencies.reserve(perSenderEdits * (o.clients - 1));
+    Client* raw = c.get();
+    c->engine->onEvent = [raw](SyncEvent e) {
+        if (e == SyncEvent::LevelSynced) {
+            raw->syncedNs = nowNs();
+            raw->synced = true;
+        }
+    };
+    c->connectNs = nowNs();
+    return c;
+}
+
+void printLatency(char const* name, std::vector<int64_t>& latencies, char const* end) {
+    std::sort(latencies.begin(), latencies.end());
+    std::printf("  \"%s\": {\"samples\": %zu, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}%s\n", name,
+        latencies.size(), percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+        latencies.empty() ? 0.0 : (double)latencies.back() / 1000.0, end);
+}
+
+// --sim: every engine runs without an I/O thread on one SimNetwork, and this loop steps
+// them all, moving the virtual clock to the next packet or timer.
+int simulate(Options const& o, SyncConfig config, std::vector<ObjectRecord> seed) {
+    constexpr auto kStep = std::chrono::milliseconds(1);
+    SimNetwork net(o.simSeed);
+    LinkConditions link;
+    link.latency = std::chrono::microseconds(int64_t(o.simLatencyMs * 1000.0));
+    link.jitter = std::chrono::microseconds(int64_t(o.simJitterMs * 1000.0));
+    link.bytesPerSecond = o.simBandwidthKBps * 1024.0;
+    link.loss = o.simLoss;
+    link.reorder = o.simReorder;
+    net.setConditions(link);
+    g_sim = &net;
+    g_epoch = net.now();
+    config.ioThread = false;
+
+    SyncConfig hostConfig = config;
+    hostConfig.deliverInbound = false;
+    hostConfig.sessionLog = o.record;
+    if (o.simResumeFail) hostConfig.resumeWindowMs = 0;
+    SyncEngine host(hostConfig, net.attach("10.0.0.1"));
+    int hostState = 0;
+    host.onEvent = [&](SyncEvent e) {
+        if (e == SyncEvent::Hosting) hostState = 1;
+        if (e == SyncEvent::PortInUse) hostState = -1;
+    };
+    LevelState sent;
+    sent.reset(seed);
+    g_sent = &sent;
+    host.startHost("bench", std::move(seed));
+
+    std::vector<SyncEngine*> engines{&host};
+    std::vector<std::unique_ptr<Client>> clients;
+    std::string firstClientIp;
+    for (int i = 0; i < o.clients; ++i) {
+        std::string ip = "10.0." + std::to_string(1 + i / 250) + "." + std::to_string(1 + i % 250);
+        if (i == 0) firstClientIp = ip;
+        clients.push_back(makeClient(i, o, config, net.attach(ip)));
+        clients.back()->engine->connectToServer("10.0.0.1");
+        engines.push_back(clients.back()->engine.get());
+    }
+    std::unique_ptr<SyncEngine> joiner;
+
+    auto step = [&](Clock::time_point until) {
+        for (auto* e : engines) e->runOnce();
+        net.advance(std::min({until, net.nextEvent(), net.now() + kStep}));
+    };
+    auto runUntil = [&](auto&& done, Clock::duration limit) {
+        auto deadline = net.now() + limit;
+        while (!done()) {
+            if (net.now() >= deadline) return false;
+            step(deadline);
+        }
+        return true;
+    };
+    auto seconds = [](double s) { return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(s)); };
+
+    bool joined = runUntil([&] {
+        if (hostState < 0) return true;
+        for (auto& c : clients) if (!c->synced || !c->engine->inSession()) return false;
+        return true;
+    }, std::chrono::seconds(60));
+    if (!joined || hostState < 0) {
+        std::fprintf(stderr, hostState < 0 ? "the simulated host could not listen\n" : "clients did not finish joining\n");
+        return 1;
+    }
+    std::vector<double> joinMs;
+    for (auto& c : clients) {
+        g_byPeer[c->engine->localPeer()] = c.get();
+        joinMs.push_back(double(c->syncedNs - c->connectNs) / 1e6);
+        c->engine->inbound().drain([](EditOp&) {});
+    }
+    std::sort(joinMs.begin(), joinMs.end());
+
+    auto start = net.now();
+    auto end = start + seconds(o.duration);
+    auto period = seconds(1.0 / o.tickHz);
+    auto nextFrame = start;
+    auto joinAt = start + (end - start) * 3 / 4;
+    auto dropAt = o.simDrop > 0 ? start + seconds(o.simDrop) : Clock::time_point::max();
+    while (net.now() < end) {
+        if (net.now() >= nextFrame) {
+            for (auto& c : clients) frame(*c, o);
+            nextFrame += period;
+        }
+        if (net.now() >= dropAt) {
+            net.resetStreams(firstClientIp);
+            dropAt = Clock::time_point::max();
+        }
+        if (o.lateJoin && !joiner && net.now() >= joinAt) {
+            SyncConfig joinerConfig = config;
+            joinerConfig.deliverInbound = false;
+            joiner = std::make_unique<SyncEngine>(joinerConfig, net.attach("10.0.255.1"));
+            joiner->onEvent = [](SyncEvent e) {
+                if (e == SyncEvent::LevelSynced) g_joinEndNs = nowNs();
+            };
+            g_joinStartNs = nowNs();
+            joiner->connectToServer("10.0.0.1");
+            engines.push_back(joiner.get());
+        }
+        step(std::min({nextFrame, end, dropAt}));
+    }
+    for (auto& c : clients) finishSending(*c);
+
+    uint64_t written = 0, bytes = 0;
+    for (auto& c : clients) {
+        auto const& s = c->batcher.stats();
+        written += s.editsQueued - s.editsCoalesced;
+        bytes += s.bytesSent;
+    }
+    uint64_t expected = written * uint64_t(o.clients - 1);
+    auto delivered = [&] {
+        uint64_t n = 0;
+        for (auto& c : clients) n += c->received;
+        return n;
+    };
+    // A client whose resume was refused starts over as a new peer and gets what it missed
+    // in a snapshot, so its deliveries can't be counted; the host holding every edit sent
+    // is what has to hold then.
+    auto complete = [&] { return host.levelHash() == sent.tree().root(); };
+    bool drained = runUntil([&] {
+        for (auto& c : clients) drain(*c);
+        return o.simResumeFail ? complete() : delivered() >= expected;
+    }, std::chrono::seconds(60));
+    auto finished = net.now();
+    // Every edit arrived everywhere; the levels must agree too, the late joiner's included.
+    auto converged = [&] {
+        for (auto* e : engines) if (e->levelHash() != host.levelHash()) return false;
+        return true;
+    };
+    bool agreed = runUntil(converged, std::chrono::seconds(10));
+    bool hostComplete = complete();
+
+    std::vector<int64_t> latencies, joinLatencies;
+    for (auto& c : clients) {
+        latencies.insert(latencies.end(), c->latencies.begin(), c->latencies.end());
+        joinLatencies.insert(joinLatencies.end(), c->joinLatencies.begin(), c->joinLatencies.end());
+    }
+    auto const& stats = net.stats();
+    auto metrics = host.metrics();
+
+    std::printf("{\n");
+    std::printf("  \"sim\": {\"seed\": %llu, \"latency_ms\": %.1f, \"jitter_ms\": %.1f, \"bandwidth_kbps\": %.0f, \"loss\": %.3f, \"reorder\": %.3f, \"drop_s\": %.1f, \"resume_fail\": %s},\n",
+        (unsigned long long)o.simSeed, o.simLatencyMs, o.simJitterMs, o.simBandwidthKBps, o.simLoss, o.simReorder, o.simDrop, o.simResumeFail ? "true" : "false");
+    std::printf("  \"clients\": %d,\n", o.clients);
+    std::printf("  \"duration_s\": %.3f,\n", o.duration);
+    std::printf("  \"seed_objects\": %u,\n", o.seedObjects);
+    std::printf("  \"join_ms\": {\"median\": %.3f, \"max\": %.3f},\n", joinMs[joinMs.size() / 2], joinMs.back());
+    std::printf("  \"edits_sent\": %llu,\n", (unsigned long long)written);
+    std::printf("  \"deliveries_expected\": %llu,\n", (unsigned long long)expected);
+    std::printf("  \"deliveries\": %llu,\n", (unsigned long long)delivered());
+    std::printf("  \"drained\": %s,\n", drained ? "true" : "false");
+    std::printf("  \"drain_ms\": %.3f,\n", std::chrono::duration<double, std::milli>(finished - end).count());
+    std::printf("  \"converged\": %s,\n", agreed ? "true" : "false");
+    std::printf("  \"host_complete\": %s,\n", hostComplete ? "true" : "false");
+    std::printf("  \"bytes_per_edit\": %.2f,\n", written ? double(bytes) / double(written) : 0.0);
+    std::printf("  \"resumes\": %llu,\n", (unsigned long long)metrics.total.resumes);
+    std::printf("  \"network\": {\"packets\": %llu, \"bytes\": %llu, \"lost\": %llu, \"reordered\": %llu, \"resets\": %llu},\n",
+        (unsigned long long)stats.packets, (unsigned long long)stats.bytes, (unsigned long long)stats.lost,
+        (unsigned long long)stats.reordered, (unsigned long long)stats.resets);
+    if (o.lateJoin) {
+        bool synced = g_joinEndNs != INT64_MAX;
+        std::printf("  \"late_join\": {\"synced\": %s, \"ms\": %.3f},\n", synced ? "true" : "false", synced ? double(g_joinEndNs - g_joinStartNs) / 1e6 : 0.0);
+        printLatency("late_join_latency_us", joinLatencies, ",");
+    }
+    printLatency("latency_us", latencies, "");
+    std::printf("}\n");
+
+    if (joiner) joiner->stop();
+    for (auto& c : clients) c->engine->stop();
+    host.stop();
+    g_sim = nullptr;
+    g_sent = nullptr;
+    return drained && agreed && hostComplete ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options o;
+    if (!parseOptions(argc, argv, o)) {
+        std::fprintf(stderr, "usage: devious-bench [--clients N>=2] [--duration S] [--create-rate R] [--move-rate R] [--delete-rate R]\n"
+                             "                     [--seed-objects N] [--tick-hz HZ] [--batch-max N] [--batch-interval S] [--port P]\n"
+                             "                     [--late-join 0|1] [--record FILE] [--replay FILE] [--replay-speed X]\n"
+                             "                     [--alloc-budget PER_DELIVERY]\n"
+                             "                     [--sim 0|1] [--sim-seed N] [--sim-latency MS] [--sim-jitter MS] [--sim-bandwidth KB/S]\n"
+                             "                     [--sim-loss P] [--sim-reorder P] [--sim-drop S] [--sim-resume-fail 0|1]\n");
+        return 2;
+    }
+
+    SyncConfig config;
+    config.port = o.port;
+    config.discoveryPort = uint16_t(o.port + 1);
+
+    // A replay starts from the log's first snapshot marker and keeps its edit frames,
+    // which point into the mapped file.
+    SessionLogReader log;
+    std::vector<std::pair<uint64_t, std::span<const uint8_t>>> replayFrames;
+    std::vector<ObjectRecord> seed;
+    uint64_t replayEdits = 0;
+    if (!o.replay.empty()) {
+        bool ok = log.open(o.replay) && log.replay(false,
+            [&](std::vector<ObjectRecord>&& records, std::vector<ObjectStamps>&&) { seed = std::move(records); },
+            [&](uint64_t timeUs, Frame const& frame) {
+                replayFrames.push_back({timeUs, frame.bytes});
+                decodeEdits(frame, [&](EditOp&&) { replayEdits++; });
+            });
+        if (!ok) {
+            std::fprintf(stderr, "%s is not a usable session log\n", o.replay.c_str());
+            return 1;
+        }
+        o.seedObjects = (uint32_t)seed.size();
+    }
+    else {
+        seed.resize(o.seedObjects);
+        for (uint32_t i = 0; i < o.seedObjects; ++i) {
+            seed[i].netId = makeNetId(kHostPeerId, i + 1);
+            seed[i].objectId = 1 + int32_t(i % 1000);
+            seed[i].x = float(i % 500) * 30.f;
+            seed[i].y = float(i / 500) * 30.f;
+        }
+    }
+    if (o.sim) return simulate(o, config, std::move(seed));
+
+    // The host is a pure relay here, like devious-relay, so every client is measured the same way.
+    SyncConfig hostConfig = config;
+    hostConfig.deliverInbound = false;
+    hostConfig.sessionLog = o.record;
+    SyncEngine host(hostConfig);
+    std::atomic<int> hostState = 0;
+    host.onEvent = [&](SyncEvent e) {
+        if (e == SyncEvent::Hosting) hostState = 1;
+        if (e == SyncEvent::PortInUse) hostState = -1;
+    };
+    host.startHost("bench", std::move(seed));
+    if (!waitFor([&] { return hostState != 0; }, std::chrono::seconds(5)) || hostState < 0) {
+        std::fprintf(stderr, "could not listen on port %u\n", o.port);
+        return 1;
+    }
+
+    std::vector<std::unique_ptr<Client>> clients;
+    for (int i = 0; i < o.clients; ++i) {
+        clients.push_back(makeClient(i, o, config, nullptr));
+        clients.back()->engine->connectToServer("127.0.0.1");
+    }
+
+    bool joined = waitFor([&] {
+        for (auto& c : clients) if (!c->synced || !c->engine->inSession()) return false;
+        return true;
+    }, std::chrono::seconds(30));
+    if (!joined) {
+        std::fprintf(stderr, "clients did not finish joining\n");
+        return 1;
+    }
+    std::vector<double> joinMs;
+    for (auto& c : clients) {
+        g_byPeer[c->engine->localPeer()] = c.get();
+        joinMs.push_back(double(c->syncedNs - c->connectNs) / 1e6);
+        c->engine->inbound().drain([](EditOp&) {});
+    }
+
+    if (!o.replay.empty()) {
+        std::vector<std::thread> threads;
+        for (auto& c : clients) threads.emplace_back(runReplayClient, std::ref(*c));
+        auto start = Clock::now();
+        uint64_t firstUs = replayFrames.empty() ? 0 : replayFrames.front().first;
+        for (auto const& [timeUs, bytes] : replayFrames) {
+            if (o.replaySpeed > 0) {
+                std::this_thread::sleep_until(start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::micro>(double(timeUs - firstUs) / o.replaySpeed)));
+            }
+            host.sendPacket(bytes);
+        }
+        uint64_t expected = replayEdits * uint64_t(o.clients);
+        auto delivered = [&] {
+            uint64_t n = 0;
+            for (auto& c : clients) n += c->received.load(std::memory_order_relaxed);
+            return n;
+        };
+        bool drained = waitFor([&] { return delivered() >= expected; }, std::chrono::seconds(60));
+        double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+        g_stop = true;
+        for (auto& t : threads) t.join();
+        double recorded = replayFrames.empty() ? 0.0 : double(replayFrames.back().first - firstUs) / 1e6;
+
+        std::printf("{\n");
+        std::printf("  \"replay\": \"%s\",\n", o.replay.c_str());
+        std::printf("  \"clients\": %d,\n", o.clients);
+        std::printf("  \"seed_objects\": %u,\n", o.seedObjects);
+        std::printf("  \"frames\": %zu,\n", replayFrames.size());
+        std::printf("  \"edits\": %llu,\n", (unsigned long long)replayEdits);
+        std::printf("  \"recorded_s\": %.3f,\n", recorded);
+        std::printf("  \"elapsed_s\": %.3f,\n", elapsed);
+        std::printf("  \"deliveries_expected\": %llu,\n", (unsigned long long)expected);
+        std::printf("  \"deliveries\": %llu,\n", (unsigned long long)delivered());
+        std::printf("  \"drained\": %s,\n", drained ? "true" : "false");
+        std::printf("  \"edits_per_sec\": %.1f,\n", double(replayEdits) / elapsed);
+        std::printf("  \"deliveries_per_sec\": %.1f\n", double(delivered()) / elapsed);
+        std::printf("}\n");
+
+        for (auto& c : clients) c->engine->stop();
+        host.stop();
+        return drained ? 0 : 1;
+    }
+
+    auto start = Clock::now() + std::chrono::milliseconds(50);
+    auto end = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(o.duration));
+    std::vector<std::thread> threads;
+    for (auto& c : clients) threads.emplace_back(runClient, std::ref(*c), std::cref(o), start, end);
+    auto delivered = [&] {
+        uint64_t n = 0;
+        for (auto& c : clients) n += c->received.load(std::memory_order_relaxed);
+        return n;
+    };
+    auto steadyFrom = start + (end - start) / 4, steadyTo = start + (end - start) * 3 / 4;
+    std::this_thread::sleep_until(steadyFrom);
+    uint64_t allocationsFrom = g_allocations.load(), deliveredFrom = delivered();
+    std::this_thread::sleep_until(steadyTo);
+    uint64_t steadyAllocations = g_allocations.load() - allocationsFrom, steadyDeliveries = delivered() - deliveredFrom;
+    double perDelivery = steadyDeliveries ? double(steadyAllocations) / double(steadyDeliveries) : 0.0;
+    bool withinBudget = steadyDeliveries && perDelivery <= o.allocBudget;
+
+    // Only downloads: like the host, it keeps the level in LevelState and nothing drains it.
+    std::unique_ptr<SyncEngine> joiner;
+    if (o.lateJoin) {
+        SyncConfig joinerConfig = config;
+        joinerConfig.deliverInbound = false;
+        joiner = std::make_unique<SyncEngine>(joinerConfig);
+        joiner->onEvent = [](SyncEvent e) {
+            if (e == SyncEvent::LevelSynced) g_joinEndNs = nowNs();
+        };
+        g_joinStartNs = nowNs();
+        joiner->connectToServer("127.0.0.1");
+    }
+
+    waitFor([&] {
+        for (auto& c : clients) if (!c->sendingDone) return false;
+        return true;
+    }, std::chrono::seconds(60));
+    uint64_t written = 0, queued = 0, bytes = 0, batches = 0;
+    for (auto& c : clients) {
+        auto const& s = c->batcher.stats();
+        queued += s.editsQueued;
+        written += s.editsQueued - s.editsCoalesced;
+        bytes += s.bytesSent;
+        batches += s.batchesSent;
+    }
+    uint64_t expected = written * uint64_t(o.clients - 1);
+    bool drained = waitFor([&] { return delivered() >= expected; }, std::chrono::seconds(10));
+    auto finished = Clock::now();
+    g_stop = true;
+    for (auto& t : threads) t.join();
+
+    std::vector<int64_t> latencies, joinLatencies;
+    for (auto& c : clients) {
+        latencies.insert(latencies.end(), c->latencies.begin(), c->latencies.end());
+        joinLatencies.insert(joinLatencies.end(), c->joinLatencies.begin(), c->joinLatencies.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
+    std::sort(joinLatencies.begin(), joinLatencies.end());
+    double elapsed = std::chrono::duration<double>(finished - start).count();
+    uint64_t clientSendCalls = 0;
+    for (auto& c : clients) clientSendCalls += c->engine->sendCalls();
+    std::sort(joinMs.begin(), joinMs.end());
+
+    std::printf("{\n");
+    std::printf("  \"clients\": %d,\n", o.clients);
+    std::printf("  \"duration_s\": %.3f,\n", o.duration);
+    std::printf("  \"seed_objects\": %u,\n", o.seedObjects);
+    std::printf("  \"rates_per_client\": {\"create\": %.1f, \"move\": %.1f, \"delete\": %.1f},\n", o.createRate, o.moveRate, o.deleteRate);
+    std::printf("  \"join_ms\": {\"median\": %.3f, \"max\": %.3f},\n", joinMs[joinMs.size() / 2], joinMs.back());
+    std::printf("  \"edits_queued\": %llu,\n", (unsigned long long)queued);
+    std::printf("  \"edits_sent\": %llu,\n", (unsigned long long)written);
+    std::printf("  \"batches_sent\": %llu,\n", (unsigned long long)batches);
+    std::printf("  \"deliveries_expected\": %llu,\n", (unsigned long long)expected);
+    std::printf("  \"deliveries\": %llu,\n", (unsigned long long)delivered());
+    std::printf("  \"drained\": %s,\n", drained ? "true" : "false");
+    std::printf("  \"edits_per_sec\": %.1f,\n", double(written) / o.duration);
+    std::printf("  \"deliveries_per_sec\": %.1f,\n", double(delivered()) / elapsed);
+    std::printf("  \"bytes_per_edit\": %.2f,\n", written ? double(bytes) / double(written) : 0.0);
+    if (o.lateJoin) {
+        bool synced = g_joinEndNs != INT64_MAX;
+        std::printf("  \"late_join\": {\"synced\": %s, \"ms\": %.3f, \"latency_us\": {\"samples\": %zu, \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f}},\n",
+            synced ? "true" : "false", synced ? double(g_joinEndNs - g_joinStartNs) / 1e6 : 0.0, joinLatencies.size(),
+            percentile(joinLatencies, 0.5), percentile(joinLatencies, 0.99), joinLatencies.empty() ? 0.0 : (double)joinLatencies.back() / 1000.0);
+    }
+    std::printf("  \"allocations\": {\"steady\": %llu, \"per_delivery\": %.4f, \"budget\": %.4f, \"within_budget\": %s},\n",
+                (unsigned long long)steadyAllocations, perDelivery, o.allocBudget, withinBudget ? "true" : "false");
+    std::printf("  \"send_calls\": {\"host\": %llu, \"clients\": %llu},\n", (unsigned long long)host.sendCalls(), (unsigned long long)clientSendCalls);
+    std::printf("  \"latency_us\": {\"samples\": %zu, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}\n",
+        latencies.size(), percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+        latencies.empty() ? 0.0 : (double)latencies.back() / 1000.0);
+    std::printf("}\n");
+
+    if (joiner) joiner->stop();
+    for (auto& c : clients) c->engine->stop();
+    host.stop();
+    if (!withinBudget) std::fprintf(stderr, "%.4f allocations per delivery, over the budget of %.4f\n", perDelivery, o.allocBudget);
+    return drained && withinBudget ? 0 : 1;
+}
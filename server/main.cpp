@@ -0,0 +1,231 @@
+// Headless relay: hosts sessions without the game, relays every peer's edits to the
+// others and keeps each level on disk so it survives restarts. With --log it also appends
+// every edit to a session log and, after a crash, recovers the level from it instead of
+// from the last save.
+//
+// Every level is a session of its own on the one port. The default session (the one a
+// client that names none joins) is kept in --data and --log; any other lives in the
+// --levels directory as <id>.dvlv, with its log next to it as <id>.dvsl when --log is
+// given. Saved levels there are opened at startup and stay open; a client naming a new
+// id opens an empty one, which is saved and closed once nobody has been in it for
+// --idle-close seconds. No more than --max-sessions are open at once.
+//
+//   devious-relay [--name NAME] [--port 54321] [--discovery-port 54322]
+//                 [--data level.dvlv] [--levels DIR] [--save-interval SECONDS] [--log session.dvsl]
+//                 [--max-sessions 64] [--idle-close SECONDS]
+
+#include "net/LevelFile.hpp"
+#include "net/SessionHub.hpp"
+#include "net/SessionLog.hpp"
+#include "net/SyncEngine.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace {
+
+std::atomic<bool> g_stopRequested = false;
+
+void onSignal(int) { g_stopRequested = true; }
+
+struct Options {
+    std::string name = "Dedicated Relay";
+    std::string dataPath = "relay-level.dvlv";
+    std::string levelsDir = "relay-levels";
+    std::string logPath;
+    devious::SyncConfig sync;
+    double saveInterval = 30.0;
+    size_t maxSessions = 64;
+    double idleClose = 300.0;
+};
+
+void usage() {
+    std::fprintf(stderr, "usage: devious-relay [--name NAME] [--port PORT] [--discovery-port PORT] [--data FILE] [--levels DIR] [--save-interval SECONDS] [--log FILE] [--max-sessions N] [--idle-close SECONDS]\n");
+}
+
+bool parseOptions(int argc, char** argv, Options& opts) {
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 >= argc) return false;
+        char const* value = argv[++i];
+        if (arg == "--name") opts.name = value;
+        else if (arg == "--port") opts.sync.port = (uint16_t)std::atoi(value);
+        else if (arg == "--discovery-port") opts.sync.discoveryPort = (uint16_t)std::atoi(value);
+        else if (arg == "--data") opts.dataPath = value;
+        else if (arg == "--levels") opts.levelsDir = value;
+        else if (arg == "--save-interval") opts.saveInterval = std::atof(value);
+        else if (arg == "--log") opts.logPath = value;
+        else if (arg == "--max-sessions") opts.maxSessions = (size_t)std::atoi(value);
+        else if (arg == "--idle-close") opts.idleClose = std::atof(value);
+        else return false;
+    }
+    return opts.saveInterval > 0 && opts.maxSessions > 0 && opts.idleClose > 0;
+}
+
+char const* describe(devious::SyncEvent event) {
+    switch (event) {
+        case devious::SyncEvent::Hosting: return "open";
+        case devious::SyncEvent::DiscoveryPortInUse: return "discovery port taken, beacons only";
+        case devious::SyncEvent::PeerDropped: return "dropped a peer that couldn't keep up";
+        case devious::SyncEvent::SessionFull: return "turned a new peer away, every peer id of the session is used";
+        default: return "unexpected event";
+    }
+}
+
+// Session ids become file names, so only plain ones are served.
+bool validSessionId(std::string const& id) {
+    if (id.size() > devious::kMaxSessionId) return false;
+    for (char c : id) {
+        bool plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+        if (!plain) return false;
+    }
+    return true;
+}
+
+struct SessionFiles {
+    std::string data;
+    std::string log;
+};
+
+SessionFiles filesFor(Options const& opts, std::string const& id) {
+    if (id.empty()) return {opts.dataPath, opts.logPath};
+    auto base = std::filesystem::path(opts.levelsDir) / id;
+    return {base.string() + ".dvlv", opts.logPath.empty() ? std::string() : base.string() + ".dvsl"};
+}
+
+std::string label(std::string const& id) { return id.empty() ? "(default)" : id; }
+
+// Objects restored from disk are re-keyed under the host's peer id. Peer ids restart
+// at 2 with every run, so keeping the old ids could collide with a new peer's objects.
+// Their stamps came from the old session's clocks and are dropped with the ids.
+std::vector<devious::ObjectRecord> loadSession(std::string const& id, SessionFiles const& files) {
+    std::vector<devious::ObjectRecord> objects;
+    std::vector<devious::ObjectStamps> stamps;
+    bool loaded = false;
+    if (!files.log.empty()) {
+        // The log is never older than the last save. The previous run's log is kept as
+        // .prev in case we crash again before the new one has its first marker.
+        std::string prevPath = files.log + ".prev";
+        std::error_code ec;
+        if (devious::recoverSessionLog(files.log, objects, stamps)) {
+            loaded = true;
+            std::filesystem::rename(files.log, prevPath, ec);
+            std::printf("[%s] recovered %zu objects from %s\n", label(id).c_str(), objects.size(), files.log.c_str());
+        }
+        else if (devious::recoverSessionLog(prevPath, objects, stamps)) {
+            loaded = true;
+            std::printf("[%s] recovered %zu objects from %s\n", label(id).c_str(), objects.size(), prevPath.c_str());
+        }
+    }
+    if (!loaded && devious::loadLevelFile(files.data, objects, stamps)) {
+        loaded = true;
+        std::printf("[%s] loaded %zu objects from %s\n", label(id).c_str(), objects.size(), files.data.c_str());
+    }
+    if (loaded) {
+        uint32_t counter = 1;
+        for (auto& object : objects) object.netId = devious::makeNetId(devious::kHostPeerId, counter++);
+    }
+    else objects.clear();
+    std::fflush(stdout);
+    return objects;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    Options opts;
+    if (!parseOptions(argc, argv, opts)) {
+        usage();
+        return 2;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(opts.levelsDir, ec);
+
+    // Per session, the state version last written to disk. Idle sessions are saved from
+    // the hub's thread, the rest from ours.
+    std::mutex saveMutex;
+    std::map<std::string, uint64_t> savedVersions;
+    auto saveSession = [&](std::string const& id, devious::SyncEngine& engine) {
+        auto snapshot = engine.captureSnapshot().get();
+        std::lock_guard<std::mutex> lock(saveMutex);
+        // A session's state is at version 1 right after it was loaded.
+        auto saved = savedVersions.try_emplace(id, 1).first;
+        if (snapshot->stateVersion == saved->second) return;
+        auto path = filesFor(opts, id).data;
+        if (devious::saveLevelFile(path, *snapshot)) {
+            saved->second = snapshot->stateVersion;
+            std::printf("[%s] saved %u objects, %zu peers connected\n", label(id).c_str(), snapshot->objectCount(), engine.peerCount());
+        }
+        else std::fprintf(stderr, "[%s] failed to save %s\n", label(id).c_str(), path.c_str());
+        std::fflush(stdout);
+    };
+
+    devious::SyncConfig config = opts.sync;
+    config.deliverInbound = false;
+    devious::SessionHub hub(config);
+    hub.maxSessions = opts.maxSessions;
+    hub.idleClose = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::duration<double>(opts.idleClose));
+    hub.openSession = [&](std::string const& id, devious::SessionSeed& seed) {
+        if (!validSessionId(id)) return false;
+        auto files = filesFor(opts, id);
+        seed.name = id.empty() ? opts.name : id;
+        seed.objects = loadSession(id, files);
+        seed.sessionLog = files.log;
+        return true;
+    };
+    hub.closingSession = [&](std::string const& id, devious::SyncEngine& engine) {
+        saveSession(id, engine);
+        // Reopening loads the level again, back at version 1.
+        std::lock_guard<std::mutex> lock(saveMutex);
+        savedVersions.erase(id);
+        std::printf("[%s] closed, nobody in it\n", label(id).c_str());
+        std::fflush(stdout);
+    };
+    hub.onEvent = [&](std::string const& id, devious::SyncEvent event) {
+        std::printf("[%s] %s\n", label(id).c_str(), describe(event));
+        std::fflush(stdout);
+    };
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    #ifdef SIGPIPE
+    std::signal(SIGPIPE, SIG_IGN);
+    #endif
+
+    if (!hub.start()) {
+        std::printf("port already in use\n");
+        return 1;
+    }
+    std::printf("listening on port %u\n", (unsigned)opts.sync.port);
+    std::fflush(stdout);
+    hub.open("", true);
+    for (auto const& entry : std::filesystem::directory_iterator(opts.levelsDir, ec)) {
+        auto id = entry.path().stem().string();
+        if (entry.path().extension() != ".dvlv" || id.empty() || !validSessionId(id)) continue;
+        if (!hub.open(id, true)) std::fprintf(stderr, "[%s] not opened, already serving %zu sessions\n", id.c_str(), opts.maxSessions);
+    }
+
+    auto save = [&] { hub.forEachSession(saveSession); };
+
+    auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(opts.saveInterval));
+    auto nextSave = std::chrono::steady_clock::now() + interval;
+    while (!g_stopRequested) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (std::chrono::steady_clock::now() < nextSave) continue;
+        save();
+        nextSave = std::chrono::steady_clock::now() + interval;
+    }
+
+    save();
+    hub.stop();
+    return 0;
+}
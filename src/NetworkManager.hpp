@@ -1,49 +1,111 @@
 #pragma once
 
-// --- WINDOWS HEADERS MUST BE FIRST ---
-#ifdef GEODE_IS_WINDOWS
-    #ifndef WIN32_LEAN_AND_MEAN
-        #define WIN32_LEAN_AND_MEAN
-    #endif
-    #include <winsock2.h>
-    #include <ws2tcpip.h>
-    #pragma comment(lib, "ws2_32.lib")
-    typedef SOCKET SocketType;
-    #define CLOSE_SOCKET closesocket
-    #define IS_VALID(s) (s != INVALID_SOCKET)
-#else
-    #include <sys/socket.h>
-    #include <netinet/in.h>
-    #include <arpa/inet.h>
-    #include <unistd.h>
-    #include <fcntl.h>
-    typedef int SocketType;
-    #define CLOSE_SOCKET close
-    #define IS_VALID(s) (s >= 0)
-#endif
+// Brings in winsock2 on Windows, which must come before Geode's windows.h.
+#include "net/Socket.hpp"
 
 #include <Geode/Geode.hpp>
-#include <thread>
-#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 #include <map>
-#include <mutex>
-#include <sstream>
+#include <vector>
+#include "net/Protocol.hpp"
+#include "net/EditBatcher.hpp"
+#include "net/FlatMap.hpp"
+#include "net/Lww.hpp"
+#include "net/Metrics.hpp"
+#include "net/ObjectBlock.hpp"
+#include "net/SpatialGrid.hpp"
+#include "net/SyncEngine.hpp"
 
 using namespace geode::prelude;
 
-struct ServerInfo {
-    std::string ip;
-    std::string name;
+// A decoded remote edit on its way from the I/O thread to the editor thread.
+using InboundOp = devious::EditOp;
+using ServerInfo = devious::ServerInfo;
+using ServerChange = devious::ServerChange;
+using ServerChangeKind = devious::ServerChangeKind;
+
+struct ApplyStats {
+    size_t pending = 0;           // remote edits waiting to be applied
+    size_t backlogApplied = 0;    // applied since the current backlog started
+    size_t lastFrameApplied = 0;
+    double lastFrameMs = 0.0;
+};
+
+// What another peer is doing right now, from its latest transient datagram.
+struct RemotePeer {
+    devious::TransientState state;
+    float age = 0.f;    // seconds since it was last heard from
 };
 
+// Per-second traffic over all links, derived from consecutive metric snapshots.
+struct NetRates {
+    double bytesIn = 0.0;
+    double bytesOut = 0.0;
+    double packetsIn = 0.0;
+    double packetsOut = 0.0;
+};
+
+// Binds the Geode-free SyncEngine to the editor: turns local editor changes into batched
+// edits, applies remote edits within a per-frame budget, and shows engine events as
+// notifications. All sockets and session state live in the engine's I/O thread.
 class NetworkManager {
-    SocketType m_tcpSocket = -1;
-    SocketType m_udpSocket = -1; 
-    bool m_running = false;
-    std::vector<SocketType> m_clients;
-    bool m_isHost = false;
-    std::mutex m_discoveryMutex;
-    std::map<std::string, ServerInfo> m_discoveredServers;
+    devious::SyncEngine m_engine;
+
+    // Owned by the editor (main) thread.
+    devious::EditBatcher<devious::EditOp> m_outgoing;
+    std::vector<uint8_t> m_batchBuffer;
+    bool m_applyingRemote = false;
+    double m_applyBudgetMs = 2.0;
+    ApplyStats m_applyStats;
+
+    // Every synced object in the current editor, by net id and by pointer. `last` is the
+    // state the session last saw, which is how local edits are detected each frame.
+    struct SyncedObject {
+        GameObject* object = nullptr;
+        devious::ObjectRecord last;
+        devious::ObjectStamps stamps;
+    };
+    LevelEditorLayer* m_editor = nullptr;
+    devious::FlatMap<uint32_t, SyncedObject> m_synced;
+    devious::FlatMap<uintptr_t, uint32_t> m_netIds;
+    // Tombstones: deleted net ids, so a late edit or refresh can't bring an object back.
+    devious::FlatMap<uint32_t, uint8_t> m_deleted;
+    uint32_t m_nextLocalId = 1;
+
+    // Inside a bulk editor action objects aren't sent one by one; whatever the action
+    // created goes out as ObjectBlock frames when it ends. Below kMinBlockObjects plain
+    // creates are cheaper.
+    static constexpr size_t kMinBlockObjects = 8;
+    int m_bulkDepth = 0;
+    std::vector<GameObject*> m_bulkCreated;
+
+    // Objects mid-drag. They are previewed to peers over the transient channel every frame
+    // and committed as a single TransformObject edit once they settle: still for
+    // kSettleSeconds, or deselected.
+    struct Moving {
+        devious::ObjectRecord latest;
+        float stillFor = 0.f;
+        bool selected = false;
+    };
+    static constexpr float kSettleSeconds = 0.15f;
+    devious::FlatMap<uint32_t, Moving> m_moving;
+    std::vector<uint32_t> m_selection;
+    std::vector<uint32_t> m_settled;
+    devious::TransientState m_sentTransient;
+    std::map<uint8_t, RemotePeer> m_remotePeers;
+    devious::Rect m_sentViewport;
+
+    // Main-thread view of the engine's counters, refreshed a few times a second.
+    devious::NetMetrics m_metrics;
+    NetRates m_rates;
+    uint64_t m_metricsRevision = 0;
+    float m_metricsTimer = 0.f;
+    double m_applyPeakMs = 0.0;
+    std::ofstream m_metricsLog;
+    float m_metricsLogTimer = 0.f;
 
 public:
     static NetworkManager* get() {
@@ -51,153 +113,548 @@ public:
         return &instance;
     }
 
-    NetworkManager() {
-        #ifdef GEODE_IS_WINDOWS
-        WSADATA wsaData;
-        WSAStartup(MAKEWORD(2, 2), &wsaData);
-        #endif
-    }
-
-    void startHost(std::string levelName) {
-        if (m_running) return;
-        m_isHost = true;
-        m_running = true;
-        std::thread([this, levelName]() {
-            m_tcpSocket = socket(AF_INET, SOCK_STREAM, 0);
-            #ifndef GEODE_IS_WINDOWS
-            int opt = 1;
-            setsockopt(m_tcpSocket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-            #endif
-            sockaddr_in serverAddr;
-            memset(&serverAddr, 0, sizeof(serverAddr));
-            serverAddr.sin_family = AF_INET;
-            serverAddr.sin_port = htons(54321);
-            serverAddr.sin_addr.s_addr = INADDR_ANY;
-            if (bind(m_tcpSocket, (sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) return;
-            listen(m_tcpSocket, 5);
-            while (m_running) {
-                sockaddr_in clientAddr;
-                #ifdef GEODE_IS_WINDOWS
-                int len = sizeof(clientAddr);
-                #else
-                socklen_t len = sizeof(clientAddr);
-                #endif
-                SocketType client = accept(m_tcpSocket, (sockaddr*)&clientAddr, &len);
-                if (IS_VALID(client)) {
-                    m_clients.push_back(client);
-                    std::thread(&NetworkManager::handleClient, this, client).detach();
-                }
+    NetworkManager() : m_engine(engineConfig()) {
+        m_engine.onEvent = [this](devious::SyncEvent event) {
+            Loader::get()->queueInMainThread([this, event] { notify(event); });
+        };
+    }
+
+    void stop() { m_engine.stop(); }
+
+    // Everything already in `editor` becomes part of the session; late joiners receive it
+    // as a snapshot.
+    void startHost(std::string levelName, LevelEditorLayer* editor) {
+        if (m_engine.isHost()) return;
+        bindEditor(editor);
+        std::vector<devious::ObjectRecord> objects;
+        for (auto obj : CCArrayExt<GameObject*>(editor->m_objects)) objects.push_back(registerObject(obj, devious::kHostPeerId));
+        m_engine.setConnectTimeout(connectTimeoutMs());
+        m_engine.startHost(std::move(levelName), std::move(objects));
+    }
+
+    void startSearching() { m_engine.startSearching(); }
+    // The browser closing is also when the servers it saw are remembered for the next one.
+    void stopSearching() {
+        m_engine.stopSearching();
+        m_engine.saveFoundServers();
+    }
+    // What changed in the LAN server list since version `since`; returns the new version.
+    uint64_t serverChanges(uint64_t since, std::vector<ServerChange>& out) { return m_engine.serverChanges(since, out); }
+    void connectToServer(std::string ip, std::string session = {}) {
+        m_engine.setConnectTimeout(connectTimeoutMs());
+        m_engine.connectToServer(std::move(ip), std::move(session));
+    }
+
+    // Thread-safe. Queues an already-encoded frame for every peer (host) or the server (client).
+    void sendPacket(std::span<const uint8_t> packet) { m_engine.sendPacket(packet); }
+
+    bool inSession() const { return m_engine.inSession(); }
+
+    // --- OUTGOING EDITS (main thread) ---
+
+    void configureBatching(size_t maxEdits, float interval) {
+        m_outgoing.maxEdits = std::max<size_t>(1, maxEdits);
+        m_outgoing.interval = std::max(0.f, interval);
+    }
+
+    void onObjectCreated(GameObject* obj) {
+        if (m_applyingRemote || !inSession()) return;
+        bindEditor(LevelEditorLayer::get());
+        if (m_bulkDepth) m_bulkCreated.push_back(obj);
+        else queueEdit({devious::CreateObjectMsg{registerObject(obj, m_engine.localPeer())}});
+    }
+
+    // Brackets paste, duplicate, undo and redo.
+    void beginBulk() { m_bulkDepth++; }
+
+    // `created` is what the action reports it made or brought back, if anything; of those,
+    // objects we don't track yet are new, which is how undoing a delete shows up. Objects
+    // made through createObject during the action are counted either way.
+    void endBulk(CCArray* created) {
+        if (m_bulkDepth == 0 || --m_bulkDepth) return;
+        auto ed = LevelEditorLayer::get();
+        std::vector<GameObject*> objects;
+        objects.swap(m_bulkCreated);
+        if (!ed || m_applyingRemote || !inSession()) return;
+        bindEditor(ed);
+        auto untracked = [&](GameObject* obj) { return obj && !m_netIds.contains(reinterpret_cast<uintptr_t>(obj)); };
+        std::erase_if(objects, [&](GameObject* obj) { return !untracked(obj); });
+        if (created) {
+            for (auto obj : CCArrayExt<GameObject*>(created)) if (untracked(obj)) objects.push_back(obj);
+        }
+        std::sort(objects.begin(), objects.end());
+        objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+
+        if (objects.size() < kMinBlockObjects) {
+            for (auto obj : objects) queueEdit({devious::CreateObjectMsg{registerObject(obj, m_engine.localPeer())}});
+            return;
+        }
+        // Anything already queued was edited first, so it has to arrive first.
+        flushEdits();
+        m_batchBuffer.clear();
+        uint64_t stamp = m_engine.stamp();
+        devious::ObjectBlockWriter writer(m_batchBuffer, stamp);
+        for (auto obj : objects) {
+            auto record = registerObject(obj, m_engine.localPeer());
+            m_synced.find(record.netId)->stamps = devious::ObjectStamps::all(stamp);
+            writer.add(record, obj->getSaveString(ed));
+        }
+        writer.finish();
+        sendPacket(m_batchBuffer);
+    }
+
+    void onObjectRemoved(GameObject* obj) {
+        if (m_applyingRemote) return;
+        auto netId = m_netIds.find(reinterpret_cast<uintptr_t>(obj));
+        if (!netId) return;
+        uint32_t id = *netId;
+        forgetObject(obj, id);
+        m_deleted.insert(id, 0);
+        queueEdit({devious::DeleteObjectMsg{id}});
+    }
+
+    // Called once per editor frame.
+    void tick(float dt) {
+        auto editor = LevelEditorLayer::get();
+        bindEditor(editor);
+        if (editor && inSession()) {
+            trackSelection(editor, dt);
+            sendTransient(editor);
+            sendViewport(editor);
+        }
+        if (m_outgoing.tick(dt)) flushEdits();
+        drainInbound();
+        receiveTransient(editor, dt);
+        refreshMetrics(dt);
+    }
+
+    // Peers heard from over the transient channel in the last few seconds.
+    std::map<uint8_t, RemotePeer> const& remotePeers() const { return m_remotePeers; }
+
+    devious::NetMetrics const& metrics() const { return m_metrics; }
+    NetRates const& rates() const { return m_rates; }
+    // Bumped whenever metrics() changes, so displays only redraw on new data.
+    uint64_t metricsRevision() const { return m_metricsRevision; }
+
+    // Appends a JSON line of metrics to `path` every second while in a session. An empty
+    // path turns logging off.
+    void setMetricsLog(std::filesystem::path const& path) {
+        if (m_metricsLog.is_open()) m_metricsLog.close();
+        if (!path.empty()) m_metricsLog.open(path, std::ios::app);
+    }
+
+    // How long the editor may spend applying remote edits per frame; the rest carries over.
+    void setApplyBudget(double ms) { m_applyBudgetMs = std::max(0.1, ms); }
+
+    ApplyStats const& applyStats() const { return m_applyStats; }
+
+    // True while remote edits are being applied, so editor hooks don't send them back out.
+    bool isApplyingRemote() const { return m_applyingRemote; }
+
+    // Queues an edit for the next batch. Edits of the same kind to the same object within
+    // one batch collapse into the latest one.
+    void queueEdit(devious::EditOp const& op) {
+        if (!inSession()) return;
+        if (auto synced = m_synced.find(op.netId())) devious::markPending(synced->stamps, op);
+        m_outgoing.push(op.coalesceKey(), op);
+        if (m_outgoing.full()) flushEdits();
+    }
+
+    // The batch is stamped now, after everything received so far, which is what lets our
+    // pending edits win over remote ones that arrived while they were queued. Moves that
+    // went out quantized are snapped to the same values here, so our copy of the level
+    // matches everyone else's.
+    void flushEdits() {
+        if (m_outgoing.empty()) return;
+        uint64_t stamp = m_engine.stamp();
+        m_outgoing.forEach([&](devious::EditOp const& op) {
+            if (auto synced = m_synced.find(op.netId())) devious::settlePending(synced->stamps, stamp);
+        });
+        m_batchBuffer.clear();
+        m_outgoing.flush(m_batchBuffer, stamp, [&](devious::TransformObjectMsg const& t) {
+            auto synced = m_synced.find(t.netId);
+            if (m_editor && synced) moveRemote(m_editor, *synced, t.x, t.y, t.rotation, t.scaleX, t.scaleY);
+        });
+        if (!m_batchBuffer.empty()) sendPacket(m_batchBuffer);
+    }
+
+    devious::BatchStats const& batchStats() const { return m_outgoing.stats(); }
+    uint64_t sendCalls() const { return m_engine.sendCalls(); }
+
+    template <class Msg>
+    void sendMessage(Msg const& msg) {
+        thread_local std::vector<uint8_t> buffer;
+        buffer.clear();
+        devious::PacketWriter writer(buffer);
+        msg.write(writer);
+        sendPacket(buffer);
+    }
+
+private:
+    static devious::SyncConfig engineConfig() {
+        devious::SyncConfig config;
+        config.discoveryCache = (Mod::get()->getSaveDir() / "servers.dvsc").string();
+        return config;
+    }
+
+    // Read on every host or join, so a changed setting applies to the next one.
+    static uint32_t connectTimeoutMs() {
+        return (uint32_t)(Mod::get()->getSettingValue<double>("connect-timeout") * 1000.0);
+    }
+
+    void notify(devious::SyncEvent event) {
+        switch (event) {
+            case devious::SyncEvent::Hosting: Notification::create("Hosting LAN Server!", NotificationIcon::Success)->show(); break;
+            case devious::SyncEvent::PortInUse: Notification::create("Port 54321 is already in use", NotificationIcon::Error)->show(); break;
+            case devious::SyncEvent::DiscoveryPortInUse: Notification::create("Another program holds the LAN discovery port", NotificationIcon::Warning)->show(); break;
+            case devious::SyncEvent::Connected: Notification::create("Connected to " + m_engine.joinedServer().name + "!", NotificationIcon::Success)->show(); break;
+            case devious::SyncEvent::ConnectFailed: Notification::create("Connection failed", NotificationIcon::Error)->show(); break;
+            case devious::SyncEvent::ConnectTimedOut: Notification::create("The host didn't answer", NotificationIcon::Error)->show(); break;
+            case devious::SyncEvent::VersionMismatch: Notification::create("The host runs another version of the mod", NotificationIcon::Error)->show(); break;
+            case devious::SyncEvent::UnknownSession: Notification::create("That level isn't open on the host anymore", NotificationIcon::Error)->show(); break;
+            case devious::SyncEvent::SessionFull: Notification::create("The session can't take any more players", NotificationIcon::Error)->show(); break;
+            case devious::SyncEvent::PeerDropped: Notification::create("Dropped a peer that couldn't keep up", NotificationIcon::Warning)->show(); break;
+            case devious::SyncEvent::LevelSynced: Notification::create("Level synced", NotificationIcon::Success)->show(); break;
+            case devious::SyncEvent::Reconnecting: Notification::create("Connection lost, reconnecting...", NotificationIcon::Loading)->show(); break;
+            case devious::SyncEvent::Resumed: Notification::create("Reconnected", NotificationIcon::Success)->show(); break;
+            case devious::SyncEvent::ConnectionLost: Notification::create("Lost the connection to the host", NotificationIcon::Error)->show(); break;
+        }
+    }
+
+    // --- REMOTE APPLY (main thread) ---
+
+    // Applies remote edits until the frame budget is spent. Whatever is left stays queued
+    // for the next frame so a large paste from a peer never freezes the editor.
+    void drainInbound() {
+        auto ed = LevelEditorLayer::get();
+        if (!ed) return;
+        auto start = std::chrono::steady_clock::now();
+        auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::milli>(m_applyBudgetMs));
+        size_t applied = 0;
+        InboundOp op;
+        m_applyingRemote = true;
+        auto& inbound = m_engine.inbound();
+        while (inbound.pop(op)) {
+            applyInbound(ed, op);
+            // Checking the clock every few ops keeps the overhead negligible for tiny ops.
+            if ((++applied & 7) == 0 && std::chrono::steady_clock::now() >= deadline) break;
+        }
+        m_applyingRemote = false;
+
+        m_applyStats.lastFrameApplied = applied;
+        m_applyStats.lastFrameMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        m_applyStats.pending = m_engine.pendingInbound();
+        m_applyStats.backlogApplied = m_applyStats.pending ? m_applyStats.backlogApplied + applied : 0;
+    }
+
+    // Remote edits are merged part by part against the stamps of what we already show,
+    // including our own edits that haven't been flushed yet, so every peer settles on the
+    // same newest value whatever order the edits arrived in.
+    void applyInbound(LevelEditorLayer* ed, InboundOp const& op) {
+        if (auto block = std::get_if<devious::ObjectBlockMsg>(&op.msg)) {
+            applyBlock(ed, *block, op.stamp);
+            return;
+        }
+        uint32_t netId = op.netId();
+        if (m_deleted.contains(netId)) return;
+        auto synced = m_synced.find(netId);
+        if (!synced) {
+            // Only whole records can introduce an object.
+            if (auto m = std::get_if<devious::CreateObjectMsg>(&op.msg)) createRemote(ed, m->object, devious::ObjectStamps::all(op.stamp));
+            else if (auto m = std::get_if<devious::ObjectStateMsg>(&op.msg)) createRemote(ed, m->object, m->stamps);
+            return;
+        }
+        uint32_t won = devious::mergeEdit(synced->stamps, op);
+        if (won) std::visit([&](auto const& m) { applyRemote(ed, *synced, m, won); }, op.msg);
+    }
+
+    void createRemote(LevelEditorLayer* ed, devious::ObjectRecord const& record, devious::ObjectStamps const& stamps) {
+        auto obj = ed->createObject(record.objectId, ccp(record.x, record.y), false);
+        if (!obj) return;
+        obj->setTag(99999);
+        obj->setRotation(record.rotation);
+        obj->setScaleX(record.scaleX);
+        obj->setScaleY(record.scaleY);
+        for (size_t p = 0; p < size_t(devious::ObjectProperty::Count); ++p) {
+            setObjectProperty(obj, devious::ObjectProperty(p), record.properties[p]);
+        }
+        m_synced.insert(record.netId, {obj, captureRecord(obj, record.netId), stamps});
+        m_netIds.insert(reinterpret_cast<uintptr_t>(obj), record.netId);
+    }
+
+    // One pass through the editor's own parser. If it doesn't hand back exactly one object
+    // per record the ids can't be matched up, so we fall back to the records.
+    void applyBlock(LevelEditorLayer* ed, devious::ObjectBlockMsg const& m, uint64_t stamp) {
+        auto const& records = m.block->records;
+        bool fresh = std::none_of(records.begin(), records.end(), [&](auto const& r) {
+            return m_synced.contains(r.netId) || m_deleted.contains(r.netId);
+        });
+        CCArray* objects = fresh ? ed->createObjectsFromString(m.block->objectString, true, true) : nullptr;
+        if (objects && objects->count() == records.size()) {
+            size_t i = 0;
+            for (auto obj : CCArrayExt<GameObject*>(objects)) {
+                uint32_t netId = records[i++].netId;
+                obj->setTag(99999);
+                m_synced.insert(netId, {obj, captureRecord(obj, netId), devious::ObjectStamps::all(stamp)});
+                m_netIds.insert(reinterpret_cast<uintptr_t>(obj), netId);
+            }
+            return;
+        }
+        if (objects) for (auto obj : CCArrayExt<GameObject*>(objects)) ed->removeObject(obj, true);
+        for (auto const& record : records) applyInbound(ed, {devious::CreateObjectMsg{record}, stamp});
+    }
+
+    // A whole record for an object we already have: only the parts that won are written.
+    void applyRecord(LevelEditorLayer* ed, SyncedObject& synced, devious::ObjectRecord const& record, uint32_t won) {
+        if (won & devious::kTransformPart) moveRemote(ed, synced, record.x, record.y, record.rotation, record.scaleX, record.scaleY);
+        for (size_t p = 0; p < size_t(devious::ObjectProperty::Count); ++p) {
+            if (!(won & devious::propertyPart(devious::ObjectProperty(p)))) continue;
+            setObjectProperty(synced.object, devious::ObjectProperty(p), record.properties[p]);
+            synced.last.properties[p] = record.properties[p];
+        }
+    }
+
+    void applyRemote(LevelEditorLayer* ed, SyncedObject& synced, devious::CreateObjectMsg const& m, uint32_t won) { applyRecord(ed, synced, m.object, won); }
+    void applyRemote(LevelEditorLayer* ed, SyncedObject& synced, devious::ObjectStateMsg const& m, uint32_t won) { applyRecord(ed, synced, m.object, won); }
+    void applyRemote(LevelEditorLayer*, SyncedObject&, devious::ObjectBlockMsg const&, uint32_t) {}
+
+    void applyRemote(LevelEditorLayer* ed, SyncedObject& synced, devious::TransformObjectMsg const& m, uint32_t) {
+        moveRemote(ed, synced, m.x, m.y, m.rotation, m.scaleX, m.scaleY);
+    }
+
+    void applyRemote(LevelEditorLayer*, SyncedObject& synced, devious::SetPropertyMsg const& m, uint32_t) {
+        setObjectProperty(synced.object, m.property, m.value);
+        synced.last.property(m.property) = m.value;
+    }
+
+    void applyRemote(LevelEditorLayer* ed, SyncedObject& synced, devious::DeleteObjectMsg const& m, uint32_t) {
+        auto obj = synced.object;
+        forgetObject(obj, m.netId);
+        m_deleted.insert(m.netId, 0);
+        ed->removeObject(obj, true);
+    }
+
+    void moveRemote(LevelEditorLayer* ed, SyncedObject& synced, float x, float y, float rotation, float scaleX, float scaleY) {
+        // Mid-drag our own move wins; it is committed after this one and overrides it everywhere.
+        if (m_moving.contains(synced.last.netId)) return;
+        auto obj = synced.object;
+        // Moving through EditorUI keeps the editor's section grid up to date; the move is
+        // relative, so the position is set exactly afterwards.
+        if (ed->m_editorUI) ed->m_editorUI->moveObject(obj, ccp(x, y) - obj->getPosition());
+        obj->setPosition({x, y});
+        obj->setRotation(rotation);
+        obj->setScaleX(scaleX);
+        obj->setScaleY(scaleY);
+        synced.last = captureRecord(obj, synced.last.netId);
+    }
+
+    // --- METRICS (main thread) ---
+
+    void refreshMetrics(float dt) {
+        m_applyPeakMs = std::max(m_applyPeakMs, m_applyStats.lastFrameMs);
+        m_metricsTimer += dt;
+        if (m_metricsTimer < 0.25f) return;
+        m_metricsTimer = 0.f;
+
+        auto next = m_engine.metrics();
+        next.applyMs = m_applyStats.lastFrameMs;
+        next.applyPeakMs = m_applyPeakMs;
+        next.applyPending = m_applyStats.pending;
+        m_applyPeakMs = 0.0;
+        double span = next.timeSec - m_metrics.timeSec;
+        if (m_metrics.timeSec > 0.0 && span > 0.0) {
+            m_rates.bytesIn = double(next.total.bytesIn - m_metrics.total.bytesIn) / span;
+            m_rates.bytesOut = double(next.total.bytesOut - m_metrics.total.bytesOut) / span;
+            m_rates.packetsIn = double(next.total.packetsIn - m_metrics.total.packetsIn) / span;
+            m_rates.packetsOut = double(next.total.packetsOut - m_metrics.total.packetsOut) / span;
+        }
+        m_metrics = std::move(next);
+        m_metricsRevision++;
+
+        m_metricsLogTimer += 0.25f;
+        if (m_metricsLog.is_open() && inSession() && m_metricsLogTimer >= 1.f) {
+            m_metricsLog << m_metrics.toJson() << '\n';
+            m_metricsLog.flush();
+            m_metricsLogTimer = 0.f;
+        }
+    }
+
+    // --- OBJECT TRACKING (main thread) ---
+
+    // Synced pointers are only meaningful for the editor they came from.
+    void bindEditor(LevelEditorLayer* editor) {
+        if (editor == m_editor) return;
+        m_editor = editor;
+        m_synced.clear();
+        m_netIds.clear();
+        m_deleted.clear();
+        m_moving.clear();
+        m_remotePeers.clear();
+        m_sentViewport = {};
+        m_bulkCreated.clear();
+    }
+
+    devious::ObjectRecord registerObject(GameObject* obj, uint8_t peer) {
+        uint32_t netId = devious::makeNetId(peer, m_nextLocalId++);
+        auto record = captureRecord(obj, netId);
+        m_synced.insert(netId, {obj, record, {}});
+        m_netIds.insert(reinterpret_cast<uintptr_t>(obj), netId);
+        return record;
+    }
+
+    void forgetObject(GameObject* obj, uint32_t netId) {
+        m_synced.erase(netId);
+        m_moving.erase(netId);
+        m_netIds.erase(reinterpret_cast<uintptr_t>(obj));
+    }
+
+    // Moves, rotations, scales and property edits all go through EditorUI on the current
+    // selection, so comparing the selection against what was last synced catches them
+    // without hooking every tool.
+    void trackSelection(LevelEditorLayer* ed, float dt) {
+        m_selection.clear();
+        m_moving.forEach([](uint32_t, Moving& m) { m.selected = false; });
+        if (ed->m_editorUI) {
+            bool preview = m_engine.transientReady();
+            for (auto obj : CCArrayExt<GameObject*>(ed->m_editorUI->getSelectedObjects())) checkForEdits(obj, dt, preview);
+        }
+        settleMoves();
+    }
+
+    void checkForEdits(GameObject* obj, float dt, bool preview) {
+        auto netId = m_netIds.find(reinterpret_cast<uintptr_t>(obj));
+        if (!netId) return;
+        m_selection.push_back(*netId);
+        auto synced = m_synced.find(*netId);
+        auto now = captureRecord(obj, *netId);
+        if (auto moving = m_moving.find(*netId)) {
+            moving->selected = true;
+            if (now.sameTransform(moving->latest)) moving->stillFor += dt;
+            else {
+                moving->latest = now;
+                moving->stillFor = 0.f;
             }
-        }).detach();
-
-        std::thread([this, levelName]() {
-            SocketType udpSock = socket(AF_INET, SOCK_DGRAM, 0);
-            int broadcast = 1;
-            setsockopt(udpSock, SOL_SOCKET, SO_BROADCAST, (char*)&broadcast, sizeof(broadcast));
-            sockaddr_in broadcastAddr;
-            memset(&broadcastAddr, 0, sizeof(broadcastAddr));
-            broadcastAddr.sin_family = AF_INET;
-            broadcastAddr.sin_port = htons(54322);
-            broadcastAddr.sin_addr.s_addr = INADDR_BROADCAST;
-            std::string msg = "GD_LAN:" + levelName;
-            while (m_running) {
-                sendto(udpSock, msg.c_str(), msg.size(), 0, (sockaddr*)&broadcastAddr, sizeof(broadcastAddr));
-                std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+        else if (!now.sameTransform(synced->last)) {
+            if (preview) m_moving.insert(*netId, {now, 0.f, true});
+            else {
+                queueEdit({devious::TransformObjectMsg{*netId, now.x, now.y, now.rotation, now.scaleX, now.scaleY}});
+                setTransform(synced->last, now);
+            }
+        }
+        for (size_t p = 0; p < size_t(devious::ObjectProperty::Count); ++p) {
+            if (now.properties[p] != synced->last.properties[p]) {
+                queueEdit({devious::SetPropertyMsg{*netId, devious::ObjectProperty(p), now.properties[p]}});
+                synced->last.properties[p] = now.properties[p];
             }
-        }).detach();
-        Loader::get()->queueInMainThread([]{
-            Notification::create("Hosting LAN Server!", NotificationIcon::Success)->show();
+        }
+    }
+
+    // Commits every drag that has come to rest. This is the only point where a drag
+    // reaches the authoritative TCP stream.
+    void settleMoves() {
+        m_settled.clear();
+        m_moving.forEach([&](uint32_t netId, Moving& m) {
+            if (!m.selected || m.stillFor >= kSettleSeconds) m_settled.push_back(netId);
         });
+        for (uint32_t netId : m_settled) {
+            auto const& latest = m_moving.find(netId)->latest;
+            queueEdit({devious::TransformObjectMsg{netId, latest.x, latest.y, latest.rotation, latest.scaleX, latest.scaleY}});
+            if (auto synced = m_synced.find(netId)) setTransform(synced->last, latest);
+            m_moving.erase(netId);
+        }
     }
 
-    void startSearching() {
-        m_running = true;
-        std::thread([this]() {
-            m_udpSocket = socket(AF_INET, SOCK_DGRAM, 0);
-            sockaddr_in recvAddr;
-            memset(&recvAddr, 0, sizeof(recvAddr));
-            recvAddr.sin_family = AF_INET;
-            recvAddr.sin_port = htons(54322);
-            recvAddr.sin_addr.s_addr = INADDR_ANY;
-            #ifndef GEODE_IS_WINDOWS
-            int reuse = 1;
-            setsockopt(m_udpSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-            #endif
-            bind(m_udpSocket, (sockaddr*)&recvAddr, sizeof(recvAddr));
-            char buffer[1024];
-            while (m_running) {
-                sockaddr_in senderAddr;
-                #ifdef GEODE_IS_WINDOWS
-                int len = sizeof(senderAddr);
-                #else
-                socklen_t len = sizeof(senderAddr);
-                #endif
-                int n = recvfrom(m_udpSocket, buffer, 1024, 0, (sockaddr*)&senderAddr, &len);
-                if (n > 0) {
-                    std::string msg(buffer, n);
-                    if (msg.find("GD_LAN:") == 0) {
-                        std::string ip = inet_ntoa(senderAddr.sin_addr);
-                        std::string name = msg.substr(7);
-                        std::lock_guard<std::mutex> lock(m_discoveryMutex);
-                        m_discoveredServers[ip] = {ip, name};
-                    }
+    static void setTransform(devious::ObjectRecord& to, devious::ObjectRecord const& from) {
+        to.x = from.x;
+        to.y = from.y;
+        to.rotation = from.rotation;
+        to.scaleX = from.scaleX;
+        to.scaleY = from.scaleY;
+    }
+
+    // --- TRANSIENT STATE (main thread) ---
+
+    void sendTransient(LevelEditorLayer* ed) {
+        if (!m_engine.transientReady()) return;
+        devious::TransientState state;
+        if (ed->m_objectLayer) {
+            auto cursor = ed->m_objectLayer->convertToNodeSpace(getMousePos());
+            state.hasCursor = true;
+            state.cursorX = cursor.x;
+            state.cursorY = cursor.y;
+        }
+        m_moving.forEach([&](uint32_t netId, Moving& m) {
+            state.drags.push_back({netId, m.latest.x, m.latest.y, m.latest.rotation, m.latest.scaleX, m.latest.scaleY});
+        });
+        state.selectionTotal = (uint16_t)std::min<size_t>(m_selection.size(), UINT16_MAX);
+        state.selection = m_selection;
+        if (state == m_sentTransient) return;
+        m_engine.sendTransient(state);
+        m_sentTransient = std::move(state);
+    }
+
+    // Tells the host what we can see, padded by half a screen each way and snapped out to
+    // grid cells so scrolling within a cell sends nothing.
+    void sendViewport(LevelEditorLayer* ed) {
+        if (m_engine.isHost() || !ed->m_objectLayer) return;
+        auto size = CCDirector::get()->getWinSize();
+        auto a = ed->m_objectLayer->convertToNodeSpace(ccp(0, 0));
+        auto b = ed->m_objectLayer->convertToNodeSpace(ccp(size.width, size.height));
+        float padX = std::abs(b.x - a.x) * 0.5f;
+        float padY = std::abs(b.y - a.y) * 0.5f;
+        constexpr float cell = devious::SpatialGrid::kCellSize;
+        devious::Rect view{
+            std::floor((std::min(a.x, b.x) - padX) / cell) * cell,
+            std::floor((std::min(a.y, b.y) - padY) / cell) * cell,
+            std::ceil((std::max(a.x, b.x) + padX) / cell) * cell,
+            std::ceil((std::max(a.y, b.y) + padY) / cell) * cell,
+        };
+        if (view == m_sentViewport) return;
+        m_sentViewport = view;
+        m_engine.setViewport(view);
+    }
+
+    // Shows peers' drags as they happen. Previews only move objects; the settled edit
+    // that follows over TCP is what counts. Objects we are dragging ourselves stay put.
+    void receiveTransient(LevelEditorLayer* ed, float dt) {
+        for (auto it = m_remotePeers.begin(); it != m_remotePeers.end();) {
+            it->second.age += dt;
+            it = it->second.age > 5.f ? m_remotePeers.erase(it) : std::next(it);
+        }
+        m_engine.takeTransient([&](uint8_t peer, devious::TransientState& state) {
+            if (ed) {
+                for (auto const& drag : state.drags) {
+                    if (auto synced = m_synced.find(drag.netId)) moveRemote(ed, *synced, drag.x, drag.y, drag.rotation, drag.scaleX, drag.scaleY);
                 }
             }
-        }).detach();
-    }
-
-    std::vector<ServerInfo> getFoundServers() {
-        std::lock_guard<std::mutex> lock(m_discoveryMutex);
-        std::vector<ServerInfo> list;
-        for (auto const& [ip, info] : m_discoveredServers) list.push_back(info);
-        return list;
-    }
-
-    void connectToServer(std::string ip) {
-        m_isHost = false;
-        m_running = true;
-        std::thread([this, ip]() {
-            m_tcpSocket = socket(AF_INET, SOCK_STREAM, 0);
-            sockaddr_in addr;
-            memset(&addr, 0, sizeof(addr));
-            addr.sin_family = AF_INET;
-            addr.sin_port = htons(54321);
-            inet_pton(AF_INET, ip.c_str(), &addr.sin_addr);
-            if (connect(m_tcpSocket, (sockaddr*)&addr, sizeof(addr)) >= 0) {
-                Loader::get()->queueInMainThread([]{ Notification::create("Connected!", NotificationIcon::Success)->show(); });
-                handleClient(m_tcpSocket);
-            }
-        }).detach();
-    }
-
-    void sendPacket(std::string packet) {
-        if (m_isHost) for (auto c : m_clients) send(c, packet.c_str(), packet.size(), 0);
-        else send(m_tcpSocket, packet.c_str(), packet.size(), 0);
-    }
-
-    void handleClient(SocketType sock) {
-        char buffer[1024];
-        while (m_running) {
-            int n = recv(sock, buffer, 1024, 0);
-            if (n <= 0) break;
-            std::string data(buffer, n);
-            std::stringstream ss(data);
-            std::string type;
-            std::getline(ss, type, ',');
-            if (type == "1") {
-                std::string sId, sX, sY;
-                std::getline(ss, sId, ','); std::getline(ss, sX, ','); std::getline(ss, sY, ',');
-                try {
-                    int id = std::stoi(sId); float x = std::stof(sX); float y = std::stof(sY);
-                    Loader::get()->queueInMainThread([=](){
-                        if (auto ed = LevelEditorLayer::get()) {
-                            auto obj = ed->createObject(id, ccp(x, y), false);
-                            if(obj) obj->setTag(99999);
-                        }
-                    });
-                } catch(...) {}
-            }
-            if (m_isHost) sendPacket(data); 
+            m_remotePeers[peer] = {std::move(state), 0.f};
+        });
+    }
+
+    static devious::ObjectRecord captureRecord(GameObject* obj, uint32_t netId) {
+        devious::ObjectRecord record;
+        record.netId = netId;
+        record.objectId = obj->m_objectID;
+        record.x = obj->getPositionX();
+        record.y = obj->getPositionY();
+        record.rotation = obj->getRotation();
+        record.scaleX = obj->getScaleX();
+        record.scaleY = obj->getScaleY();
+        record.property(devious::ObjectProperty::ZOrder) = obj->m_zOrder;
+        record.property(devious::ObjectProperty::ZLayer) = (int32_t)obj->m_zLayer;
+        record.property(devious::ObjectProperty::EditorLayer) = obj->m_editorLayer;
+        record.property(devious::ObjectProperty::EditorLayer2) = obj->m_editorLayer2;
+        return record;
+    }
+
+    static void setObjectProperty(GameObject* obj, devious::ObjectProperty property, int32_t value) {
+        switch (property) {
+            case devious::ObjectProperty::ZOrder: obj->m_zOrder = value; break;
+            case devious::ObjectProperty::ZLayer: obj->m_zLayer = (ZLayer)value; break;
+            case devious::ObjectProperty::EditorLayer: obj->m_editorLayer = (short)value; break;
+            case devious::ObjectProperty::EditorLayer2: obj->m_editorLayer2 = (short)value; break;
+            default: break;
         }
     }
 };
@@ -12,13 +12,23 @@
 #include <Geode/modify/MenuLayer.hpp>
 #include <Geode/modify/LevelEditorLayer.hpp>
 #include <Geode/modify/EditorPauseLayer.hpp>
+#include <Geode/modify/EditorUI.hpp>
 #include "NetworkManager.hpp"
 
 using namespace geode::prelude;
 
 // --- SERVER BROWSER POPUP ---
 class ServerBrowser : public FLAlertLayer {
+    struct Row {
+        CCMenuItemSpriteExtra* button;
+        ButtonSprite* sprite;
+        ServerInfo server;
+    };
     CCMenu* m_listMenu;
+    CCLabelBMFont* m_scanning;
+    std::map<std::string, Row> m_rows;
+    uint64_t m_listVersion = 0;
+    std::vector<ServerChange> m_changes;
 public:
     bool init() {
         // 9th argument (1.0f) for Geode v5
@@ -29,36 +39,88 @@ public:
         m_listMenu->setLayout(ColumnLayout::create());
         m_listMenu->setPosition({150, 100}); 
         m_mainLayer->addChild(m_listMenu);
+        m_scanning = CCLabelBMFont::create("Scanning...", "goldFont.fnt");
+        m_scanning->setScale(0.6f);
+        m_listMenu->addChild(m_scanning);
 
         NetworkManager::get()->startSearching();
-        this->schedule(schedule_selector(ServerBrowser::refreshList), 1.0f);
+        // Cheap when nothing changed: one version check under the engine's lock.
+        this->schedule(schedule_selector(ServerBrowser::refreshList));
+        refreshList(0.f);
         return true;
     }
 
+    ~ServerBrowser() override { NetworkManager::get()->stopSearching(); }
+
+    static std::string rowLabel(ServerInfo const& s) {
+        std::string label = s.name + " (" + s.ip + ")";
+        std::string latency = s.reachable() ? " - " + std::to_string(std::lround(s.rttMs)) + " ms" : " - no reply";
+        if (s.cached) return label + " - saved" + latency;
+        if (!s.compatible()) return label + " - other version";
+        return label + " - " + std::to_string(s.players) + (s.players == 1 ? " player" : " players") + latency;
+    }
+
+    // Closest first: compatible servers by latency, then those not replying, then the rest.
+    void sortRows() {
+        std::vector<Row*> rows;
+        for (auto& [key, row] : m_rows) rows.push_back(&row);
+        auto rank = [](ServerInfo const& s) { return s.compatible() ? (s.reachable() ? 0 : 1) : 2; };
+        std::stable_sort(rows.begin(), rows.end(), [&](Row* a, Row* b) {
+            if (rank(a->server) != rank(b->server)) return rank(a->server) < rank(b->server);
+            return rank(a->server) == 0 && a->server.rttMs < b->server.rttMs;
+        });
+        for (size_t i = 0; i < rows.size(); ++i) m_listMenu->reorderChild(rows[i]->button, int(i));
+    }
+
+    // Only the rows that changed are touched.
     void refreshList(float dt) {
-        m_listMenu->removeAllChildren();
-        auto servers = NetworkManager::get()->getFoundServers();
-        if (servers.empty()) {
-            auto label = CCLabelBMFont::create("Scanning...", "goldFont.fnt");
-            label->setScale(0.6f);
-            m_listMenu->addChild(label);
-        }
-        for (auto& s : servers) {
-            std::string labelText = s.name + " (" + s.ip + ")";
-            auto btnSprite = ButtonSprite::create(labelText.c_str(), 200, true, "goldFont.fnt", "GJ_button_01.png", 30, 0.6f);
-            auto btn = CCMenuItemSpriteExtra::create(btnSprite, this, menu_selector(ServerBrowser::onJoin));
-            btn->setUserObject(CCString::create(s.ip));
-            m_listMenu->addChild(btn);
+        m_changes.clear();
+        uint64_t version = NetworkManager::get()->serverChanges(m_listVersion, m_changes);
+        if (version == m_listVersion && m_changes.empty()) return;
+        m_listVersion = version;
+        for (auto const& change : m_changes) {
+            auto const& s = change.server;
+            auto row = m_rows.find(s.key());
+            switch (change.kind) {
+                case ServerChangeKind::Reset:
+                    for (auto& [key, r] : m_rows) r.button->removeFromParent();
+                    m_rows.clear();
+                    break;
+                case ServerChangeKind::Added:
+                case ServerChangeKind::Updated:
+                    if (row != m_rows.end()) {
+                        row->second.sprite->setString(rowLabel(s).c_str());
+                        row->second.server = s;
+                        break;
+                    }
+                    {
+                        auto sprite = ButtonSprite::create(rowLabel(s).c_str(), 200, true, "goldFont.fnt", "GJ_button_01.png", 30, 0.6f);
+                        auto btn = CCMenuItemSpriteExtra::create(sprite, this, menu_selector(ServerBrowser::onJoin));
+                        btn->setUserObject(CCString::create(s.key()));
+                        m_listMenu->addChild(btn);
+                        m_rows[s.key()] = {btn, sprite, s};
+                    }
+                    break;
+                case ServerChangeKind::Removed:
+                    if (row == m_rows.end()) break;
+                    row->second.button->removeFromParent();
+                    m_rows.erase(row);
+                    break;
+            }
         }
+        m_scanning->setVisible(m_rows.empty());
+        sortRows();
         m_listMenu->updateLayout();
     }
 
     void onJoin(CCObject* sender) {
         auto node = static_cast<CCNode*>(sender);
-        if (auto ipStr = dynamic_cast<CCString*>(node->getUserObject())) {
-            NetworkManager::get()->connectToServer(ipStr->getCString());
-            this->onBtn1(nullptr); 
-        }
+        auto key = dynamic_cast<CCString*>(node->getUserObject());
+        if (!key) return;
+        auto row = m_rows.find(key->getCString());
+        if (row == m_rows.end()) return;
+        NetworkManager::get()->connectToServer(row->second.server.ip, row->second.server.session);
+        this->onBtn1(nullptr); 
     }
 
     static ServerBrowser* create() {
@@ -91,24 +153,185 @@ class $modify(MyPauseLayer, EditorPauseLayer) {
         auto btnSprite = ButtonSprite::create("Host LAN", 80, true, "goldFont.fnt", "GJ_button_01.png", 30, 0.6f);
         auto btn = CCMenuItemSpriteExtra::create(btnSprite, this, menu_selector(MyPauseLayer::onHost));
         menu->addChild(btn);
+        auto statsSprite = ButtonSprite::create("Net Stats", 80, true, "goldFont.fnt", "GJ_button_04.png", 30, 0.6f);
+        auto statsBtn = CCMenuItemSpriteExtra::create(statsSprite, this, menu_selector(MyPauseLayer::onToggleNetStats));
+        menu->addChild(statsBtn);
         menu->updateLayout();
     }
+    void onToggleNetStats(CCObject*) {
+        bool show = !Mod::get()->getSavedValue<bool>("show-net-stats", false);
+        Mod::get()->setSavedValue("show-net-stats", show);
+    }
     void onHost(CCObject*) {
+        auto editor = LevelEditorLayer::get();
         std::string levelName = "Unknown Level";
-        if (auto level = LevelEditorLayer::get()->m_level) levelName = level->m_levelName;
-        NetworkManager::get()->startHost(levelName);
+        if (auto level = editor->m_level) levelName = level->m_levelName;
+        NetworkManager::get()->startHost(levelName, editor);
     }
 };
 
 class $modify(MyEditor, LevelEditorLayer) {
+    bool init(GJGameLevel* level, bool noUI) {
+        if (!LevelEditorLayer::init(level, noUI)) return false;
+        NetworkManager::get()->configureBatching(
+            (size_t)Mod::get()->getSettingValue<int64_t>("batch-max-edits"),
+            (float)Mod::get()->getSettingValue<double>("batch-interval")
+        );
+        NetworkManager::get()->setApplyBudget(Mod::get()->getSettingValue<double>("apply-budget-ms"));
+        NetworkManager::get()->setMetricsLog(Mod::get()->getSettingValue<bool>("metrics-log")
+            ? Mod::get()->getSaveDir() / "metrics.jsonl" : std::filesystem::path());
+        this->schedule(schedule_selector(MyEditor::onNetworkTick));
+        return true;
+    }
+
+    void onNetworkTick(float dt) {
+        NetworkManager::get()->tick(dt);
+        updateSyncProgress();
+        updateNetStats();
+        updatePeerCursors();
+    }
+
+    // One label per remote peer at its cursor, in level space so it scrolls with the level.
+    void updatePeerCursors() {
+        if (!m_objectLayer) return;
+        auto container = m_objectLayer->getChildByID("peer-cursors"_spr);
+        if (!container) {
+            container = CCNode::create();
+            container->setID("peer-cursors"_spr);
+            m_objectLayer->addChild(container, 10000);
+        }
+        auto const& peers = NetworkManager::get()->remotePeers();
+        std::vector<CCNode*> stale;
+        for (auto child : CCArrayExt<CCNode*>(container->getChildren())) {
+            auto it = peers.find((uint8_t)child->getTag());
+            if (it == peers.end() || !it->second.state.hasCursor) stale.push_back(child);
+        }
+        for (auto child : stale) child->removeFromParent();
+
+        for (auto const& [peer, remote] : peers) {
+            if (!remote.state.hasCursor) continue;
+            auto label = static_cast<CCLabelBMFont*>(container->getChildByTag(peer));
+            if (!label) {
+                label = CCLabelBMFont::create("", "chatFont.fnt");
+                label->setTag(peer);
+                label->setAnchorPoint({0.f, 1.f});
+                label->setColor({255, 200, 60});
+                container->addChild(label);
+            }
+            std::string text = "P" + std::to_string(peer);
+            if (remote.state.selectionTotal) text += " (" + std::to_string(remote.state.selectionTotal) + ")";
+            label->setString(text.c_str());
+            label->setPosition({remote.state.cursorX, remote.state.cursorY});
+        }
+    }
+
+    // Top-left readout of the session's counters, toggled from the pause menu.
+    void updateNetStats() {
+        auto label = static_cast<CCLabelBMFont*>(this->getChildByID("net-stats"_spr));
+        if (!Mod::get()->getSavedValue<bool>("show-net-stats", false)) {
+            if (label) label->setVisible(false);
+            return;
+        }
+        auto net = NetworkManager::get();
+        if (!label) {
+            label = CCLabelBMFont::create("", "chatFont.fnt");
+            label->setID("net-stats"_spr);
+            label->setScale(0.5f);
+            label->setAnchorPoint({0.f, 1.f});
+            auto winSize = CCDirector::get()->getWinSize();
+            label->setPosition({5, winSize.height - 5});
+            this->addChild(label, 1000);
+            label->setTag(-1);
+        }
+        label->setVisible(true);
+        // The tag remembers which metrics revision is on screen.
+        if ((uint64_t)label->getTag() == net->metricsRevision()) return;
+        label->setTag((int)net->metricsRevision());
+
+        auto const& m = net->metrics();
+        auto const& r = net->rates();
+        char text[512];
+        std::snprintf(text, sizeof(text),
+            "%s peer %u, %zu links, rtt %.1f ms\n"
+            "in %.1f KB/s (%.0f pkt/s)  out %.1f KB/s (%.0f pkt/s)\n"
+            "send queue %zu B (peak %zu B)  decode errors %llu  repaired %llu\n"
+            "inbound %zu  apply %.2f ms (peak %.2f ms)",
+            m.host ? "Host" : "Client", m.localPeer, m.links.size(), m.total.rttMs,
+            r.bytesIn / 1024.0, r.packetsIn, r.bytesOut / 1024.0, r.packetsOut,
+            m.total.queueBytes, m.total.peakQueueBytes, (unsigned long long)m.total.decodeErrors,
+            (unsigned long long)m.total.repairedObjects,
+            m.inboundDepth, m.applyMs, m.applyPeakMs);
+        label->setString(text);
+    }
+
+    // Shows how far the editor is through a backlog of remote edits.
+    void updateSyncProgress() {
+        auto const& stats = NetworkManager::get()->applyStats();
+        auto label = static_cast<CCLabelBMFont*>(this->getChildByID("sync-progress"_spr));
+        if (stats.pending == 0) {
+            if (label) label->setVisible(false);
+            return;
+        }
+        if (!label) {
+            label = CCLabelBMFont::create("", "bigFont.fnt");
+            label->setID("sync-progress"_spr);
+            label->setScale(0.4f);
+            auto winSize = CCDirector::get()->getWinSize();
+            label->setPosition({winSize.width / 2, winSize.height - 20});
+            this->addChild(label, 1000);
+        }
+        size_t total = stats.backlogApplied + stats.pending;
+        int percent = total ? (int)(stats.backlogApplied * 100 / total) : 100;
+        std::string text = "Syncing " + std::to_string(percent) + "% (" + std::to_string(stats.pending) + " left)";
+        label->setString(text.c_str());
+        label->setVisible(true);
+    }
+
     // FIX: createObject is the safe hook for Mac & Win
     GameObject* createObject(int id, CCPoint pos, bool undo) {
         GameObject* obj = LevelEditorLayer::createObject(id, pos, undo);
-        if (obj) {
-            std::stringstream ss;
-            ss << "1," << obj->m_objectID << "," << obj->getPositionX() << "," << obj->getPositionY();
-            NetworkManager::get()->sendPacket(ss.str());
-        }
+        if (obj) NetworkManager::get()->onObjectCreated(obj);
         return obj;
     }
+
+    void removeObject(GameObject* obj, bool noUndo) {
+        NetworkManager::get()->onObjectRemoved(obj);
+        LevelEditorLayer::removeObject(obj, noUndo);
+    }
+
+    // Undo and redo can bring back whole groups at once; they go out as one block. Only
+    // the objects the step holds can come back, so the rest of the level isn't looked at.
+    void undoLastAction() {
+        auto restored = objectsOf(m_undoObjects);
+        NetworkManager::get()->beginBulk();
+        LevelEditorLayer::undoLastAction();
+        NetworkManager::get()->endBulk(restored);
+    }
+
+    void redoLastAction() {
+        auto restored = objectsOf(m_redoObjects);
+        NetworkManager::get()->beginBulk();
+        LevelEditorLayer::redoLastAction();
+        NetworkManager::get()->endBulk(restored);
+    }
+
+    // The objects held by the newest step on an undo or redo stack.
+    static CCArray* objectsOf(CCArray* stack) {
+        auto step = stack ? typeinfo_cast<UndoObject*>(stack->lastObject()) : nullptr;
+        if (!step) return nullptr;
+        auto objects = CCArray::create();
+        if (step->m_objects) objects->addObjectsFromArray(step->m_objects);
+        if (step->m_objectCopy && step->m_objectCopy->m_object) objects->addObject(step->m_objectCopy->m_object);
+        return objects;
+    }
+};
+
+// Paste and duplicate both end up here.
+class $modify(MyEditorUI, EditorUI) {
+    CCArray* pasteObjects(gd::string const& str, bool withColor, bool noUndo) {
+        NetworkManager::get()->beginBulk();
+        auto objects = EditorUI::pasteObjects(str, withColor, noUndo);
+        NetworkManager::get()->endBulk(objects);
+        return objects;
+    }
 };
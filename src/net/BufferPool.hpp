@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace devious {
+
+// Per-thread free lists, so the I/O thread's steady state (a packet made, queued, sent and
+// dropped for every frame it relays) runs without touching the heap once warmed up.
+// Memory freed on a thread goes to that thread's list, whichever thread allocated it, and
+// every list is capped so a burst doesn't pin memory for good.
+namespace pool_detail {
+    // A thread's list is gone once the thread's destructors ran; frees after that (static
+    // objects torn down at exit) go straight to the heap.
+    inline thread_local bool t_listsGone = false;
+
+    // Fixed-size blocks of Size bytes.
+    template <size_t Size, size_t Align>
+    struct BlockList {
+        static constexpr size_t kMaxBlocks = 4096;
+        std::vector<void*> blocks;
+
+        BlockList() { blocks.reserve(kMaxBlocks); }
+        ~BlockList() {
+            for (void* p : blocks) ::operator delete(p, std::align_val_t(Align));
+            t_listsGone = true;
+        }
+
+        static BlockList* local() {
+            if (t_listsGone) return nullptr;
+            thread_local BlockList list;
+            return &list;
+        }
+    };
+
+    // Byte buffers that keep their capacity, up to kMaxBytes of it per thread.
+    struct ByteList {
+        static constexpr size_t kMaxBuffers = 1024;
+        static constexpr size_t kMaxBytes = 8 * 1024 * 1024;
+        static constexpr size_t kMaxBufferCapacity = 256 * 1024;
+        // New buffers start big enough for a typical batch, so reuse rarely has to grow one.
+        static constexpr size_t kInitialCapacity = 2048;
+        std::vector<std::vector<uint8_t>*> buffers;
+        size_t bytes = 0;
+
+        ByteList() { buffers.reserve(kMaxBuffers); }
+        ~ByteList() {
+            for (auto* b : buffers) delete b;
+            t_listsGone = true;
+        }
+
+        static ByteList* local() {
+            if (t_listsGone) return nullptr;
+            thread_local ByteList list;
+            return &list;
+        }
+    };
+
+    inline std::vector<uint8_t>* acquireBytes() {
+        auto list = ByteList::local();
+        if (!list || list->buffers.empty()) {
+            auto* b = new std::vector<uint8_t>();
+            b->reserve(ByteList::kInitialCapacity);
+            return b;
+        }
+        auto* b = list->buffers.back();
+        list->buffers.pop_back();
+        list->bytes -= b->capacity();
+        return b;
+    }
+
+    inline void releaseBytes(std::vector<uint8_t>* b) {
+        auto list = ByteList::local();
+        size_t capacity = b->capacity();
+        if (!list || capacity > ByteList::kMaxBufferCapacity || list->buffers.size() == ByteList::kMaxBuffers || list->bytes + capacity > ByteList::kMaxBytes) {
+            delete b;
+            return;
+        }
+        b->clear();
+        list->bytes += capacity;
+        list->buffers.push_back(b);
+    }
+}
+
+// std::allocator replacement backed by the per-thread block lists. Used for the control
+// blocks of pooled packets; anything but single objects goes to the heap.
+template <class T>
+struct PoolAllocator {
+    using value_type = T;
+    using List = pool_detail::BlockList<sizeof(T), alignof(T)>;
+
+    PoolAllocator() = default;
+    template <class U>
+    PoolAllocator(PoolAllocator<U> const&) {}
+
+    T* allocate(size_t n) {
+        if (n == 1) {
+            auto list = List::local();
+            if (list && !list->blocks.empty()) {
+                void* p = list->blocks.back();
+                list->blocks.pop_back();
+                return static_cast<T*>(p);
+            }
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(alignof(T))));
+    }
+
+    void deallocate(T* p, size_t n) {
+        auto list = n == 1 ? List::local() : nullptr;
+        if (list && list->blocks.size() < List::kMaxBlocks) list->blocks.push_back(p);
+        else ::operator delete(p, std::align_val_t(alignof(T)));
+    }
+
+    template <class U>
+    bool operator==(PoolAllocator<U> const&) const { return true; }
+};
+
+} // namespace devious
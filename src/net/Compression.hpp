@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+// Small LZ77 block codec in the spirit of LZ4: fast enough to run on the I/O thread
+// for every late-join snapshot chunk, and dependency-free so the same code builds in
+// the mod and in headless tools.
+//
+//   sequence := token [litLen+] literals [u16 offset [matchLen+]]
+//   token    := (min(litLen, 15) << 4) | min(matchLen - 4, 15)
+//
+// Lengths of 15 or more continue in extra bytes of 255 until a smaller byte. The last
+// sequence has literals only.
+
+namespace devious {
+
+namespace detail {
+    inline uint32_t read32(const uint8_t* p) { uint32_t v; std::memcpy(&v, p, 4); return v; }
+
+    inline void writeLength(std::vector<uint8_t>& out, size_t len) {
+        while (len >= 255) { out.push_back(255); len -= 255; }
+        out.push_back(uint8_t(len));
+    }
+
+    inline bool readLength(const uint8_t*& ip, const uint8_t* end, size_t& len) {
+        uint8_t b;
+        do {
+            if (ip >= end) return false;
+            b = *ip++;
+            len += b;
+        } while (b == 255);
+        return true;
+    }
+}
+
+inline void lzCompress(std::span<const uint8_t> in, std::vector<uint8_t>& out) {
+    constexpr int kHashBits = 14;
+    constexpr size_t kMinMatch = 4;
+    thread_local std::vector<uint32_t> table(1u << kHashBits);
+    std::fill(table.begin(), table.end(), 0);
+
+    const uint8_t* src = in.data();
+    const size_t n = in.size();
+    size_t anchor = 0;
+    size_t i = 0;
+
+    auto emit = [&](size_t litEnd, size_t offset, size_t matchLen) {
+        size_t litLen = litEnd - anchor;
+        uint8_t token = uint8_t((litLen < 15 ? litLen : 15) << 4);
+        if (matchLen) token |= uint8_t(matchLen - kMinMatch < 15 ? matchLen - kMinMatch : 15);
+        out.push_back(token);
+        if (litLen >= 15) detail::writeLength(out, litLen - 15);
+        out.insert(out.end(), src + anchor, src + litEnd);
+        if (!matchLen) return;
+        out.push_back(uint8_t(offset));
+        out.push_back(uint8_t(offset >> 8));
+        if (matchLen - kMinMatch >= 15) detail::writeLength(out, matchLen - kMinMatch - 15);
+    };
+
+    while (n >= kMinMatch && i + kMinMatch <= n) {
+        uint32_t seq = detail::read32(src + i);
+        uint32_t h = (seq * 2654435761u) >> (32 - kHashBits);
+        uint32_t candidate = table[h];
+        table[h] = uint32_t(i + 1);
+        if (candidate && i - (candidate - 1) <= 0xFFFF && detail::read32(src + candidate - 1) == seq) {
+            size_t match = candidate - 1;
+            size_t len = kMinMatch;
+            while (i + len < n && src[match + len] == src[i + len]) ++len;
+            emit(i, i - match, len);
+            i += len;
+            anchor = i;
+        }
+        else ++i;
+    }
+    emit(n, 0, 0);
+}
+
+// Decompresses into `out`, which must be exactly the original size. Returns false on
+// malformed input instead of reading or writing out of bounds.
+inline bool lzDecompress(std::span<const uint8_t> in, std::span<uint8_t> out) {
+    const uint8_t* ip = in.data();
+    const uint8_t* end = ip + in.size();
+    uint8_t* op = out.data();
+    uint8_t* outEnd = op + out.size();
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t litLen = token >> 4;
+        if (litLen == 15 && !detail::readLength(ip, end, litLen)) return false;
+        if (size_t(end - ip) < litLen || size_t(outEnd - op) < litLen) return false;
+        std::memcpy(op, ip, litLen);
+        ip += litLen;
+        op += litLen;
+        if (ip == end) break;
+
+        if (end - ip < 2) return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !detail::readLength(ip, end, matchLen)) return false;
+        matchLen += 4;
+        if (offset == 0 || offset > size_t(op - out.data()) || size_t(outEnd - op) < matchLen) return false;
+        const uint8_t* match = op - offset;
+        for (size_t k = 0; k < matchLen; ++k) op[k] = match[k]; // may overlap
+        op += matchLen;
+    }
+    return op == outEnd;
+}
+
+// Groups byte k of every `width`-byte element together. Columns of similar numbers
+// (ids, coordinates) turn into long runs that the LZ stage compresses far better.
+inline void byteShuffle(std::span<const uint8_t> in, std::span<uint8_t> out, size_t width) {
+    size_t count = in.size() / width;
+    for (size_t i = 0; i < count; ++i)
+        for (size_t b = 0; b < width; ++b) out[b * count + i] = in[i * width + b];
+}
+
+inline void byteUnshuffle(std::span<const uint8_t> in, std::span<uint8_t> out, size_t width) {
+    size_t count = in.size() / width;
+    for (size_t i = 0; i < count; ++i)
+        for (size_t b = 0; b < width; ++b) out[i * width + b] = in[b * count + i];
+}
+
+} // namespace devious
@@ -0,0 +1,391 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include "Protocol.hpp"
+
+namespace devious {
+
+// LAN discovery runs next to the session on its own UDP port, outside the frame protocol:
+//
+//   query  := "DVLQ" | u16 protocol version
+//   beacon := "DVLB" | u16 protocol version | u16 session port | u16 players | u32 objects
+//             | u16 ttl ms | u8 name length | name | u8 session id length | session id
+//   probe  := "DVLP" | u16 protocol version | u64 sent us
+//   echo   := "DVLE" | u16 protocol version | u64 sent us | u64 received us | u64 replied us
+//
+// Hosts broadcast a beacon every kBeaconInterval and answer a query at once, straight to
+// where it came from. A browser broadcasts a query when it starts searching, so hosts
+// show up after one round trip instead of at their next beacon. An entry lives for the
+// TTL its host advertised, so a host that goes away drops out of every list on its own.
+// A host serving several sessions on one port beacons (and answers) once per session.
+//
+// While searching, the browser also probes every listed server each kProbeInterval, all
+// at once. Probes go to the session port, whose UDP socket belongs to that host alone;
+// the echo adds the host's clock on arrival and departure, which gives the round trip
+// and the offset between the two clocks.
+constexpr uint32_t kDiscoveryQueryMagic = 0x514C5644;  // "DVLQ"
+constexpr uint32_t kDiscoveryBeaconMagic = 0x424C5644; // "DVLB"
+constexpr uint32_t kProbeMagic = 0x504C5644;           // "DVLP"
+constexpr uint32_t kProbeEchoMagic = 0x454C5644;       // "DVLE"
+constexpr auto kProbeInterval = std::chrono::seconds(1);
+// A server that leaves this many probes in a row unanswered is shown as not replying.
+constexpr uint32_t kMaxUnansweredProbes = 3;
+constexpr auto kBeaconInterval = std::chrono::seconds(1);
+constexpr uint16_t kBeaconTtlMs = 3500;
+constexpr size_t kMaxServerName = 64;
+// A server remembered from the last run is listed this long unless it answers the query.
+constexpr auto kRememberedTtl = std::chrono::milliseconds(1500);
+// A host answers at most this many queries per beacon interval.
+constexpr uint32_t kMaxQueryAnswers = 64;
+
+struct ServerInfo {
+    std::string ip;
+    std::string session;
+    std::string name;
+    uint16_t port = 0;
+    uint16_t players = 0;
+    uint32_t objects = 0;
+    uint16_t version = 0;
+    // Known from an earlier run and not heard from yet.
+    bool cached = false;
+    // Measured by probing: smoothed round trip (-1 until an echo arrives, or once probes
+    // go unanswered) and how far the host's clock is ahead of ours.
+    double rttMs = -1.0;
+    int64_t clockOffsetUs = 0;
+
+    bool compatible() const { return version == kProtocolVersion; }
+    bool reachable() const { return rttMs >= 0.0; }
+    // Identifies the entry in a server list.
+    std::string key() const { return session.empty() ? ip : ip + "/" + session; }
+    bool operator==(ServerInfo const&) const = default;
+};
+
+struct DiscoveryQuery {
+    static bool read(PacketReader& r) {
+        uint32_t magic = r.u32();
+        r.u16();
+        return r.ok() && magic == kDiscoveryQueryMagic;
+    }
+
+    static void write(PacketWriter& w) {
+        w.u32(kDiscoveryQueryMagic);
+        w.u16(kProtocolVersion);
+    }
+};
+
+struct DiscoveryBeacon {
+    ServerInfo server;  // everything but ip, which is the sender's address
+    uint16_t ttlMs = kBeaconTtlMs;
+
+    void write(PacketWriter& w) const {
+        auto name = std::string_view(server.name).substr(0, kMaxServerName);
+        auto session = std::string_view(server.session).substr(0, kMaxSessionId);
+        w.u32(kDiscoveryBeaconMagic);
+        w.u16(server.version);
+        w.u16(server.port);
+        w.u16(server.players);
+        w.u32(server.objects);
+        w.u16(ttlMs);
+        w.u8(uint8_t(name.size()));
+        w.bytes((uint8_t const*)name.data(), name.size());
+        w.u8(uint8_t(session.size()));
+        w.bytes((uint8_t const*)session.data(), session.size());
+    }
+
+    static bool read(PacketReader& r, DiscoveryBeacon& out) {
+        if (r.u32() != kDiscoveryBeaconMagic) return false;
+        out.server.version = r.u16();
+        out.server.port = r.u16();
+        out.server.players = r.u16();
+        out.server.objects = r.u32();
+        out.ttlMs = r.u16();
+        auto name = r.bytes(r.u8());
+        out.server.name.assign((char const*)name.data(), name.size());
+        out.server.session.clear();
+        if (r.ok() && !r.atEnd()) {
+            auto session = r.bytes(r.u8());
+            out.server.session.assign((char const*)session.data(), session.size());
+        }
+        return r.ok();
+    }
+};
+
+struct DiscoveryProbe {
+    uint64_t sentUs = 0;
+
+    void write(PacketWriter& w) const {
+        w.u32(kProbeMagic);
+        w.u16(kProtocolVersion);
+        w.u64(sentUs);
+    }
+
+    static bool read(PacketReader& r, DiscoveryProbe& out) {
+        if (r.u32() != kProbeMagic) return false;
+        r.u16();
+        out.sentUs = r.u64();
+        return r.ok();
+    }
+};
+
+struct DiscoveryEcho {
+    uint64_t sentUs = 0;      // the prober's clock
+    uint64_t receivedUs = 0;  // the host's
+    uint64_t repliedUs = 0;   // the host's
+
+    void write(PacketWriter& w) const {
+        w.u32(kProbeEchoMagic);
+        w.u16(kProtocolVersion);
+        w.u64(sentUs);
+        w.u64(receivedUs);
+        w.u64(repliedUs);
+    }
+
+    static bool read(PacketReader& r, DiscoveryEcho& out) {
+        if (r.u32() != kProbeEchoMagic) return false;
+        r.u16();
+        out.sentUs = r.u64();
+        out.receivedUs = r.u64();
+        out.repliedUs = r.u64();
+        return r.ok();
+    }
+
+    // The round trip minus the time the host held the probe, and the host's clock minus
+    // ours assuming both directions took as long, given when the echo arrived.
+    double rttMs(uint64_t arrivedUs) const {
+        int64_t held = int64_t(repliedUs - receivedUs);
+        return double(std::max<int64_t>(int64_t(arrivedUs - sentUs) - held, 0)) / 1000.0;
+    }
+    int64_t clockOffsetUs(uint64_t arrivedUs) const {
+        return (int64_t(receivedUs - sentUs) + int64_t(repliedUs - arrivedUs)) / 2;
+    }
+};
+
+enum class ServerChangeKind : uint8_t {
+    // Forget every row; Added entries for the whole list follow.
+    Reset,
+    Added,
+    Updated,
+    Removed,
+};
+
+struct ServerChange {
+    ServerChangeKind kind = ServerChangeKind::Added;
+    ServerInfo server;
+};
+
+// The servers a browser can see, by address and session, with a versioned log of what changed so a
+// UI only touches the rows that did. Not thread-safe; the engine guards it.
+class ServerDirectory {
+    using Clock = std::chrono::steady_clock;
+    static constexpr size_t kMaxChanges = 256;
+
+    struct Entry {
+        ServerInfo info;
+        Clock::time_point expires;
+        uint32_t unanswered = 0;  // probes sent since the last echo
+    };
+
+    std::map<std::string, Entry> m_servers;
+    std::deque<ServerChange> m_changes;  // the last kMaxChanges, ending at m_version
+    uint64_t m_version = 0;
+    bool m_cacheDirty = false;
+
+    void record(ServerChangeKind kind, ServerInfo const& server) {
+        m_changes.push_back({kind, server});
+        if (m_changes.size() > kMaxChanges) m_changes.pop_front();
+        m_version++;
+    }
+
+    void smooth(Entry& entry, double rttMs, int64_t clockOffsetUs) {
+        auto& info = entry.info;
+        entry.unanswered = 0;
+        long shown = info.reachable() ? std::lround(info.rttMs) : -1;
+        if (!info.reachable()) {
+            info.rttMs = rttMs;
+            info.clockOffsetUs = clockOffsetUs;
+        }
+        else {
+            if (rttMs <= info.rttMs) info.clockOffsetUs = clockOffsetUs;
+            info.rttMs += (rttMs - info.rttMs) / 8.0;
+        }
+        // The list shows whole milliseconds; finer changes would only churn its rows.
+        if (std::lround(info.rttMs) != shown) record(ServerChangeKind::Updated, info);
+    }
+
+public:
+    uint64_t version() const { return m_version; }
+
+    // A beacon or an answer to a query.
+    void seen(ServerInfo const& info, Clock::time_point expires) {
+        auto [it, added] = m_servers.try_emplace(info.key(), Entry{info, expires});
+        auto& entry = it->second;
+        entry.expires = std::max(entry.expires, expires);
+        if (added) {
+            record(ServerChangeKind::Added, info);
+            m_cacheDirty = true;
+            return;
+        }
+        // Beacons know nothing of what probing measured.
+        ServerInfo merged = info;
+        merged.rttMs = entry.info.rttMs;
+        merged.clockOffsetUs = entry.info.clockOffsetUs;
+        if (entry.info == merged) return;
+        if (entry.info.cached || entry.info.name != info.name || entry.info.port != info.port) m_cacheDirty = true;
+        entry.info = merged;
+        record(ServerChangeKind::Updated, merged);
+    }
+
+    // A probe is about to go out to every listed server: appends them to `out`, once per
+    // address and port. Servers that left too many probes unanswered lose their round trip.
+    void probing(std::vector<ServerInfo>& out) {
+        size_t first = out.size();
+        for (auto& [key, entry] : m_servers) {
+            bool probed = std::any_of(out.begin() + ptrdiff_t(first), out.end(), [&](ServerInfo const& s) {
+                return s.ip == entry.info.ip && s.port == entry.info.port;
+            });
+            if (!probed) out.push_back(entry.info);
+            if (++entry.unanswered <= kMaxUnansweredProbes || !entry.info.reachable()) continue;
+            entry.info.rttMs = -1.0;
+            record(ServerChangeKind::Updated, entry.info);
+        }
+    }
+
+    // An echo from `ip`, for every session there. The round trip is smoothed like TCP's;
+    // the clock offset is taken from samples no slower than that, since a slow one was
+    // held up one way or the other.
+    void measured(std::string const& ip, double rttMs, int64_t clockOffsetUs) {
+        for (auto& [key, entry] : m_servers) {
+            if (entry.info.ip == ip) smooth(entry, rttMs, clockOffsetUs);
+        }
+    }
+
+    // A server remembered from an earlier run. Shown until `expires` unless it answers.
+    void remembered(ServerInfo info, Clock::time_point expires) {
+        info.cached = true;
+        if (m_servers.try_emplace(info.key(), Entry{info, expires}).second) record(ServerChangeKind::Added, info);
+    }
+
+    void expire(Clock::time_point now) {
+        for (auto it = m_servers.begin(); it != m_servers.end();) {
+            if (it->second.expires > now) { ++it; continue; }
+            if (!it->second.info.cached) m_cacheDirty = true;
+            record(ServerChangeKind::Removed, it->second.info);
+            it = m_servers.erase(it);
+        }
+    }
+
+    Clock::time_point nextExpiry() const {
+        auto next = Clock::time_point::max();
+        for (auto const& [key, entry] : m_servers) next = std::min(next, entry.expires);
+        return next;
+    }
+
+    // Appends what changed after version `since` to `out` and returns the version that
+    // brings the caller to. A caller too far behind the log gets a Reset and the whole list.
+    uint64_t changesSince(uint64_t since, std::vector<ServerChange>& out) const {
+        if (since == m_version) return m_version;
+        if (since < m_version && m_version - since <= m_changes.size()) {
+            out.insert(out.end(), m_changes.end() - ptrdiff_t(m_version - since), m_changes.end());
+            return m_version;
+        }
+        out.push_back({ServerChangeKind::Reset, {}});
+        for (auto const& [key, entry] : m_servers) out.push_back({ServerChangeKind::Added, entry.info});
+        return m_version;
+    }
+
+    std::vector<ServerInfo> list() const {
+        std::vector<ServerInfo> out;
+        for (auto const& [key, entry] : m_servers) out.push_back(entry.info);
+        return out;
+    }
+
+    // True once after the set of live servers (or what the cache keeps of them) changed.
+    bool takeCacheDirty() { return std::exchange(m_cacheDirty, false); }
+};
+
+// Servers seen live are kept on disk, so the next browser lists them before anyone has
+// answered. The file is "DVSC" | u16 format version | u16 count, then per server:
+// u8 ip length | ip | u16 port | u8 name length | name | u8 session id length | session id.
+// Version 1 files have no session ids.
+constexpr uint32_t kServerCacheMagic = 0x43535644; // "DVSC"
+constexpr uint16_t kServerCacheVersion = 2;
+constexpr size_t kMaxCachedServers = 32;
+
+inline std::vector<ServerInfo> loadServerCache(std::filesystem::path const& path) {
+    std::vector<ServerInfo> servers;
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return servers;
+    std::vector<uint8_t> bytes{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+    PacketReader r(bytes);
+    uint32_t magic = r.u32();
+    uint16_t version = r.u16();
+    uint16_t count = r.u16();
+    if (!r.ok() || magic != kServerCacheMagic || version == 0 || version > kServerCacheVersion) return servers;
+    for (uint16_t i = 0; i < count && i < kMaxCachedServers; ++i) {
+        ServerInfo s;
+        auto ip = r.bytes(r.u8());
+        s.ip.assign((char const*)ip.data(), ip.size());
+        s.port = r.u16();
+        auto name = r.bytes(r.u8());
+        s.name.assign((char const*)name.data(), name.size());
+        if (version >= 2) {
+            auto session = r.bytes(r.u8());
+            s.session.assign((char const*)session.data(), session.size());
+        }
+        if (!r.ok()) break;
+        servers.push_back(std::move(s));
+    }
+    return servers;
+}
+
+// Saves the live servers in `servers`. Written through a temporary file like a level.
+inline bool saveServerCache(std::filesystem::path const& path, std::vector<ServerInfo> const& servers) {
+    std::vector<uint8_t> bytes;
+    PacketWriter w(bytes);
+    w.u32(kServerCacheMagic);
+    w.u16(kServerCacheVersion);
+    w.u16(0);
+    uint16_t count = 0;
+    for (auto const& s : servers) {
+        if (s.cached || count == kMaxCachedServers) continue;
+        auto name = std::string_view(s.name).substr(0, kMaxServerName);
+        auto session = std::string_view(s.session).substr(0, kMaxSessionId);
+        w.u8(uint8_t(s.ip.size()));
+        w.bytes((uint8_t const*)s.ip.data(), s.ip.size());
+        w.u16(s.port);
+        w.u8(uint8_t(name.size()));
+        w.bytes((uint8_t const*)name.data(), name.size());
+        w.u8(uint8_t(session.size()));
+        w.bytes((uint8_t const*)session.data(), session.size());
+        count++;
+    }
+    PacketWriter::store32(bytes.data() + 4, kServerCacheVersion | (uint32_t(count) << 16));
+
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        out.write((char const*)bytes.data(), (std::streamsize)bytes.size());
+        if (!out.flush()) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
+
+} // namespace devious
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "FlatMap.hpp"
+#include "Protocol.hpp"
+#include "TransformBlock.hpp"
+
+namespace devious {
+
+struct BatchStats {
+    uint64_t editsQueued = 0;
+    uint64_t editsCoalesced = 0;
+    uint64_t batchesSent = 0;
+    uint64_t bytesSent = 0;
+};
+
+// Collects outgoing edits on the editor thread and turns them into one Batch frame.
+// Edits are keyed by the object they touch; a newer edit for a key that is already
+// queued replaces it in place, so only the latest state of each object goes out.
+template <class Op>
+class EditBatcher {
+    struct Entry {
+        uint64_t key;
+        Op op;
+    };
+
+    std::vector<Entry> m_entries;
+    FlatMap<uint64_t, uint32_t> m_slots;  // keys are never 0: they hold a net id
+    uint16_t m_coalesced = 0;
+    float m_sinceFlush = 0.f;
+    BatchStats m_stats;
+
+public:
+    // A batch is flushed when it holds maxEdits entries or `interval` seconds have
+    // passed since the last flush. An interval of 0 flushes every frame.
+    size_t maxEdits = 256;
+    float interval = 0.f;
+
+    void push(uint64_t key, Op const& op) {
+        m_stats.editsQueued++;
+        if (auto slot = m_slots.find(key)) {
+            m_entries[*slot].op = op;
+            m_stats.editsCoalesced++;
+            if (m_coalesced < UINT16_MAX) m_coalesced++;
+            return;
+        }
+        m_slots.insert(key, (uint32_t)m_entries.size());
+        m_entries.push_back({key, op});
+    }
+
+    bool empty() const { return m_entries.empty(); }
+    size_t size() const { return m_entries.size(); }
+    bool full() const { return m_entries.size() >= maxEdits; }
+
+    // Advances the flush timer; returns true when the queued edits should go out.
+    bool tick(float dt) {
+        m_sinceFlush += dt;
+        return !empty() && (full() || m_sinceFlush >= interval);
+    }
+
+    template <class F>
+    void forEach(F&& fn) const {
+        for (auto const& entry : m_entries) fn(entry.op);
+    }
+
+    // Appends one Batch frame with every queued edit to `out`, all under `stamp`, and
+    // resets the queue. Enough transforms to make it worth it are packed into
+    // TransformBlocks after the batch, so they still follow a create of the same object;
+    // each of those is passed to onQuantized(TransformObjectMsg const&) as it will arrive.
+    void flush(std::vector<uint8_t>& out, uint64_t stamp) {
+        flush(out, stamp, [](TransformObjectMsg const&) {});
+    }
+
+    template <class F>
+    void flush(std::vector<uint8_t>& out, uint64_t stamp, F&& onQuantized) {
+        m_sinceFlush = 0.f;
+        if (m_entries.empty()) return;
+        size_t start = out.size();
+        thread_local std::vector<TransformObjectMsg> transforms;
+        transforms.clear();
+        if constexpr (std::is_same_v<Op, EditOp>) {
+            auto isTransform = [](Entry const& e) { return std::holds_alternative<TransformObjectMsg>(e.op.msg); };
+            if ((size_t)std::count_if(m_entries.begin(), m_entries.end(), isTransform) >= kMinTransformBlock) {
+                for (auto const& e : m_entries) if (isTransform(e)) transforms.push_back(std::get<TransformObjectMsg>(e.op.msg));
+                std::erase_if(m_entries, isTransform);
+            }
+        }
+        PacketWriter w(out);
+        size_t i = 0;
+        while (i < m_entries.size()) {
+            // Large bursts are split so a single frame never exceeds the payload limit.
+            size_t end = std::min(m_entries.size(), i + kMaxBatchRecords);
+            BatchHeader{uint16_t(end - i), m_coalesced, stamp}.write(w);
+            for (; i < end; ++i) m_entries[i].op.writeRecord(w);
+            w.finish();
+            m_coalesced = 0;
+            m_stats.batchesSent++;
+        }
+        if (!transforms.empty()) {
+            writeTransformBlocks(transforms, stamp, out);
+            for (auto const& t : transforms) onQuantized(quantized(t));
+            m_stats.batchesSent += (transforms.size() + kMaxTransformBlock - 1) / kMaxTransformBlock;
+        }
+        m_stats.bytesSent += out.size() - start;
+        m_entries.clear();
+        m_slots.clear();
+    }
+
+    BatchStats const& stats() const { return m_stats; }
+};
+
+} // namespace devious
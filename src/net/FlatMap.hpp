@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+namespace devious {
+
+// Open-addressing hash map for integer (or pointer-sized) keys with linear probing
+// and backward-shift deletion, so lookups stay a few cache lines even on 100k-object
+// levels and erasing never leaves tombstones behind. Key 0 marks an empty slot and
+// cannot be stored.
+template <class K, class V>
+class FlatMap {
+    static_assert(std::is_integral_v<K>, "FlatMap keys must be integers");
+
+    struct Slot {
+        K key = 0;
+        V value{};
+    };
+
+    std::vector<Slot> m_slots;
+    size_t m_size = 0;
+    size_t m_mask = 0;
+
+    size_t home(K key) const {
+        uint64_t h = uint64_t(key) * 0x9E3779B97F4A7C15ull;
+        return size_t(h ^ (h >> 32)) & m_mask;
+    }
+
+    void rehash(size_t capacity) {
+        std::vector<Slot> old;
+        old.swap(m_slots);
+        m_slots.resize(capacity);
+        m_mask = capacity - 1;
+        m_size = 0;
+        for (auto& slot : old) if (slot.key) insert(slot.key, std::move(slot.value));
+    }
+
+public:
+    FlatMap() { rehash(16); }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    void clear() {
+        for (auto& slot : m_slots) slot = Slot{};
+        m_size = 0;
+    }
+
+    void reserve(size_t count) {
+        size_t capacity = m_slots.size();
+        while (count * 10 > capacity * 7) capacity <<= 1;
+        if (capacity != m_slots.size()) rehash(capacity);
+    }
+
+    V* find(K key) {
+        for (size_t i = home(key);; i = (i + 1) & m_mask) {
+            if (m_slots[i].key == key) return &m_slots[i].value;
+            if (m_slots[i].key == 0) return nullptr;
+        }
+    }
+
+    V const* find(K key) const { return const_cast<FlatMap*>(this)->find(key); }
+
+    bool contains(K key) const { return find(key) != nullptr; }
+
+    // Inserts or overwrites; returns the stored value.
+    V& insert(K key, V value) {
+        if ((m_size + 1) * 10 > m_slots.size() * 7) rehash(m_slots.size() * 2);
+        size_t i = home(key);
+        while (m_slots[i].key != 0 && m_slots[i].key != key) i = (i + 1) & m_mask;
+        if (m_slots[i].key == 0) {
+            m_slots[i].key = key;
+            m_size++;
+        }
+        m_slots[i].value = std::move(value);
+        return m_slots[i].value;
+    }
+
+    bool erase(K key) {
+        size_t i = home(key);
+        while (m_slots[i].key != key) {
+            if (m_slots[i].key == 0) return false;
+            i = (i + 1) & m_mask;
+        }
+        // Pull later entries of the probe chain back so no lookup ever hits a hole early.
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & m_mask;
+            if (m_slots[j].key == 0) break;
+            size_t k = home(m_slots[j].key);
+            bool between = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+            if (!between) {
+                m_slots[i] = std::move(m_slots[j]);
+                i = j;
+            }
+        }
+        m_slots[i] = Slot{};
+        m_size--;
+        return true;
+    }
+
+    template <class F>
+    void forEach(F&& fn) {
+        for (auto& slot : m_slots) if (slot.key) fn(slot.key, slot.value);
+    }
+};
+
+} // namespace devious
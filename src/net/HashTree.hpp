@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "Protocol.hpp"
+
+namespace devious {
+
+// A fixed 16-ary tree over kTreeLeaves buckets; every grid cell of the level hashes to
+// one bucket. Each object hashes to 64 bits (record and stamps) and every node holds the
+// wrapping sum of the hashes of all objects below it. A sum instead of a hash of the
+// children keeps updates O(depth): changing an object adds the difference to its leaf and
+// the three nodes above it. Peers holding the same objects agree on every node, and where
+// they don't, comparing children narrows it down to the buckets that differ.
+constexpr uint32_t kTreeFanoutBits = 4;
+constexpr uint8_t kTreeDepth = 3;  // levels below the root; leaves are level kTreeDepth
+constexpr uint32_t kTreeLeaves = 1u << (kTreeFanoutBits * kTreeDepth);
+// Queried below the leaves: the objects in them, one hash each.
+constexpr uint8_t kTreeObjectLevel = kTreeDepth + 1;
+
+constexpr uint32_t treeLevelSize(uint8_t level) { return 1u << (kTreeFanoutBits * level); }
+constexpr uint32_t treeLevelOffset(uint8_t level) { return (treeLevelSize(level) - 1) / ((1u << kTreeFanoutBits) - 1); }
+
+inline uint64_t mix64(uint64_t h) {
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBull;
+    return h ^ (h >> 31);
+}
+
+// The bucket of a SpatialGrid cell key.
+inline uint32_t treeLeaf(uint64_t cellKey) { return uint32_t(mix64(cellKey) >> (64 - kTreeFanoutBits * kTreeDepth)); }
+
+inline uint64_t objectHash(ObjectRecord const& r, ObjectStamps const& stamps) {
+    auto bits = [](float v) { uint32_t u; std::memcpy(&u, &v, 4); return u; };
+    uint64_t h = mix64(r.netId);
+    h = mix64(h ^ (uint64_t(uint32_t(r.objectId)) << 32 | bits(r.x)));
+    h = mix64(h ^ (uint64_t(bits(r.y)) << 32 | bits(r.rotation)));
+    h = mix64(h ^ (uint64_t(bits(r.scaleX)) << 32 | bits(r.scaleY)));
+    for (size_t p = 0; p < size_t(ObjectProperty::Count); p += 2) {
+        h = mix64(h ^ (uint64_t(uint32_t(r.properties[p])) << 32 | uint32_t(r.properties[p + 1])));
+    }
+    for (uint64_t part : stamps.parts) h = mix64(h ^ part);
+    return h;
+}
+
+class HashTree {
+    std::vector<uint64_t> m_nodes = std::vector<uint64_t>(treeLevelOffset(kTreeDepth + 1));
+
+    void update(uint32_t leaf, uint64_t delta) {
+        for (uint8_t level = 0; level <= kTreeDepth; ++level) {
+            m_nodes[treeLevelOffset(level) + (leaf >> (kTreeFanoutBits * (kTreeDepth - level)))] += delta;
+        }
+    }
+
+public:
+    void clear() { std::fill(m_nodes.begin(), m_nodes.end(), 0); }
+
+    void add(uint32_t leaf, uint64_t hash) { update(leaf, hash); }
+    void remove(uint32_t leaf, uint64_t hash) { update(leaf, 0 - hash); }
+
+    uint64_t root() const { return m_nodes[0]; }
+    uint64_t node(uint8_t level, uint32_t index) const { return m_nodes[treeLevelOffset(level) + index]; }
+};
+
+} // namespace devious
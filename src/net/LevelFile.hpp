@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <system_error>
+#include <vector>
+#include "Protocol.hpp"
+#include "Snapshot.hpp"
+
+namespace devious {
+
+// A level saved to disk is a snapshot as it goes over the wire: an 8-byte file header
+// ("DVLV", u16 format version, u16 reserved) followed by the same compressed
+// SnapshotChunk frames a late joiner receives. Version 2 chunks carry LWW stamps.
+constexpr uint32_t kLevelFileMagic = 0x564C5644; // "DVLV"
+constexpr uint16_t kLevelFileVersion = 2;
+
+// Writes to a temporary file and renames it over `path`, so a crash mid-save never
+// leaves a truncated level behind.
+inline bool saveLevelFile(std::filesystem::path const& path, Snapshot& snapshot) {
+    auto tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out) return false;
+        std::vector<uint8_t> header;
+        PacketWriter w(header);
+        w.u32(kLevelFileMagic);
+        w.u16(kLevelFileVersion);
+        w.u16(0);
+        out.write((char const*)header.data(), (std::streamsize)header.size());
+        for (uint16_t i = 0; i < snapshot.chunkCount(); ++i) {
+            auto const& frame = *snapshot.chunkFrame(i);
+            out.write((char const*)frame.data(), (std::streamsize)frame.size());
+        }
+        if (!out.flush()) return false;
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
+
+// Appends the saved records to `out` and their stamps to `stamps`. Returns false if the
+// file is missing or damaged.
+inline bool loadLevelFile(std::filesystem::path const& path, std::vector<ObjectRecord>& out, std::vector<ObjectStamps>& stamps) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::vector<uint8_t> bytes{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+
+    PacketReader header(bytes);
+    uint32_t magic = header.u32();
+    uint16_t version = header.u16();
+    header.u16();
+    if (!header.ok() || magic != kLevelFileMagic || version != kLevelFileVersion) return false;
+
+    bool ok = true;
+    size_t consumed = 8;
+    forEachFrame(std::span<const uint8_t>(bytes).subspan(8), [&](Frame const& frame) {
+        consumed += frame.bytes.size();
+        if (!ok || frame.type != MsgType::SnapshotChunk) return;
+        PacketReader reader(frame.payload);
+        SnapshotChunkHeader chunk;
+        ok = SnapshotChunkHeader::read(reader, chunk) && decodeSnapshotChunk(chunk, reader.rest(), out, stamps);
+    });
+    return ok && consumed == bytes.size();
+}
+
+} // namespace devious
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <bitset>
+#include <cstdint>
+#include <vector>
+#include "FlatMap.hpp"
+#include "HashTree.hpp"
+#include "Lww.hpp"
+#include "Protocol.hpp"
+#include "SpatialGrid.hpp"
+
+namespace devious {
+
+// Every synced object as the session stream has it, kept on the I/O thread: the host's
+// copy serves late joiners without touching the editor, and a client's mirror is what
+// gets compared against it. Records live in a dense array (cheap to copy into a snapshot)
+// indexed by net id through a FlatMap, with their LWW stamps alongside. `version` changes
+// on every mutation, which tells whether a cached snapshot is still current. A SpatialGrid
+// files every record by position so interest management can ask what lies inside a
+// viewport, and a HashTree over the same cells summarises the whole state for
+// verification. Deleted ids are remembered so a stale record can't bring them back.
+class LevelState {
+    std::vector<ObjectRecord> m_objects;
+    std::vector<ObjectStamps> m_stamps;
+    FlatMap<uint32_t, uint32_t> m_index;
+    FlatMap<uint32_t, uint8_t> m_deleted;
+    SpatialGrid m_grid;
+    HashTree m_tree;
+    uint64_t m_version = 0;
+
+public:
+    // Without stamps every part starts at 0, older than any edit.
+    void reset(std::vector<ObjectRecord> objects, std::vector<ObjectStamps> stamps = {}) {
+        m_objects = std::move(objects);
+        m_stamps = std::move(stamps);
+        m_stamps.resize(m_objects.size());
+        m_index.clear();
+        m_index.reserve(m_objects.size());
+        m_deleted.clear();
+        m_grid.clear();
+        m_tree.clear();
+        for (uint32_t i = 0; i < m_objects.size(); ++i) {
+            m_index.insert(m_objects[i].netId, i);
+            m_grid.insert(m_objects[i].netId, m_objects[i].x, m_objects[i].y);
+            hashIn(i);
+        }
+        m_version++;
+    }
+
+    ObjectRecord const* find(uint32_t netId) const {
+        auto i = m_index.find(netId);
+        return i ? &m_objects[*i] : nullptr;
+    }
+
+    ObjectStamps const* stamps(uint32_t netId) const {
+        auto i = m_index.find(netId);
+        return i ? &m_stamps[*i] : nullptr;
+    }
+
+    // Merges an edit by its stamps; returns false if it changed nothing (unknown object,
+    // or every part it writes already has a newer edit).
+    bool apply(EditOp const& op) {
+        bool applied = false;
+        if (auto block = std::get_if<ObjectBlockMsg>(&op.msg)) {
+            for (auto const& record : block->block->records) applied |= applyEdit({CreateObjectMsg{record}, op.stamp});
+        }
+        else applied = applyEdit(op);
+        if (applied) m_version++;
+        return applied;
+    }
+
+    std::vector<ObjectRecord> const& objects() const { return m_objects; }
+    std::vector<ObjectStamps> const& objectStamps() const { return m_stamps; }
+    SpatialGrid const& grid() const { return m_grid; }
+    HashTree const& tree() const { return m_tree; }
+    size_t size() const { return m_objects.size(); }
+    uint64_t version() const { return m_version; }
+
+    // Calls fn(record, stamps) for every object in one of the `leaves` buckets.
+    template <class F>
+    void forEachInLeaves(std::bitset<kTreeLeaves> const& leaves, F&& fn) const {
+        m_grid.forEachCell([&](uint64_t cellKey, std::span<const uint32_t> ids) {
+            if (!leaves[treeLeaf(cellKey)]) return;
+            for (uint32_t netId : ids) {
+                uint32_t slot = *m_index.find(netId);
+                fn(m_objects[slot], m_stamps[slot]);
+            }
+        });
+    }
+
+private:
+    bool applyEdit(EditOp const& op) {
+        uint32_t netId = op.netId();
+        if (netId == 0 || m_deleted.contains(netId)) return false;
+        auto slot = m_index.find(netId);
+        if (std::holds_alternative<DeleteObjectMsg>(op.msg)) {
+            m_deleted.insert(netId, 0);
+            return slot && remove(*slot);
+        }
+        if (!slot) {
+            ObjectRecord const* record = nullptr;
+            if (auto m = std::get_if<CreateObjectMsg>(&op.msg)) record = &m->object;
+            if (auto m = std::get_if<ObjectStateMsg>(&op.msg)) record = &m->object;
+            if (!record) return false;
+            slot = &m_index.insert(netId, (uint32_t)m_objects.size());
+            m_objects.push_back(*record);
+            m_stamps.emplace_back();
+            m_grid.insert(netId, record->x, record->y);
+            hashIn(*slot);
+        }
+        uint32_t i = *slot;
+        ObjectStamps stamps = m_stamps[i];
+        uint32_t won = mergeEdit(stamps, op);
+        if (!won) return false;
+        hashOut(i);
+        m_stamps[i] = stamps;
+        std::visit([&](auto const& m) { write(m_objects[i], m, won); }, op.msg);
+        hashIn(i);
+        return true;
+    }
+
+    uint32_t leafOf(uint32_t slot) const { return treeLeaf(SpatialGrid::keyAt(m_objects[slot].x, m_objects[slot].y)); }
+    void hashIn(uint32_t slot) { m_tree.add(leafOf(slot), objectHash(m_objects[slot], m_stamps[slot])); }
+    void hashOut(uint32_t slot) { m_tree.remove(leafOf(slot), objectHash(m_objects[slot], m_stamps[slot])); }
+
+    void setTransform(ObjectRecord& obj, float x, float y, float rotation, float scaleX, float scaleY) {
+        m_grid.move(obj.netId, obj.x, obj.y, x, y);
+        obj.x = x;
+        obj.y = y;
+        obj.rotation = rotation;
+        obj.scaleX = scaleX;
+        obj.scaleY = scaleY;
+    }
+
+    // Writes the parts of a whole record that won.
+    void writeRecord(ObjectRecord& obj, ObjectRecord const& from, uint32_t won) {
+        obj.objectId = from.objectId;
+        if (won & kTransformPart) setTransform(obj, from.x, from.y, from.rotation, from.scaleX, from.scaleY);
+        for (size_t p = 0; p < size_t(ObjectProperty::Count); ++p) {
+            if (won & propertyPart(ObjectProperty(p))) obj.properties[p] = from.properties[p];
+        }
+    }
+
+    void write(ObjectRecord& obj, CreateObjectMsg const& m, uint32_t won) { writeRecord(obj, m.object, won); }
+    void write(ObjectRecord& obj, ObjectStateMsg const& m, uint32_t won) { writeRecord(obj, m.object, won); }
+    void write(ObjectRecord& obj, TransformObjectMsg const& m, uint32_t) { setTransform(obj, m.x, m.y, m.rotation, m.scaleX, m.scaleY); }
+    void write(ObjectRecord& obj, SetPropertyMsg const& m, uint32_t) { obj.property(m.property) = m.value; }
+    void write(ObjectRecord&, DeleteObjectMsg const&, uint32_t) {}
+    void write(ObjectRecord&, ObjectBlockMsg const&, uint32_t) {}
+
+    bool remove(uint32_t slot) {
+        uint32_t netId = m_objects[slot].netId;
+        hashOut(slot);
+        m_grid.remove(netId, m_objects[slot].x, m_objects[slot].y);
+        m_index.erase(netId);
+        if (slot != m_objects.size() - 1) {
+            m_objects[slot] = m_objects.back();
+            m_stamps[slot] = m_stamps.back();
+            m_index.insert(m_objects[slot].netId, slot);
+        }
+        m_objects.pop_back();
+        m_stamps.pop_back();
+        return true;
+    }
+};
+
+} // namespace devious
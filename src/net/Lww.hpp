@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <type_traits>
+#include "Protocol.hpp"
+
+namespace devious {
+
+// Last-writer-wins merge of edits into an object's ObjectStamps. Each peer applies its
+// own edits at once and every remote edit goes through mergeEdit, so all peers end up
+// with the same value for every part no matter in which order the edits reached them.
+// A delete always wins: net ids are never reused, so nothing may bring an object back.
+
+constexpr uint32_t kAllParts = (1u << kStampParts) - 1;
+constexpr uint32_t kTransformPart = 1u;
+constexpr uint32_t propertyPart(ObjectProperty p) { return 2u << uint32_t(p); }
+
+// A local edit that is queued but not flushed yet. It is stamped at flush time, later
+// than anything received before then, so until that point remote edits can't beat it.
+constexpr uint64_t kPendingStamp = UINT64_MAX;
+
+// The parts of an object an edit writes.
+inline uint32_t editParts(EditOp const& op) {
+    return std::visit([](auto const& m) -> uint32_t {
+        using M = std::decay_t<decltype(m)>;
+        if constexpr (std::is_same_v<M, TransformObjectMsg>) return kTransformPart;
+        else if constexpr (std::is_same_v<M, SetPropertyMsg>) return propertyPart(m.property);
+        else return kAllParts;
+    }, op.msg);
+}
+
+// Advances `stamps` by the parts of `op` that are newer and returns those parts; only
+// they should be applied.
+inline uint32_t mergeEdit(ObjectStamps& stamps, EditOp const& op) {
+    if (std::holds_alternative<DeleteObjectMsg>(op.msg)) return kAllParts;
+    auto state = std::get_if<ObjectStateMsg>(&op.msg);
+    uint32_t parts = editParts(op), won = 0;
+    for (size_t i = 0; i < kStampParts; ++i) {
+        if (!(parts >> i & 1)) continue;
+        uint64_t stamp = state ? state->stamps.parts[i] : op.stamp;
+        if (stamp <= stamps.parts[i]) continue;
+        stamps.parts[i] = stamp;
+        won |= 1u << i;
+    }
+    return won;
+}
+
+// Marks the parts `op` writes as pending a local stamp.
+inline void markPending(ObjectStamps& stamps, EditOp const& op) {
+    uint32_t parts = editParts(op);
+    for (size_t i = 0; i < kStampParts; ++i) if (parts >> i & 1) stamps.parts[i] = kPendingStamp;
+}
+
+// Gives pending parts their stamp once the batch holding them is flushed.
+inline void settlePending(ObjectStamps& stamps, uint64_t stamp) {
+    for (auto& part : stamps.parts) if (part == kPendingStamp) part = stamp;
+}
+
+} // namespace devious
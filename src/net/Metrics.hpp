@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace devious {
+
+// Counters for one peer link. Owned and bumped by the I/O thread with plain adds; other
+// threads only ever see the copies published in NetMetrics.
+struct LinkMetrics {
+    uint8_t peerId = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint64_t packetsIn = 0;     // frames decoded
+    uint64_t packetsOut = 0;    // packets queued (a packet may hold several frames)
+    uint64_t sendCalls = 0;
+    uint64_t decodeErrors = 0;
+    uint64_t repairedObjects = 0;  // host: objects resent because tree verification found them differing
+    uint64_t resumes = 0;       // sessions carried over onto this link after a reconnect
+    uint64_t resentPackets = 0; // packets sent again because the previous link lost them
+    size_t queueBytes = 0;
+    size_t peakQueueBytes = 0;
+    double rttMs = -1.0;        // -1 until the first pong
+
+    void add(LinkMetrics const& o) {
+        bytesIn += o.bytesIn;
+        bytesOut += o.bytesOut;
+        packetsIn += o.packetsIn;
+        packetsOut += o.packetsOut;
+        sendCalls += o.sendCalls;
+        decodeErrors += o.decodeErrors;
+        repairedObjects += o.repairedObjects;
+        resumes += o.resumes;
+        resentPackets += o.resentPackets;
+        queueBytes += o.queueBytes;
+        peakQueueBytes = std::max(peakQueueBytes, o.peakQueueBytes);
+    }
+};
+
+// A point-in-time view of the session, published by the I/O thread a few times a second.
+// The apply fields belong to whoever drains the inbound ring and are filled in by it.
+struct NetMetrics {
+    double timeSec = 0.0;
+    bool host = false;
+    uint8_t localPeer = 0;
+    std::vector<LinkMetrics> links;
+    LinkMetrics total;          // live links plus every link closed so far; rtt is the live mean
+    size_t inboundDepth = 0;
+
+    double applyMs = 0.0;       // last frame
+    double applyPeakMs = 0.0;   // worst frame since the previous publish
+    size_t applyPending = 0;
+
+    // One JSON object on a single line, for metrics.jsonl.
+    std::string toJson() const {
+        std::string out;
+        char buf[512];
+        auto link = [&](LinkMetrics const& l) {
+            std::snprintf(buf, sizeof(buf),
+                "{\"peer\":%u,\"bytes_in\":%llu,\"bytes_out\":%llu,\"packets_in\":%llu,\"packets_out\":%llu,"
+                "\"send_calls\":%llu,\"decode_errors\":%llu,\"repaired_objects\":%llu,\"resumes\":%llu,\"resent_packets\":%llu,\"queue_bytes\":%zu,\"peak_queue_bytes\":%zu,\"rtt_ms\":%.3f}",
+                l.peerId, (unsigned long long)l.bytesIn, (unsigned long long)l.bytesOut, (unsigned long long)l.packetsIn,
+                (unsigned long long)l.packetsOut, (unsigned long long)l.sendCalls, (unsigned long long)l.decodeErrors,
+                (unsigned long long)l.repairedObjects, (unsigned long long)l.resumes, (unsigned long long)l.resentPackets,
+                l.queueBytes, l.peakQueueBytes, l.rttMs);
+            out += buf;
+        };
+        std::snprintf(buf, sizeof(buf), "{\"t\":%.3f,\"host\":%s,\"peer\":%u,\"inbound_depth\":%zu,\"apply_ms\":%.3f,\"apply_peak_ms\":%.3f,\"apply_pending\":%zu,\"total\":",
+            timeSec, host ? "true" : "false", localPeer, inboundDepth, applyMs, applyPeakMs, applyPending);
+        out += buf;
+        link(total);
+        out += ",\"links\":[";
+        for (size_t i = 0; i < links.size(); ++i) {
+            if (i) out += ',';
+            link(links[i]);
+        }
+        out += "]}";
+        return out;
+    }
+};
+
+} // namespace devious
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+
+namespace devious {
+
+// Bounded lock-free queue for many producers and one consumer (Vyukov's sequenced
+// ring). Each slot carries a sequence number that tells producers whether it is free
+// and the consumer whether it is filled, so neither side ever takes a lock. push()
+// fails instead of blocking when the ring is full; the caller decides what to do.
+template <class T>
+class MpscRing {
+    struct alignas(64) Slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+    alignas(64) std::atomic<size_t> m_head = 0; // next slot to claim (producers)
+    alignas(64) std::atomic<size_t> m_tail = 0; // next slot to read (consumer)
+
+public:
+    // capacity is rounded up to a power of two.
+    explicit MpscRing(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) size <<= 1;
+        m_slots = std::make_unique<Slot[]>(size);
+        m_mask = size - 1;
+        for (size_t i = 0; i < size; ++i) m_slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+    // Approximate; exact only when no producer is mid-push.
+    size_t size() const {
+        return m_head.load(std::memory_order_relaxed) - m_tail.load(std::memory_order_relaxed);
+    }
+
+    bool push(T&& value) {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = m_slots[pos & m_mask];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.value = std::move(value);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0) return false;
+            else pos = m_head.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Consumer only.
+    bool pop(T& out) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        Slot& slot = m_slots[tail & m_mask];
+        if (slot.seq.load(std::memory_order_acquire) != tail + 1) return false;
+        out = std::move(slot.value);
+        slot.seq.store(tail + m_mask + 1, std::memory_order_release);
+        m_tail.store(tail + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Consumer only. Pops up to `max` items into fn(T&) and returns how many were taken.
+    template <class F>
+    size_t drain(F&& fn, size_t max = SIZE_MAX) {
+        size_t n = 0;
+        T value;
+        while (n < max && pop(value)) {
+            fn(value);
+            ++n;
+        }
+        return n;
+    }
+};
+
+} // namespace devious
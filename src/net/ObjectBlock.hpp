@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "Compression.hpp"
+#include "Protocol.hpp"
+#include "Snapshot.hpp"
+
+namespace devious {
+
+// ObjectBlock payload := u64 stamp | u32 count | u32 stringSize | lz(raw)
+// raw := byte-shuffled record columns (as in snapshot chunks) | object string
+//
+// A big paste is split into blocks of at most kBlockMaxObjects objects or about
+// kBlockStringBudget bytes of object string, which keeps every frame well under
+// kMaxPayloadSize. They are written back to back, so the paste still goes out at once.
+constexpr size_t kBlockMaxObjects = 4096;
+constexpr size_t kBlockStringBudget = 512 * 1024;
+constexpr size_t kBlockMaxStringSize = 4 * kMaxPayloadSize;
+
+inline void writeObjectBlock(ObjectBlock const& block, uint64_t stamp, std::vector<uint8_t>& out) {
+    thread_local std::vector<uint8_t> columns, raw;
+    columns.clear();
+    snapshot_detail::packColumns<ObjectRecord>(block.records, columns);
+    raw.resize(columns.size() + block.objectString.size());
+    byteShuffle(columns, {raw.data(), columns.size()}, 4);
+    std::memcpy(raw.data() + columns.size(), block.objectString.data(), block.objectString.size());
+
+    PacketWriter w(out);
+    w.begin(MsgType::ObjectBlock);
+    w.u64(stamp);
+    w.u32((uint32_t)block.records.size());
+    w.u32((uint32_t)block.objectString.size());
+    lzCompress(raw, out);
+    w.finish();
+}
+
+inline bool readObjectBlock(PacketReader& r, ObjectBlock& out, uint64_t& stamp) {
+    stamp = r.u64();
+    uint32_t count = r.u32();
+    uint32_t stringSize = r.u32();
+    if (!r.ok() || count > kBlockMaxObjects || stringSize > kBlockMaxStringSize) return false;
+    size_t recordBytes = count * snapshot_detail::kRecordBytes;
+    thread_local std::vector<uint8_t> raw, columns;
+    raw.resize(recordBytes + stringSize);
+    if (!lzDecompress(r.rest(), raw)) return false;
+    columns.resize(recordBytes);
+    byteUnshuffle({raw.data(), recordBytes}, columns, 4);
+    out.records.clear();
+    snapshot_detail::unpackColumns(columns, count, out.records);
+    out.objectString.assign((char const*)raw.data() + recordBytes, stringSize);
+    return true;
+}
+
+// Collects objects and writes a block frame to `out` whenever one is full. Object
+// strings are joined with ';', the separator of the editor's level string. Every block
+// of one action shares its stamp.
+class ObjectBlockWriter {
+    std::vector<uint8_t>& m_out;
+    uint64_t m_stamp;
+    ObjectBlock m_block;
+
+public:
+    ObjectBlockWriter(std::vector<uint8_t>& out, uint64_t stamp) : m_out(out), m_stamp(stamp) {}
+
+    void add(ObjectRecord const& record, std::string_view objectString) {
+        m_block.records.push_back(record);
+        m_block.objectString.append(objectString);
+        m_block.objectString.push_back(';');
+        if (m_block.records.size() >= kBlockMaxObjects || m_block.objectString.size() >= kBlockStringBudget) finish();
+    }
+
+    void finish() {
+        if (m_block.records.empty()) return;
+        writeObjectBlock(m_block, m_stamp, m_out);
+        m_block.records.clear();
+        m_block.objectString.clear();
+    }
+};
+
+} // namespace devious
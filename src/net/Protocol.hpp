@@ -0,0 +1,1063 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+// Binary wire format shared by every peer. All fields are fixed-width little-endian.
+//
+//   frame  := header payload
+//   header := u32 payloadLength | u8 version | u8 type | u16 flags
+//
+// The length prefix lets the receiver split a TCP byte stream into frames no matter
+// how the kernel coalesced or fragmented the writes.
+
+namespace devious {
+
+constexpr uint8_t kProtocolVersion = 7;
+constexpr size_t kFrameHeaderSize = 8;
+constexpr uint32_t kMaxPayloadSize = 1u << 20;
+constexpr size_t kMaxBatchRecords = 4096;
+
+enum class MsgType : uint8_t {
+    CreateObject = 1,
+    Batch = 2,
+    SnapshotRequest = 3,
+    SnapshotBegin = 4,
+    SnapshotChunk = 5,
+    SnapshotEnd = 6,
+    TransformObject = 7,
+    SetProperty = 8,
+    DeleteObject = 9,
+    Welcome = 10,
+    Ping = 11,
+    Pong = 12,
+    Viewport = 13,
+    ObjectBlock = 14,
+    ObjectState = 15,
+    TreeDigest = 16,
+    TreeQuery = 17,
+    BucketDigest = 18,
+    Ack = 19,
+    Resume = 20,
+    Resumed = 21,
+    TransformBlock = 22,
+    Hello = 23,
+    HelloAck = 24,
+};
+
+// Network ids are unique for a whole session without any coordination: the top byte is
+// the peer id the host handed out in Welcome, the low 24 bits count that peer's objects.
+constexpr uint32_t makeNetId(uint8_t peer, uint32_t counter) { return (uint32_t(peer) << 24) | (counter & 0xFFFFFF); }
+constexpr uint8_t netIdPeer(uint32_t netId) { return uint8_t(netId >> 24); }
+constexpr uint8_t kHostPeerId = 1;
+
+enum class ObjectProperty : uint8_t {
+    ZOrder = 0,
+    ZLayer = 1,
+    EditorLayer = 2,
+    EditorLayer2 = 3,
+    Count
+};
+
+// One synced object as the network layer sees it.
+struct ObjectRecord {
+    uint32_t netId = 0;
+    int32_t objectId = 0;
+    float x = 0.f;
+    float y = 0.f;
+    float rotation = 0.f;
+    float scaleX = 1.f;
+    float scaleY = 1.f;
+    int32_t properties[size_t(ObjectProperty::Count)] = {};
+
+    int32_t& property(ObjectProperty p) { return properties[size_t(p)]; }
+    int32_t property(ObjectProperty p) const { return properties[size_t(p)]; }
+
+    bool sameTransform(ObjectRecord const& o) const {
+        return x == o.x && y == o.y && rotation == o.rotation && scaleX == o.scaleX && scaleY == o.scaleY;
+    }
+};
+
+// Lamport stamps: (counter << 8) | peer. Every peer stamps its own edits from one
+// counter that it also advances past every stamp it receives, so stamps order all edits
+// of a session consistently with causality, and the peer byte breaks ties. 0 is older
+// than any edit.
+constexpr uint64_t makeStamp(uint64_t counter, uint8_t peer) { return (counter << 8) | peer; }
+constexpr uint64_t stampCounter(uint64_t stamp) { return stamp >> 8; }
+
+// The stamp of the newest edit to each independently editable part of an object: part 0
+// is the transform, part 1 + p is property p. Concurrent edits merge part by part, last
+// writer wins.
+constexpr size_t kStampParts = 1 + size_t(ObjectProperty::Count);
+
+struct ObjectStamps {
+    uint64_t parts[kStampParts] = {};
+
+    static ObjectStamps all(uint64_t stamp) {
+        ObjectStamps s;
+        for (auto& part : s.parts) part = stamp;
+        return s;
+    }
+
+    uint64_t newest() const { return *std::max_element(std::begin(parts), std::end(parts)); }
+};
+
+struct Frame {
+    MsgType type;
+    uint16_t flags;
+    std::span<const uint8_t> payload;
+    std::span<const uint8_t> bytes; // header + payload, for verbatim relaying
+};
+
+// --- ENCODING ---
+
+class PacketWriter {
+    std::vector<uint8_t>& m_out;
+    size_t m_frameStart = 0;
+
+public:
+    explicit PacketWriter(std::vector<uint8_t>& out) : m_out(out) {}
+
+    void begin(MsgType type, uint16_t flags = 0) {
+        m_frameStart = m_out.size();
+        u32(0);
+        u8(kProtocolVersion);
+        u8(static_cast<uint8_t>(type));
+        u16(flags);
+    }
+
+    void finish() {
+        uint32_t len = static_cast<uint32_t>(m_out.size() - m_frameStart - kFrameHeaderSize);
+        store32(m_out.data() + m_frameStart, len);
+    }
+
+    void u8(uint8_t v) { m_out.push_back(v); }
+    void u16(uint16_t v) { uint8_t b[2] = {uint8_t(v), uint8_t(v >> 8)}; bytes(b, 2); }
+    void u32(uint32_t v) { uint8_t b[4]; store32(b, v); bytes(b, 4); }
+    void u64(uint64_t v) { u32(uint32_t(v)); u32(uint32_t(v >> 32)); }
+    void i32(int32_t v) { u32(static_cast<uint32_t>(v)); }
+    void f32(float v) { uint32_t u; std::memcpy(&u, &v, 4); u32(u); }
+    void bytes(const uint8_t* p, size_t n) { m_out.insert(m_out.end(), p, p + n); }
+
+    static void store32(uint8_t* p, uint32_t v) {
+        p[0] = uint8_t(v); p[1] = uint8_t(v >> 8); p[2] = uint8_t(v >> 16); p[3] = uint8_t(v >> 24);
+    }
+};
+
+class PacketReader {
+    std::span<const uint8_t> m_data;
+    size_t m_pos = 0;
+    bool m_ok = true;
+
+    bool need(size_t n) {
+        if (!m_ok || m_data.size() - m_pos < n) { m_ok = false; return false; }
+        return true;
+    }
+
+public:
+    explicit PacketReader(std::span<const uint8_t> data) : m_data(data) {}
+
+    bool ok() const { return m_ok; }
+    bool atEnd() const { return m_pos == m_data.size(); }
+    size_t remaining() const { return m_data.size() - m_pos; }
+    size_t position() const { return m_pos; }
+
+    uint8_t u8() { return need(1) ? m_data[m_pos++] : 0; }
+    uint16_t u16() {
+        if (!need(2)) return 0;
+        uint16_t v = uint16_t(m_data[m_pos] | (m_data[m_pos + 1] << 8));
+        m_pos += 2;
+        return v;
+    }
+    uint32_t u32() {
+        if (!need(4)) return 0;
+        uint32_t v = load32(m_data.data() + m_pos);
+        m_pos += 4;
+        return v;
+    }
+    uint64_t u64() {
+        uint64_t lo = u32();
+        return lo | (uint64_t(u32()) << 32);
+    }
+    int32_t i32() { return static_cast<int32_t>(u32()); }
+    float f32() { uint32_t u = u32(); float v; std::memcpy(&v, &u, 4); return v; }
+
+    // The next n bytes, consumed; empty (and !ok()) if there aren't that many.
+    std::span<const uint8_t> bytes(size_t n) {
+        if (!need(n)) return {};
+        auto out = m_data.subspan(m_pos, n);
+        m_pos += n;
+        return out;
+    }
+
+    // The unread remainder of the payload, consumed.
+    std::span<const uint8_t> rest() {
+        auto out = m_data.subspan(m_pos);
+        m_pos = m_data.size();
+        return out;
+    }
+
+    static uint32_t load32(const uint8_t* p) {
+        return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+    }
+};
+
+// --- MESSAGES ---
+
+// Edits to objects are records inside a Batch frame (writeRecord: type byte + body).
+// Control messages are frames of their own (write).
+
+struct CreateObjectMsg {
+    static constexpr MsgType kType = MsgType::CreateObject;
+
+    ObjectRecord object;
+
+    void writeRecord(PacketWriter& w) const {
+        w.u8(static_cast<uint8_t>(kType));
+        writeObject(w, object);
+    }
+
+    static bool read(PacketReader& r, CreateObjectMsg& out) {
+        readObject(r, out.object);
+        return r.ok();
+    }
+
+    static void writeObject(PacketWriter& w, ObjectRecord const& object) {
+        w.u32(object.netId);
+        w.i32(object.objectId);
+        w.f32(object.x);
+        w.f32(object.y);
+        w.f32(object.rotation);
+        w.f32(object.scaleX);
+        w.f32(object.scaleY);
+        for (int32_t p : object.properties) w.i32(p);
+    }
+
+    static void readObject(PacketReader& r, ObjectRecord& object) {
+        object.netId = r.u32();
+        object.objectId = r.i32();
+        object.x = r.f32();
+        object.y = r.f32();
+        object.rotation = r.f32();
+        object.scaleX = r.f32();
+        object.scaleY = r.f32();
+        for (int32_t& p : object.properties) p = r.i32();
+    }
+};
+
+// Move, rotate and scale all send the full transform, so applying the latest one wins.
+// When a whole selection moves they go out quantized in a TransformBlock frame instead of
+// batch records (see TransformBlock.hpp) and are decoded back into these.
+struct TransformObjectMsg {
+    static constexpr MsgType kType = MsgType::TransformObject;
+
+    uint32_t netId = 0;
+    float x = 0.f;
+    float y = 0.f;
+    float rotation = 0.f;
+    float scaleX = 1.f;
+    float scaleY = 1.f;
+
+    bool operator==(TransformObjectMsg const&) const = default;
+
+    void writeRecord(PacketWriter& w) const {
+        w.u8(static_cast<uint8_t>(kType));
+        w.u32(netId);
+        w.f32(x);
+        w.f32(y);
+        w.f32(rotation);
+        w.f32(scaleX);
+        w.f32(scaleY);
+    }
+
+    static bool read(PacketReader& r, TransformObjectMsg& out) {
+        out.netId = r.u32();
+        out.x = r.f32();
+        out.y = r.f32();
+        out.rotation = r.f32();
+        out.scaleX = r.f32();
+        out.scaleY = r.f32();
+        return r.ok();
+    }
+};
+
+struct SetPropertyMsg {
+    static constexpr MsgType kType = MsgType::SetProperty;
+
+    uint32_t netId = 0;
+    ObjectProperty property = ObjectProperty::ZOrder;
+    int32_t value = 0;
+
+    void writeRecord(PacketWriter& w) const {
+        w.u8(static_cast<uint8_t>(kType));
+        w.u32(netId);
+        w.u8(static_cast<uint8_t>(property));
+        w.i32(value);
+    }
+
+    static bool read(PacketReader& r, SetPropertyMsg& out) {
+        out.netId = r.u32();
+        uint8_t property = r.u8();
+        out.value = r.i32();
+        out.property = static_cast<ObjectProperty>(property);
+        return r.ok() && property < uint8_t(ObjectProperty::Count);
+    }
+};
+
+struct DeleteObjectMsg {
+    static constexpr MsgType kType = MsgType::DeleteObject;
+
+    uint32_t netId = 0;
+
+    void writeRecord(PacketWriter& w) const {
+        w.u8(static_cast<uint8_t>(kType));
+        w.u32(netId);
+    }
+
+    static bool read(PacketReader& r, DeleteObjectMsg& out) {
+        out.netId = r.u32();
+        return r.ok();
+    }
+};
+
+// Host -> client: an object as the host has it, with the stamp of every part, so the
+// receiver can merge it with edits of its own that the host hasn't seen yet. Sent in
+// place of edits that were held back outside the client's viewport.
+struct ObjectStateMsg {
+    static constexpr MsgType kType = MsgType::ObjectState;
+
+    ObjectRecord object;
+    ObjectStamps stamps;
+
+    void writeRecord(PacketWriter& w) const {
+        w.u8(static_cast<uint8_t>(kType));
+        CreateObjectMsg::writeObject(w, object);
+        for (uint64_t part : stamps.parts) w.u64(part);
+    }
+
+    static bool read(PacketReader& r, ObjectStateMsg& out) {
+        CreateObjectMsg::readObject(r, out.object);
+        for (uint64_t& part : out.stamps.parts) part = r.u64();
+        return r.ok();
+    }
+};
+
+// Host -> client, before the snapshot: the peer id that prefixes the client's net ids,
+// and the token the client presents to resume the session after losing the link.
+struct WelcomeMsg {
+    static constexpr MsgType kType = MsgType::Welcome;
+
+    uint8_t peerId = 0;
+    uint64_t token = 0;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u8(peerId);
+        w.u64(token);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, WelcomeMsg& out) {
+        out.peerId = r.u8();
+        out.token = r.u64();
+        return r.ok();
+    }
+};
+
+// Many objects created in one editor action (paste, duplicate, a grouped undo or redo).
+// Besides the records it carries the editor's own object string, one entry per record
+// in the same order, so receivers rebuild every object with all of its settings.
+struct ObjectBlock {
+    std::vector<ObjectRecord> records;
+    std::string objectString;
+};
+
+// Not a batch record: an ObjectBlock travels as a frame of its own (see ObjectBlock.hpp)
+// and reaches the editor through the same inbound queue as every other edit, so it is
+// applied in order with them. The block is shared, not copied, on the way.
+struct ObjectBlockMsg {
+    static constexpr MsgType kType = MsgType::ObjectBlock;
+
+    std::shared_ptr<const ObjectBlock> block;
+};
+
+// Any edit to a single object, or a whole ObjectBlock. This is what the batcher queues
+// and what the I/O thread hands to the editor.
+struct EditOp {
+    std::variant<CreateObjectMsg, TransformObjectMsg, SetPropertyMsg, DeleteObjectMsg, ObjectBlockMsg, ObjectStateMsg> msg;
+    // Stamp of the batch or block it arrived in; an ObjectState carries its own per part.
+    uint64_t stamp = 0;
+
+    // 0 for blocks, which touch many objects.
+    uint32_t netId() const {
+        return std::visit([](auto const& m) -> uint32_t {
+            if constexpr (requires { m.object; }) return m.object.netId;
+            else if constexpr (requires { m.block; }) return 0;
+            else return m.netId;
+        }, msg);
+    }
+
+    // Edits with the same key may replace each other in a batch: one per object per kind,
+    // with each property counting as its own kind.
+    uint64_t coalesceKey() const {
+        uint64_t kind = std::visit([](auto const& m) -> uint64_t {
+            using M = std::decay_t<decltype(m)>;
+            if constexpr (std::is_same_v<M, SetPropertyMsg>) return 16 + uint64_t(m.property);
+            else return uint64_t(M::kType);
+        }, msg);
+        return (uint64_t(netId()) << 8) | kind;
+    }
+
+    // Blocks are never batched and write nothing here.
+    void writeRecord(PacketWriter& w) const {
+        std::visit([&](auto const& m) {
+            if constexpr (requires { m.writeRecord(w); }) m.writeRecord(w);
+        }, msg);
+    }
+
+    // Decodes one edit record of the given type; false for unknown types or short input.
+    static bool read(MsgType type, PacketReader& r, EditOp& out) {
+        auto decode = [&]<class M>(M) {
+            M m;
+            if (!M::read(r, m)) return false;
+            out.msg = m;
+            return true;
+        };
+        switch (type) {
+            case MsgType::CreateObject: return decode(CreateObjectMsg{});
+            case MsgType::TransformObject: return decode(TransformObjectMsg{});
+            case MsgType::SetProperty: return decode(SetPropertyMsg{});
+            case MsgType::DeleteObject: return decode(DeleteObjectMsg{});
+            case MsgType::ObjectState: return decode(ObjectStateMsg{});
+            default: return false;
+        }
+    }
+};
+
+// Batch payload := u16 count | u16 coalesced | u64 stamp | count * (u8 type | body)
+// `coalesced` is how many edits the sender folded away before flushing; it is only
+// informational and lets either side account for the saved traffic. Every edit in a
+// batch carries the batch's Lamport stamp.
+struct BatchHeader {
+    uint16_t count = 0;
+    uint16_t coalesced = 0;
+    uint64_t stamp = 0;
+
+    void write(PacketWriter& w) const {
+        w.begin(MsgType::Batch);
+        w.u16(count);
+        w.u16(coalesced);
+        w.u64(stamp);
+    }
+
+    static bool read(PacketReader& r, BatchHeader& out) {
+        out.count = r.u16();
+        out.coalesced = r.u16();
+        out.stamp = r.u64();
+        return r.ok();
+    }
+};
+
+// Late-join transfer. A client sends SnapshotRequest right after connecting; the host
+// answers with Begin, `chunkCount` compressed Chunks and End. Chunks are spatially
+// sorted and sent nearest-to-the-viewport first, so they may arrive in any order. Live
+// edits relayed while the transfer is running come after the capture point and are held
+// by the client until End. A client that lost its connection mid-transfer asks to resume
+// from `nextChunk`, the first index it is still missing; the host honours that only if
+// the level hasn't changed since.
+struct SnapshotRequestMsg {
+    static constexpr MsgType kType = MsgType::SnapshotRequest;
+
+    uint32_t resumeSnapshotId = 0;
+    uint16_t nextChunk = 0;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u32(resumeSnapshotId);
+        w.u16(nextChunk);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, SnapshotRequestMsg& out) {
+        out.resumeSnapshotId = r.u32();
+        out.nextChunk = r.u16();
+        return r.ok();
+    }
+};
+
+struct SnapshotBeginMsg {
+    static constexpr MsgType kType = MsgType::SnapshotBegin;
+
+    uint32_t snapshotId = 0;
+    uint32_t objectCount = 0;
+    uint16_t chunkCount = 0;
+    uint16_t firstChunk = 0;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u32(snapshotId);
+        w.u32(objectCount);
+        w.u16(chunkCount);
+        w.u16(firstChunk);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, SnapshotBeginMsg& out) {
+        out.snapshotId = r.u32();
+        out.objectCount = r.u32();
+        out.chunkCount = r.u16();
+        out.firstChunk = r.u16();
+        return r.ok();
+    }
+};
+
+// Chunk payload := u32 snapshotId | u16 index | u16 recordCount | u32 rawSize | compressed bytes
+struct SnapshotChunkHeader {
+    uint32_t snapshotId = 0;
+    uint16_t index = 0;
+    uint16_t recordCount = 0;
+    uint32_t rawSize = 0;
+
+    static bool read(PacketReader& r, SnapshotChunkHeader& out) {
+        out.snapshotId = r.u32();
+        out.index = r.u16();
+        out.recordCount = r.u16();
+        out.rawSize = r.u32();
+        return r.ok();
+    }
+};
+
+struct SnapshotEndMsg {
+    static constexpr MsgType kType = MsgType::SnapshotEnd;
+
+    uint32_t snapshotId = 0;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u32(snapshotId);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, SnapshotEndMsg& out) {
+        out.snapshotId = r.u32();
+        return r.ok();
+    }
+};
+
+// Either side, every few seconds per link: the peer echoes `sentUs` back in a Pong so
+// the sender can measure round-trip time against its own clock.
+struct PingMsg {
+    static constexpr MsgType kType = MsgType::Ping;
+
+    uint64_t sentUs = 0;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u64(sentUs);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, PingMsg& out) {
+        out.sentUs = r.u64();
+        return r.ok();
+    }
+};
+
+struct PongMsg {
+    static constexpr MsgType kType = MsgType::Pong;
+
+    uint64_t sentUs = 0;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u64(sentUs);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, PongMsg& out) {
+        out.sentUs = r.u64();
+        return r.ok();
+    }
+};
+
+// Client -> host: the part of the level the client's editor is looking at (level units,
+// already padded). The host relays edits inside it straight away and defers the rest.
+struct ViewportMsg {
+    static constexpr MsgType kType = MsgType::Viewport;
+
+    float minX = 0.f;
+    float minY = 0.f;
+    float maxX = 0.f;
+    float maxY = 0.f;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.f32(minX);
+        w.f32(minY);
+        w.f32(maxX);
+        w.f32(maxY);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, ViewportMsg& out) {
+        out.minX = r.f32();
+        out.minY = r.f32();
+        out.maxX = r.f32();
+        out.maxY = r.f32();
+        return r.ok() && out.minX <= out.maxX && out.minY <= out.maxY;
+    }
+};
+
+// --- VERIFICATION ---
+
+// Every few seconds a synced client sends the root of its HashTree in a TreeDigest. The
+// host answers a mismatch with a TreeQuery for the children of every node that differs,
+// the client sends those back in another TreeDigest, and so on down to the leaves. For
+// leaves that still differ the host queries kTreeObjectLevel, and the client lists the
+// hash of every object it has in those buckets in a BucketDigest. The host then sends the
+// current state of each object that differs, is missing on either side or is gone, in an
+// ordinary Batch. The client's own edits travel ahead of its digests on the same link,
+// so the host never mistakes one it hasn't seen yet for an object it deleted.
+constexpr size_t kMaxTreeNodes = 4096;
+constexpr size_t kMaxBucketObjects = 65536;
+
+struct TreeDigestMsg {
+    static constexpr MsgType kType = MsgType::TreeDigest;
+
+    struct Node {
+        uint16_t index = 0;
+        uint64_t hash = 0;
+    };
+
+    uint8_t level = 0;
+    std::vector<Node> nodes;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u8(level);
+        w.u16(uint16_t(nodes.size()));
+        for (auto const& n : nodes) {
+            w.u16(n.index);
+            w.u64(n.hash);
+        }
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, TreeDigestMsg& out) {
+        out.level = r.u8();
+        uint16_t count = r.u16();
+        if (!r.ok() || count > kMaxTreeNodes || r.remaining() < count * 10u) return false;
+        out.nodes.resize(count);
+        for (auto& n : out.nodes) {
+            n.index = r.u16();
+            n.hash = r.u64();
+        }
+        return r.ok();
+    }
+};
+
+struct TreeQueryMsg {
+    static constexpr MsgType kType = MsgType::TreeQuery;
+
+    uint8_t level = 0;
+    std::vector<uint16_t> indices;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u8(level);
+        w.u16(uint16_t(indices.size()));
+        for (uint16_t i : indices) w.u16(i);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, TreeQueryMsg& out) {
+        out.level = r.u8();
+        uint16_t count = r.u16();
+        if (!r.ok() || count > kMaxTreeNodes || r.remaining() < count * 2u) return false;
+        out.indices.resize(count);
+        for (auto& i : out.indices) i = r.u16();
+        return r.ok();
+    }
+};
+
+// Every object the client has in `buckets`, unless one bucket alone passes
+// kMaxBucketObjects; the host then resends the ones left out, which is merely wasteful.
+struct BucketDigestMsg {
+    static constexpr MsgType kType = MsgType::BucketDigest;
+
+    struct Object {
+        uint32_t netId = 0;
+        uint64_t hash = 0;
+    };
+
+    std::vector<uint16_t> buckets;
+    std::vector<Object> objects;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u16(uint16_t(buckets.size()));
+        for (uint16_t b : buckets) w.u16(b);
+        w.u32(uint32_t(objects.size()));
+        for (auto const& o : objects) {
+            w.u32(o.netId);
+            w.u64(o.hash);
+        }
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, BucketDigestMsg& out) {
+        uint16_t bucketCount = r.u16();
+        if (!r.ok() || bucketCount > kMaxTreeNodes || r.remaining() < bucketCount * 2u) return false;
+        out.buckets.resize(bucketCount);
+        for (auto& b : out.buckets) b = r.u16();
+        uint32_t count = r.u32();
+        if (!r.ok() || count > kMaxBucketObjects || r.remaining() < count * 12u) return false;
+        out.objects.resize(count);
+        for (auto& o : out.objects) {
+            o.netId = r.u32();
+            o.hash = r.u64();
+        }
+        return r.ok();
+    }
+};
+
+// --- RESUME ---
+
+// Every frame on a link except link control is numbered implicitly, counting from 1 in
+// the order it was sent. Both ends ack what they have received every so often and keep
+// what they sent but haven't seen acked. A client whose link drops reconnects with a
+// Resume carrying its token and how many frames it received; the host answers with a
+// Resumed and, if it still has them, every frame after that. Otherwise the client starts
+// over with a snapshot.
+constexpr bool isLinkControl(MsgType type) {
+    return type == MsgType::Ping || type == MsgType::Pong || type == MsgType::Ack || type == MsgType::Resume || type == MsgType::Resumed
+        || type == MsgType::Hello || type == MsgType::HelloAck;
+}
+
+// Every link opens with a handshake: the client sends a Hello before anything else and
+// the host answers with a HelloAck before anything else. Their type numbers never change
+// and fields are only ever added at the end, and they are read whatever protocol version
+// their header carries, so peers running different versions can still tell each other
+// so before hanging up.
+constexpr bool isHandshake(MsgType type) {
+    return type == MsgType::Hello || type == MsgType::HelloAck;
+}
+
+// Names one of the sessions a host serves on its port; empty for the host's only (or
+// default) one.
+constexpr size_t kMaxSessionId = 64;
+
+// Client -> host, first on every link: our version and the session we want to join.
+struct HelloMsg {
+    static constexpr MsgType kType = MsgType::Hello;
+
+    uint16_t version = kProtocolVersion;
+    std::string session;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u16(version);
+        size_t length = std::min(session.size(), kMaxSessionId);
+        w.u8(uint8_t(length));
+        w.bytes((uint8_t const*)session.data(), length);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, HelloMsg& out) {
+        out.version = r.u16();
+        out.session.clear();
+        // Before sessions, a Hello ended here.
+        if (r.ok() && r.atEnd()) return true;
+        auto session = r.bytes(r.u8());
+        out.session.assign((char const*)session.data(), session.size());
+        return r.ok();
+    }
+};
+
+// What the host made of a Hello. Its version is checked before anything else.
+enum class HelloStatus : uint8_t {
+    VersionMismatch = 0,
+    Accepted = 1,
+    UnknownSession = 2,
+    // Every peer id of the session was handed out. Sent after an accepted Hello, instead
+    // of a Welcome, to a client asking to join as a new peer.
+    SessionFull = 3,
+};
+
+// Host -> client: whether the client may join, and what the session is. A host that
+// refused closes the link once this is out. Transient datagrams for the session go to
+// `transientPort` on the host (0: the session has no UDP channel).
+struct HelloAckMsg {
+    static constexpr MsgType kType = MsgType::HelloAck;
+    static constexpr size_t kMaxName = 64;
+
+    uint16_t version = kProtocolVersion;
+    HelloStatus status = HelloStatus::VersionMismatch;
+    uint16_t players = 0;
+    uint32_t objects = 0;
+    std::string name;
+    uint16_t transientPort = 0;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u16(version);
+        w.u8(uint8_t(status));
+        w.u16(players);
+        w.u32(objects);
+        size_t length = std::min(name.size(), kMaxName);
+        w.u8(uint8_t(length));
+        w.bytes((uint8_t const*)name.data(), length);
+        w.u16(transientPort);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, HelloAckMsg& out) {
+        out.version = r.u16();
+        out.status = HelloStatus(r.u8());
+        out.players = r.u16();
+        out.objects = r.u32();
+        auto name = r.bytes(r.u8());
+        out.name.assign((char const*)name.data(), name.size());
+        out.transientPort = r.atEnd() ? 0 : r.u16();
+        return r.ok();
+    }
+};
+
+// Either side: every frame up to and including `received` arrived.
+struct AckMsg {
+    static constexpr MsgType kType = MsgType::Ack;
+
+    uint64_t received = 0;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u64(received);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, AckMsg& out) {
+        out.received = r.u64();
+        return r.ok();
+    }
+};
+
+// Client -> host, first on a new link instead of a SnapshotRequest.
+struct ResumeMsg {
+    static constexpr MsgType kType = MsgType::Resume;
+
+    uint64_t token = 0;
+    uint64_t received = 0;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u64(token);
+        w.u64(received);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, ResumeMsg& out) {
+        out.token = r.u64();
+        out.received = r.u64();
+        return r.ok();
+    }
+};
+
+// Host -> client: whether the session was resumed and how many of the client's frames
+// the host had received, so the client can resend the rest either way.
+struct ResumedMsg {
+    static constexpr MsgType kType = MsgType::Resumed;
+
+    bool ok = false;
+    uint64_t received = 0;
+
+    void write(PacketWriter& w) const {
+        w.begin(kType);
+        w.u8(ok ? 1 : 0);
+        w.u64(received);
+        w.finish();
+    }
+
+    static bool read(PacketReader& r, ResumedMsg& out) {
+        out.ok = r.u8() != 0;
+        out.received = r.u64();
+        return r.ok();
+    }
+};
+
+// --- TRANSIENT DATAGRAMS ---
+
+// Drag previews, cursors and selections go over UDP next to the TCP link. Every datagram
+// carries the sender's whole transient state, so a lost one is simply superseded by the
+// next and receivers keep only the newest sequence number per peer.
+//
+//   datagram := u8 version | u8 peerId | u16 flags | u32 seq | TransientState
+constexpr size_t kTransientHeaderSize = 8;
+constexpr size_t kMaxDatagramSize = 1200;
+
+// Wrap-safe "a is newer than b" for 32-bit sequence numbers.
+constexpr bool seqNewer(uint32_t a, uint32_t b) { return int32_t(a - b) > 0; }
+
+// state := u8 hasCursor | f32 x | f32 y | u16 dragCount | drags | u16 selectionTotal
+//          | u16 selectionCount | selectionCount * u32 netId
+// drag  := u32 netId | f32 x | f32 y | f32 rotation | f32 scaleX | f32 scaleY
+struct TransientState {
+    static constexpr size_t kDragSize = 24;
+
+    bool hasCursor = false;
+    float cursorX = 0.f;
+    float cursorY = 0.f;
+    std::vector<TransformObjectMsg> drags;
+    uint16_t selectionTotal = 0;    // may exceed `selection` when it didn't fit
+    std::vector<uint32_t> selection;
+
+    bool operator==(TransientState const&) const = default;
+
+    // Fills the datagram up to kMaxDatagramSize: drags first, then as much of the
+    // selection as still fits.
+    void write(PacketWriter& w, size_t budget) const {
+        w.u8(hasCursor);
+        w.f32(cursorX);
+        w.f32(cursorY);
+        budget -= std::min<size_t>(budget, 15);
+        size_t dragCount = std::min(drags.size(), budget / kDragSize);
+        w.u16(uint16_t(dragCount));
+        for (size_t i = 0; i < dragCount; ++i) {
+            auto const& d = drags[i];
+            w.u32(d.netId);
+            w.f32(d.x);
+            w.f32(d.y);
+            w.f32(d.rotation);
+            w.f32(d.scaleX);
+            w.f32(d.scaleY);
+        }
+        budget -= dragCount * kDragSize;
+        size_t selectionCount = std::min(selection.size(), budget / 4);
+        w.u16(selectionTotal);
+        w.u16(uint16_t(selectionCount));
+        for (size_t i = 0; i < selectionCount; ++i) w.u32(selection[i]);
+    }
+
+    static bool read(PacketReader& r, TransientState& out) {
+        out.hasCursor = r.u8() != 0;
+        out.cursorX = r.f32();
+        out.cursorY = r.f32();
+        uint16_t dragCount = r.u16();
+        if (r.remaining() < size_t(dragCount) * kDragSize) return false;
+        out.drags.resize(dragCount);
+        for (auto& d : out.drags) {
+            d.netId = r.u32();
+            d.x = r.f32();
+            d.y = r.f32();
+            d.rotation = r.f32();
+            d.scaleX = r.f32();
+            d.scaleY = r.f32();
+        }
+        out.selectionTotal = r.u16();
+        uint16_t selectionCount = r.u16();
+        if (r.remaining() < size_t(selectionCount) * 4) return false;
+        out.selection.resize(selectionCount);
+        for (auto& id : out.selection) id = r.u32();
+        return r.ok();
+    }
+};
+
+struct TransientHeader {
+    uint8_t peerId = 0;
+    uint32_t seq = 0;
+
+    void write(PacketWriter& w) const {
+        w.u8(kProtocolVersion);
+        w.u8(peerId);
+        w.u16(0);
+        w.u32(seq);
+    }
+
+    static bool read(PacketReader& r, TransientHeader& out) {
+        if (r.u8() != kProtocolVersion) return false;
+        out.peerId = r.u8();
+        r.u16();
+        out.seq = r.u32();
+        return r.ok();
+    }
+};
+
+// --- STREAM DECODING ---
+
+// Per-connection receive buffer. recv() writes straight into prepare(), and drain()
+// hands out every complete frame in place, keeping any trailing partial frame for
+// the next read. The storage is reused for the lifetime of the connection.
+class FrameDecoder {
+    std::vector<uint8_t> m_buffer;
+    size_t m_begin = 0;
+    size_t m_end = 0;
+
+public:
+    explicit FrameDecoder(size_t initialCapacity = 16 * 1024) : m_buffer(initialCapacity) {}
+
+    std::span<uint8_t> prepare(size_t minFree = 4096) {
+        if (m_buffer.size() - m_end < minFree) {
+            if (m_begin > 0) {
+                std::memmove(m_buffer.data(), m_buffer.data() + m_begin, m_end - m_begin);
+                m_end -= m_begin;
+                m_begin = 0;
+            }
+            if (m_buffer.size() - m_end < minFree) m_buffer.resize(m_end + minFree);
+        }
+        return {m_buffer.data() + m_end, m_buffer.size() - m_end};
+    }
+
+    void commit(size_t n) { m_end += n; }
+
+    size_t buffered() const { return m_end - m_begin; }
+
+    // Calls onFrame(const Frame&) for each complete frame. Returns false if the stream
+    // is corrupt (unknown version outside the handshake, or oversized length); the
+    // connection should be dropped.
+    template <class F>
+    bool drain(F&& onFrame) {
+        while (m_end - m_begin >= kFrameHeaderSize) {
+            const uint8_t* h = m_buffer.data() + m_begin;
+            uint32_t len = PacketReader::load32(h);
+            if ((h[4] != kProtocolVersion && !isHandshake(MsgType(h[5]))) || len > kMaxPayloadSize) return false;
+            if (m_end - m_begin < kFrameHeaderSize + len) {
+                // Make sure a large frame will fit once the rest of it arrives.
+                if (m_buffer.size() - m_begin < kFrameHeaderSize + len) prepare(kFrameHeaderSize + len - (m_end - m_begin));
+                break;
+            }
+            Frame frame;
+            frame.type = static_cast<MsgType>(h[5]);
+            frame.flags = uint16_t(h[6] | (h[7] << 8));
+            frame.payload = {h + kFrameHeaderSize, len};
+            frame.bytes = {h, kFrameHeaderSize + len};
+            m_begin += kFrameHeaderSize + len;
+            onFrame(frame);
+        }
+        if (m_begin == m_end) m_begin = m_end = 0;
+        return true;
+    }
+};
+
+// Walks a buffer that is known to hold only complete frames (e.g. our own outgoing bytes).
+template <class F>
+void forEachFrame(std::span<const uint8_t> buffer, F&& onFrame) {
+    while (buffer.size() >= kFrameHeaderSize) {
+        uint32_t len = PacketReader::load32(buffer.data());
+        if (buffer.size() < kFrameHeaderSize + len) return;
+        Frame frame;
+        frame.type = static_cast<MsgType>(buffer[5]);
+        frame.flags = uint16_t(buffer[6] | (buffer[7] << 8));
+        frame.payload = buffer.subspan(kFrameHeaderSize, len);
+        frame.bytes = buffer.subspan(0, kFrameHeaderSize + len);
+        onFrame(frame);
+        buffer = buffer.subspan(kFrameHeaderSize + len);
+    }
+}
+
+} // namespace devious
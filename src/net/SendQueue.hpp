@@ -0,0 +1,289 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+#include "BufferPool.hpp"
+
+namespace devious {
+
+// An encoded frame (or run of frames) shared by every peer it is sent to. Relaying a
+// message to N peers costs one encode and N reference bumps, not N copies.
+using Packet = std::shared_ptr<const std::vector<uint8_t>>;
+
+// A pooled buffer to encode one packet into. take() hands it over as a Packet; its bytes
+// and shared_ptr control block return to the pool when the last reference is dropped.
+class PacketBuffer {
+    std::vector<uint8_t>* m_bytes = pool_detail::acquireBytes();
+
+public:
+    PacketBuffer() = default;
+    ~PacketBuffer() { if (m_bytes) pool_detail::releaseBytes(m_bytes); }
+
+    PacketBuffer(PacketBuffer const&) = delete;
+    PacketBuffer& operator=(PacketBuffer const&) = delete;
+
+    std::vector<uint8_t>& bytes() { return *m_bytes; }
+
+    Packet take() { return Packet(std::exchange(m_bytes, nullptr), &pool_detail::releaseBytes, PoolAllocator<uint8_t>{}); }
+};
+
+inline Packet makePacket(std::span<const uint8_t> bytes) {
+    PacketBuffer buffer;
+    buffer.bytes().assign(bytes.begin(), bytes.end());
+    return buffer.take();
+}
+
+inline Packet makePacket(std::vector<uint8_t>&& bytes) {
+    return std::make_shared<const std::vector<uint8_t>>(std::move(bytes));
+}
+
+// FIFO of packets in a power-of-two ring. Unlike a deque it keeps its storage while it
+// drains, so a queue that has seen its peak size never allocates again.
+class PacketRing {
+    std::vector<Packet> m_slots = std::vector<Packet>(16);
+    size_t m_head = 0;
+    size_t m_size = 0;
+
+    void grow() {
+        std::vector<Packet> slots(m_slots.size() * 2);
+        for (size_t i = 0; i < m_size; ++i) slots[i] = std::move((*this)[i]);
+        m_slots.swap(slots);
+        m_head = 0;
+    }
+
+public:
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    Packet& operator[](size_t i) { return m_slots[(m_head + i) & (m_slots.size() - 1)]; }
+    Packet const& operator[](size_t i) const { return m_slots[(m_head + i) & (m_slots.size() - 1)]; }
+    Packet& front() { return m_slots[m_head]; }
+
+    void push_back(Packet packet) {
+        if (m_size == m_slots.size()) grow();
+        (*this)[m_size++] = std::move(packet);
+    }
+
+    void pop_front() {
+        m_slots[m_head].reset();
+        m_head = (m_head + 1) & (m_slots.size() - 1);
+        m_size--;
+    }
+
+    void clear() {
+        while (m_size) pop_front();
+        m_head = 0;
+    }
+};
+
+// Outbound traffic classes. Control frames (pings, acks, the handshake) go to the socket
+// ahead of everything still waiting in a lane; interactive edits and bulk transfers
+// (late-join snapshots, big pastes) share what's left by weight.
+enum class Lane : uint8_t {
+    Control,
+    Interactive,
+    Bulk,
+};
+
+// Refills at `rate` bytes per second up to `burst`. A packet may go out while any tokens
+// are left and takes the bucket into debt, so packets larger than the burst still pass.
+class TokenBucket {
+    using Clock = std::chrono::steady_clock;
+    double m_rate = 0.0;  // 0 = unlimited
+    double m_burst = 0.0;
+    double m_tokens = 0.0;
+    Clock::time_point m_last;
+
+public:
+    // Starts full at `now`. Times are the caller's clock, whichever that is.
+    void configure(double rate, double burst, Clock::time_point now) {
+        m_rate = rate;
+        m_burst = burst;
+        m_tokens = burst;
+        m_last = now;
+    }
+
+    bool ready(Clock::time_point now) {
+        if (m_rate <= 0.0) return true;
+        if (now > m_last) {
+            m_tokens = std::min(m_burst, m_tokens + m_rate * std::chrono::duration<double>(now - m_last).count());
+            m_last = now;
+        }
+        return m_tokens > 0.0;
+    }
+
+    void spend(size_t bytes) { if (m_rate > 0.0) m_tokens -= double(bytes); }
+
+    // When ready() turns true again.
+    Clock::time_point readyAt() const {
+        if (m_rate <= 0.0 || m_tokens > 0.0) return m_last;
+        return m_last + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((1.0 - m_tokens) / m_rate));
+    }
+};
+
+// Per-peer queue of packets waiting for the socket. Control packets go straight onto the
+// wire queue; the others wait in their lane until schedule() commits them, a little at a
+// time so a later interactive packet never has far to queue behind bulk. The I/O thread
+// gathers the head of the wire queue into an iovec array and writes it with a single
+// scatter-gather call.
+class SendQueue {
+    // The lanes get this many bytes per round each while both have packets.
+    static constexpr int64_t kQuantum[2] = {16 * 1024, 4 * 1024};
+    // schedule() stops committing once this much is waiting for the socket.
+    static constexpr size_t kWireTarget = 64 * 1024;
+
+    PacketRing m_wire;
+    size_t m_headOffset = 0;
+    size_t m_wireBytes = 0;
+    PacketRing m_lanes[2];  // Interactive, Bulk
+    size_t m_laneBytes[2] = {};
+    int64_t m_deficit[2] = {};
+
+public:
+    void push(Packet packet, Lane lane = Lane::Control) {
+        if (!packet || packet->empty()) return;
+        if (lane == Lane::Control) {
+            m_wireBytes += packet->size();
+            m_wire.push_back(std::move(packet));
+            return;
+        }
+        size_t l = size_t(lane) - 1;
+        m_laneBytes[l] += packet->size();
+        m_lanes[l].push_back(std::move(packet));
+    }
+
+    size_t bytes() const { return m_wireBytes + m_laneBytes[0] + m_laneBytes[1]; }
+    size_t laneBytes(Lane lane) const { return lane == Lane::Control ? m_wireBytes : m_laneBytes[size_t(lane) - 1]; }
+    bool empty() const { return bytes() == 0; }
+    bool wireEmpty() const { return m_wireBytes == 0; }
+
+    // True if schedule() has something it may commit now.
+    bool canSchedule(TokenBucket& bulk, std::chrono::steady_clock::time_point now) {
+        return !m_lanes[0].empty() || (!m_lanes[1].empty() && bulk.ready(now));
+    }
+
+    // Commits lane packets to the wire, by deficit round robin between the lanes, until
+    // kWireTarget bytes are waiting. Bulk only goes while `bulk` has tokens. Calls
+    // onCommit(packet, lane) for each, in wire order.
+    template <class F>
+    void schedule(TokenBucket& bulk, std::chrono::steady_clock::time_point now, F&& onCommit) {
+        auto eligible = [&](size_t l) { return !m_lanes[l].empty() && (l == 0 || bulk.ready(now)); };
+        while (m_wireBytes < kWireTarget && (eligible(0) || eligible(1))) {
+            for (size_t l = 0; l < 2 && m_wireBytes < kWireTarget; ++l) {
+                if (!eligible(l)) {
+                    if (m_lanes[l].empty()) m_deficit[l] = 0;
+                    continue;
+                }
+                m_deficit[l] += kQuantum[l];
+                while (m_deficit[l] > 0 && m_wireBytes < kWireTarget && eligible(l)) {
+                    Packet packet = std::move(m_lanes[l].front());
+                    m_lanes[l].pop_front();
+                    size_t size = packet->size();
+                    m_laneBytes[l] -= size;
+                    m_deficit[l] -= int64_t(size);
+                    if (l == 1) bulk.spend(size);
+                    onCommit(packet, Lane(l + 1));
+                    m_wireBytes += size;
+                    m_wire.push_back(std::move(packet));
+                }
+            }
+        }
+    }
+
+    // Empties the lanes without sending: calls fn(packet, lane) for each, interactive first.
+    template <class F>
+    void drainLanes(F&& fn) {
+        for (size_t l = 0; l < 2; ++l) {
+            while (!m_lanes[l].empty()) {
+                fn(m_lanes[l].front(), Lane(l + 1));
+                m_lanes[l].pop_front();
+            }
+            m_laneBytes[l] = 0;
+            m_deficit[l] = 0;
+        }
+    }
+
+    // Fills `out` with the unsent wire bytes, oldest first; returns how many spans were used.
+    size_t gather(std::span<std::span<const uint8_t>> out) const {
+        size_t n = 0;
+        for (size_t i = 0; i < m_wire.size() && n < out.size(); ++i) {
+            auto const& p = *m_wire[i];
+            size_t offset = i == 0 ? m_headOffset : 0;
+            out[n++] = {p.data() + offset, p.size() - offset};
+        }
+        return n;
+    }
+
+    // Drops `sent` bytes from the front after a successful write.
+    void consume(size_t sent) {
+        m_wireBytes -= sent;
+        while (sent > 0) {
+            size_t left = m_wire.front()->size() - m_headOffset;
+            if (sent < left) {
+                m_headOffset += sent;
+                return;
+            }
+            sent -= left;
+            m_wire.pop_front();
+            m_headOffset = 0;
+        }
+    }
+
+    void clear() {
+        m_wire.clear();
+        m_headOffset = 0;
+        m_wireBytes = 0;
+        drainLanes([](Packet const&, Lane) {});
+    }
+};
+
+// The packets sent on a link that the peer hasn't acknowledged yet, oldest first. They
+// are numbered in the order they were queued, from 1; link control (pings, acks, resume)
+// isn't numbered, so both ends count the same frames. Past kMaxBytes the oldest packets
+// are dropped, and a peer that still needed one of them can't resume the link.
+class RetransmitBuffer {
+    PacketRing m_packets;
+    uint64_t m_first = 1;  // number of m_packets.front()
+    size_t m_bytes = 0;
+
+    void pop() {
+        m_bytes -= m_packets.front()->size();
+        m_packets.pop_front();
+        m_first++;
+    }
+
+public:
+    static constexpr size_t kMaxBytes = 8 * 1024 * 1024;
+
+    void push(Packet packet) {
+        m_bytes += packet->size();
+        m_packets.push_back(std::move(packet));
+        while (m_bytes > kMaxBytes) pop();
+    }
+
+    // Forgets everything up to and including packet `seq`.
+    void ack(uint64_t seq) {
+        while (!m_packets.empty() && m_first <= seq) pop();
+    }
+
+    // Whether every packet after `received` is still here.
+    bool covers(uint64_t received) const {
+        return received + 1 >= m_first && received + 1 <= m_first + m_packets.size();
+    }
+
+    // Calls fn(packet) for every packet after `received` that is still here.
+    template <class F>
+    void forEachAfter(uint64_t received, F&& fn) const {
+        size_t start = received + 1 > m_first ? size_t(received + 1 - m_first) : 0;
+        for (size_t i = start; i < m_packets.size(); ++i) fn(m_packets[i]);
+    }
+
+    size_t bytes() const { return m_bytes; }
+};
+
+} // namespace devious
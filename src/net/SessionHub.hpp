@@ -0,0 +1,417 @@
+#pragma once
+
+#include "Socket.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Discovery.hpp"
+#include "Protocol.hpp"
+#include "SyncEngine.hpp"
+#include "Transport.hpp"
+
+namespace devious {
+
+// What a session starts from when the hub opens it.
+struct SessionSeed {
+    std::string name;
+    std::vector<ObjectRecord> objects;  // net ids under kHostPeerId
+    std::string sessionLog;             // see SyncConfig::sessionLog
+};
+
+// Serves many sessions on one port. The hub owns the listener: it reads each new link's
+// Hello, finds the session it names (opening it on first use) and hands the link over to
+// that session's engine, which answers the Hello and takes it from there. Every session is
+// a SyncEngine of its own, so levels, peers, send queues and metrics never mix; they share
+// the hub's transport. The hub also answers latency probes on the port.
+//
+// Opening a session may mean loading a level from disk, so it happens on a thread of its
+// own; links for it wait in the hub until it's up. At most maxSessions are open at once,
+// and one that has had no peers for idleClose is closed again.
+class SessionHub {
+    struct PendingLink {
+        SocketType sock = INVALID_SOCK;
+        sockaddr_in from{};
+        std::vector<uint8_t> received;
+        std::chrono::steady_clock::time_point deadline;
+        bool done = false;
+    };
+
+    // A session, open or still opening. `engine` is null once ready if openSession refused it.
+    struct Slot {
+        std::shared_future<std::shared_ptr<SyncEngine>> engine;
+        bool keep = false;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    // A Hello is a few dozen bytes; a link whose first frame claims more isn't one of ours.
+    static constexpr uint32_t kMaxHelloPayload = 256;
+    // How long the I/O thread sleeps at most, so stop() and sessions that finished opening
+    // are noticed without a wake socket.
+    static constexpr int kMaxPollMs = 100;
+    // ... and while links wait for a session that is opening.
+    static constexpr int kOpeningPollMs = 5;
+
+    SyncConfig m_config;
+    std::shared_ptr<Transport> m_transport;
+    std::atomic<bool> m_running = false;
+    std::thread m_ioThread;
+
+    // Owned by the I/O thread.
+    SocketType m_listenSocket = INVALID_SOCK;
+    SocketType m_udpSocket = INVALID_SOCK;
+    std::vector<PendingLink> m_pending;
+    std::map<std::string, std::vector<PendingLink>> m_waiting;  // by the session still opening
+    std::vector<PollFd> m_pollFds;
+    std::vector<std::shared_ptr<SyncEngine>> m_roundSessions;
+    std::vector<std::pair<std::string, std::shared_ptr<SyncEngine>>> m_idle;
+
+    std::mutex m_sessionMutex;
+    std::map<std::string, Slot> m_sessions;
+    // Held while sessions are walked or closed, so a session isn't stopped under a caller.
+    std::mutex m_closeMutex;
+
+public:
+    // Called for a session id nobody serves yet, on a thread of its own. Fills in `seed`
+    // and returns true to open the session; false refuses the id.
+    std::function<bool(std::string const& id, SessionSeed& seed)> openSession;
+    // Called on the I/O thread just before an idle session is closed, e.g. to save it.
+    std::function<void(std::string const& id, SyncEngine& session)> closingSession;
+    // Every session's events, with its id. Called on that session's I/O thread.
+    std::function<void(std::string const& id, SyncEvent event)> onEvent;
+
+    // Set before start(). Ids past the limit are refused like unknown ones.
+    size_t maxSessions = 64;
+    std::chrono::milliseconds idleClose = std::chrono::minutes(5);
+
+    // `config` is every session's; the hub listens on its port. Runs over the real network
+    // unless given another transport.
+    explicit SessionHub(SyncConfig config = {}, std::shared_ptr<Transport> transport = nullptr)
+        : m_config(config), m_transport(transport ? std::move(transport) : std::make_shared<SystemTransport>()) {}
+    ~SessionHub() { stop(); }
+
+    SessionHub(SessionHub const&) = delete;
+    SessionHub& operator=(SessionHub const&) = delete;
+
+    // Opens the port and starts routing. False if the port is taken.
+    bool start() {
+        if (m_running) return true;
+        m_listenSocket = m_transport->openListener(m_config.port);
+        if (!IS_VALID(m_listenSocket)) return false;
+        m_udpSocket = m_transport->openDatagram(m_config.port, false);
+        m_running = true;
+        if (m_config.ioThread) m_ioThread = std::thread([this] { while (m_running) runRound(true); });
+        return true;
+    }
+
+    // Stops routing and every session.
+    void stop() {
+        if (!m_running.exchange(false)) return;
+        if (m_ioThread.joinable()) m_ioThread.join();
+        for (auto& link : m_pending) m_transport->close(link.sock);
+        m_pending.clear();
+        for (auto& [id, links] : m_waiting) {
+            for (auto& link : links) m_transport->close(link.sock);
+        }
+        m_waiting.clear();
+        closeSocket(m_listenSocket);
+        closeSocket(m_udpSocket);
+        std::map<std::string, Slot> sessions;
+        {
+            std::lock_guard<std::mutex> lock(m_sessionMutex);
+            sessions.swap(m_sessions);
+        }
+        for (auto& [id, slot] : sessions) {
+            if (auto session = slot.engine.get()) session->stop();
+        }
+    }
+
+    // Without an I/O thread: one turn of the hub's loop and of every open session's.
+    void runOnce() {
+        if (!m_running || m_config.ioThread) return;
+        runRound(false);
+        {
+            std::lock_guard<std::mutex> lock(m_sessionMutex);
+            m_roundSessions.clear();
+            for (auto& [id, slot] : m_sessions) {
+                if (auto session = ready(slot)) m_roundSessions.push_back(session);
+            }
+        }
+        for (auto& session : m_roundSessions) session->runOnce();
+    }
+
+    // Opens session `id` now instead of on its first client, on the calling thread. A kept
+    // session is never closed for being idle. False if openSession refused it or the hub
+    // is full.
+    bool open(std::string const& id, bool keep = false) {
+        auto engine = reserve(id, keep, false);
+        return engine.valid() && engine.get() != nullptr;
+    }
+
+    // Stops session `id`. Its peers are dropped; a client that comes back reopens it.
+    void close(std::string const& id) {
+        std::lock_guard<std::mutex> closing(m_closeMutex);
+        Slot slot;
+        {
+            std::lock_guard<std::mutex> lock(m_sessionMutex);
+            auto it = m_sessions.find(id);
+            if (it == m_sessions.end()) return;
+            slot = std::move(it->second);
+            m_sessions.erase(it);
+        }
+        if (auto session = slot.engine.get()) session->stop();
+    }
+
+    // Calls fn(id, session) for every open session. None is closed until it returns; one
+    // opening meanwhile may be missed.
+    template <class F>
+    void forEachSession(F&& fn) {
+        std::lock_guard<std::mutex> closing(m_closeMutex);
+        std::vector<std::pair<std::string, std::shared_ptr<SyncEngine>>> open;
+        {
+            std::lock_guard<std::mutex> lock(m_sessionMutex);
+            for (auto& [id, slot] : m_sessions) {
+                if (auto session = ready(slot)) open.emplace_back(id, std::move(session));
+            }
+        }
+        for (auto& [id, session] : open) fn(id, *session);
+    }
+
+private:
+    void closeSocket(SocketType& s) {
+        if (IS_VALID(s)) m_transport->close(s);
+        s = INVALID_SOCK;
+    }
+
+    uint64_t nowUs() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(m_transport->now().time_since_epoch()).count();
+    }
+
+    // The slot's engine if it's done opening, null otherwise.
+    static std::shared_ptr<SyncEngine> ready(Slot const& slot) {
+        if (slot.engine.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return nullptr;
+        return slot.engine.get();
+    }
+
+    // The slot for `id`; a new one only while the hub isn't full. A new session is opened
+    // on a thread of its own if `async`, else on the calling thread before returning.
+    std::shared_future<std::shared_ptr<SyncEngine>> reserve(std::string const& id, bool keep, bool async) {
+        std::shared_future<std::shared_ptr<SyncEngine>> engine;
+        std::promise<std::shared_ptr<SyncEngine>> opened;
+        {
+            std::lock_guard<std::mutex> lock(m_sessionMutex);
+            if (auto it = m_sessions.find(id); it != m_sessions.end()) {
+                it->second.keep |= keep;
+                return it->second.engine;
+            }
+            if (m_sessions.size() >= maxSessions || !openSession) return {};
+            if (async) engine = std::async(std::launch::async, [this, id] { return create(id); }).share();
+            else engine = opened.get_future().share();
+            m_sessions.emplace(id, Slot{engine, keep, m_transport->now()});
+        }
+        if (async) return engine;
+        auto session = create(id);
+        std::lock_guard<std::mutex> lock(m_sessionMutex);
+        opened.set_value(session);
+        if (!session) m_sessions.erase(id);
+        return engine;
+    }
+
+    // Runs outside m_sessionMutex: openSession may take a while.
+    std::shared_ptr<SyncEngine> create(std::string const& id) {
+        SessionSeed seed;
+        if (!openSession(id, seed)) return nullptr;
+        SyncConfig config = m_config;
+        config.listen = false;
+        config.sessionLog = seed.sessionLog;
+        auto session = std::make_shared<SyncEngine>(config, m_transport);
+        session->onEvent = [this, id](SyncEvent event) {
+            if (onEvent) onEvent(id, event);
+        };
+        session->startHost(std::move(seed.name), std::move(seed.objects), id);
+        return session;
+    }
+
+    void runRound(bool block) {
+        auto& fds = m_pollFds;
+        fds.clear();
+        auto watch = [&](SocketType s) {
+            PollFd pfd;
+            pfd.fd = s;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+        };
+        watch(m_listenSocket);
+        size_t udpIdx = fds.size();
+        if (IS_VALID(m_udpSocket)) watch(m_udpSocket);
+        size_t pendingIdx = fds.size();
+        auto now = m_transport->now();
+        int timeoutMs = m_waiting.empty() ? kMaxPollMs : kOpeningPollMs;
+        for (auto& link : m_pending) {
+            watch(link.sock);
+            auto untilDeadline = std::chrono::duration_cast<std::chrono::milliseconds>(link.deadline - now).count() + 1;
+            timeoutMs = (int)std::clamp<long long>(untilDeadline, 0, timeoutMs);
+        }
+        if (m_transport->poll(fds, block ? timeoutMs : 0) < 0) return;
+
+        if (fds[0].revents & POLLIN) acceptLinks();
+        if (udpIdx < pendingIdx && (fds[udpIdx].revents & POLLIN)) answerProbes();
+        // Links accepted this round are past the end of fds and wait for the next one.
+        for (size_t i = 0; i < fds.size() - pendingIdx; ++i) {
+            if (fds[pendingIdx + i].revents & (POLLIN | POLLERR | POLLHUP)) readHello(m_pending[i]);
+        }
+        now = m_transport->now();
+        for (auto& link : m_pending) {
+            if (link.done || now < link.deadline) continue;
+            m_transport->close(link.sock);
+            link.done = true;
+        }
+        std::erase_if(m_pending, [](PendingLink const& link) { return link.done; });
+        handOver();
+        closeIdle();
+    }
+
+    void acceptLinks() {
+        while (true) {
+            PendingLink link;
+            link.sock = m_transport->accept(m_listenSocket, link.from);
+            if (!IS_VALID(link.sock)) return;
+            link.deadline = m_transport->now() + std::chrono::milliseconds(m_config.connectTimeoutMs);
+            m_pending.push_back(std::move(link));
+        }
+    }
+
+    // Reads until the link's first frame is in. It must be a Hello, of any version.
+    void readHello(PendingLink& link) {
+        uint8_t buffer[4096];
+        while (true) {
+            long n = m_transport->recv(link.sock, buffer);
+            if (n == kWouldBlock) return;
+            if (n <= 0) break;
+            link.received.insert(link.received.end(), buffer, buffer + n);
+            if (link.received.size() < kFrameHeaderSize) continue;
+            uint32_t len = PacketReader::load32(link.received.data());
+            if (MsgType(link.received[5]) != MsgType::Hello || len > kMaxHelloPayload) break;
+            if (link.received.size() < kFrameHeaderSize + len) continue;
+            HelloMsg hello;
+            PacketReader reader(std::span<const uint8_t>(link.received.data() + kFrameHeaderSize, len));
+            if (!HelloMsg::read(reader, hello)) break;
+            route(link, hello);
+            return;
+        }
+        m_transport->close(link.sock);
+        link.done = true;
+    }
+
+    void route(PendingLink& link, HelloMsg const& hello) {
+        link.done = true;
+        if (hello.version != kProtocolVersion) {
+            refuse(link, HelloStatus::VersionMismatch);
+            return;
+        }
+        auto engine = reserve(hello.session, false, true);
+        if (!engine.valid()) {
+            refuse(link, HelloStatus::UnknownSession);
+            return;
+        }
+        m_waiting[hello.session].push_back(std::move(link));
+    }
+
+    // Hands waiting links to the sessions that are done opening, or refuses them if their
+    // session couldn't be opened.
+    void handOver() {
+        for (auto it = m_waiting.begin(); it != m_waiting.end();) {
+            std::shared_ptr<SyncEngine> session;
+            {
+                std::lock_guard<std::mutex> lock(m_sessionMutex);
+                auto slot = m_sessions.find(it->first);
+                if (slot != m_sessions.end()) {
+                    if (slot->second.engine.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+                        ++it;
+                        continue;
+                    }
+                    session = slot->second.engine.get();
+                    slot->second.lastUsed = m_transport->now();
+                    if (!session) m_sessions.erase(slot);
+                }
+            }
+            for (auto& link : it->second) {
+                if (session) session->adopt(link.sock, link.from, std::move(link.received));
+                else refuse(link, HelloStatus::UnknownSession);
+            }
+            it = m_waiting.erase(it);
+        }
+    }
+
+    // Closes the sessions nobody has been in for idleClose. While forEachSession is busy
+    // that waits for a later round.
+    void closeIdle() {
+        std::unique_lock<std::mutex> closing(m_closeMutex, std::try_to_lock);
+        if (!closing) return;
+        auto now = m_transport->now();
+        m_idle.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_sessionMutex);
+            for (auto it = m_sessions.begin(); it != m_sessions.end();) {
+                auto session = ready(it->second);
+                if (!session || it->second.keep || session->peerCount() > 0 || m_waiting.contains(it->first)) {
+                    if (session && session->peerCount() > 0) it->second.lastUsed = now;
+                    ++it;
+                    continue;
+                }
+                if (now - it->second.lastUsed < idleClose) {
+                    ++it;
+                    continue;
+                }
+                m_idle.emplace_back(it->first, std::move(session));
+                it = m_sessions.erase(it);
+            }
+        }
+        for (auto& [id, session] : m_idle) {
+            if (closingSession) closingSession(id, *session);
+            session->stop();
+        }
+        m_idle.clear();
+    }
+
+    // The link is closed right after; the answer is small enough to go in one write.
+    void refuse(PendingLink& link, HelloStatus status) {
+        std::vector<uint8_t> bytes;
+        PacketWriter w(bytes);
+        HelloAckMsg ack;
+        ack.status = status;
+        ack.write(w);
+        std::span<const uint8_t> part(bytes);
+        m_transport->send(link.sock, std::span(&part, 1));
+        m_transport->close(link.sock);
+    }
+
+    void answerProbes() {
+        uint8_t buffer[512];
+        while (true) {
+            sockaddr_in from;
+            long n = m_transport->recvFrom(m_udpSocket, buffer, from);
+            if (n <= 0) return;
+            PacketReader reader(std::span<const uint8_t>(buffer, (size_t)n));
+            DiscoveryProbe probe;
+            if (!DiscoveryProbe::read(reader, probe)) continue;
+            uint64_t received = nowUs();
+            std::vector<uint8_t> bytes;
+            PacketWriter w(bytes);
+            DiscoveryEcho{probe.sentUs, received, nowUs()}.write(w);
+            m_transport->sendTo(m_udpSocket, bytes, from);
+        }
+    }
+};
+
+} // namespace devious
@@ -0,0 +1,288 @@
+#pragma once
+
+#include "Socket.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <span>
+#include <vector>
+#include "ObjectBlock.hpp"
+#include "Protocol.hpp"
+#include "Snapshot.hpp"
+#include "TransformBlock.hpp"
+
+#ifndef _WIN32
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+namespace devious {
+
+// A session log is every edit frame the host applied, appended as it happens:
+//
+//   file   := "DVSL" | u16 format version | u16 reserved | record*
+//   record := u64 microseconds since the log was opened | frame
+//
+// Frames are the Batch, ObjectBlock and TransformBlock frames exactly as they came off the wire, so the
+// log costs what the traffic costs. Snapshot markers are the late-join frames: a
+// SnapshotBegin, its compressed chunks and a SnapshotEnd, all with the same time. One is
+// written when the log is opened and more as it grows, so recovery only replays the
+// edits after the last one. A record cut short by a crash ends the log.
+constexpr uint32_t kSessionLogMagic = 0x4C535644; // "DVSL"
+constexpr uint16_t kSessionLogVersion = 1;
+constexpr size_t kSessionLogHeaderSize = 8;
+constexpr size_t kSessionLogTimeSize = 8;
+
+inline bool isEditFrame(MsgType type) {
+    return type == MsgType::Batch || type == MsgType::ObjectBlock || type == MsgType::TransformBlock;
+}
+
+// Calls fn(EditOp&&) for every edit in an edit frame, decoded the way the engine applies
+// them: stamped with the batch stamp, and none of a batch with a malformed record.
+template <class F>
+void decodeEdits(Frame const& frame, F&& fn) {
+    PacketReader reader(frame.payload);
+    if (frame.type == MsgType::TransformBlock) {
+        thread_local std::vector<TransformObjectMsg> transforms;
+        uint64_t stamp = 0;
+        if (readTransformBlock(reader, transforms, stamp)) for (auto const& t : transforms) fn(EditOp{t, stamp});
+        return;
+    }
+    if (frame.type == MsgType::ObjectBlock) {
+        auto block = std::make_shared<ObjectBlock>();
+        uint64_t stamp = 0;
+        if (readObjectBlock(reader, *block, stamp)) fn(EditOp{ObjectBlockMsg{std::move(block)}, stamp});
+        return;
+    }
+    if (frame.type != MsgType::Batch) return;
+    BatchHeader header;
+    if (!BatchHeader::read(reader, header)) return;
+    thread_local std::vector<EditOp> ops;
+    ops.clear();
+    for (uint16_t i = 0; i < header.count; ++i) {
+        EditOp op;
+        if (!EditOp::read(static_cast<MsgType>(reader.u8()), reader, op)) return;
+        op.stamp = header.stamp;
+        ops.push_back(std::move(op));
+    }
+    for (auto& op : ops) fn(std::move(op));
+}
+
+// Appends records to a log file. Records are buffered and written by flush(), which the
+// I/O thread calls once per round, so a busy session costs one write per poll.
+class SessionLogWriter {
+    std::ofstream m_out;
+    std::vector<uint8_t> m_buffer;
+    std::chrono::steady_clock::time_point m_start;
+    uint64_t m_bytesSinceMarker = 0;
+
+public:
+    // Starts a new log at `path`, replacing any file there.
+    bool open(std::filesystem::path const& path) {
+        close();
+        m_out.open(path, std::ios::binary | std::ios::trunc);
+        if (!m_out) return false;
+        m_start = std::chrono::steady_clock::now();
+        m_bytesSinceMarker = 0;
+        PacketWriter w(m_buffer);
+        w.u32(kSessionLogMagic);
+        w.u16(kSessionLogVersion);
+        w.u16(0);
+        return flush();
+    }
+
+    bool isOpen() const { return m_out.is_open(); }
+    uint64_t bytesSinceMarker() const { return m_bytesSinceMarker; }
+
+    void append(std::span<const uint8_t> frame) {
+        if (!isOpen()) return;
+        auto timeUs = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_start).count();
+        PacketWriter w(m_buffer);
+        w.u64(timeUs);
+        w.bytes(frame.data(), frame.size());
+        m_bytesSinceMarker += frame.size();
+    }
+
+    void appendSnapshot(Snapshot& snapshot) {
+        std::vector<uint8_t> frame;
+        PacketWriter w(frame);
+        SnapshotBeginMsg{snapshot.id, snapshot.objectCount(), snapshot.chunkCount(), 0}.write(w);
+        append(frame);
+        for (uint16_t i = 0; i < snapshot.chunkCount(); ++i) append(*snapshot.chunkFrame(i));
+        frame.clear();
+        SnapshotEndMsg{snapshot.id}.write(w);
+        append(frame);
+        m_bytesSinceMarker = 0;
+    }
+
+    // A failed write closes the log rather than leaving a hole in the middle of it.
+    bool flush() {
+        if (!isOpen() || m_buffer.empty()) return isOpen();
+        m_out.write((char const*)m_buffer.data(), (std::streamsize)m_buffer.size());
+        m_buffer.clear();
+        if (m_out.flush()) return true;
+        m_out.close();
+        return false;
+    }
+
+    void close() {
+        flush();
+        if (m_out.is_open()) m_out.close();
+        m_buffer.clear();
+    }
+};
+
+// A read-only view of a whole file, mapped rather than read so a long session is never
+// copied before replaying it.
+class MappedFile {
+    std::span<const uint8_t> m_data;
+    #ifdef _WIN32
+    HANDLE m_file = INVALID_HANDLE_VALUE;
+    HANDLE m_mapping = nullptr;
+    #endif
+
+public:
+    MappedFile() = default;
+    ~MappedFile() { close(); }
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+
+    bool open(std::filesystem::path const& path) {
+        close();
+        #ifdef _WIN32
+        m_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) return false;
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(m_file, &size)) { close(); return false; }
+        if (size.QuadPart == 0) return true;
+        m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        void* view = m_mapping ? MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (!view) { close(); return false; }
+        m_data = {(uint8_t const*)view, (size_t)size.QuadPart};
+        #else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        void* view = nullptr;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) view = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (view == MAP_FAILED) return false;
+        if (view) m_data = {(uint8_t const*)view, (size_t)st.st_size};
+        #endif
+        return true;
+    }
+
+    void close() {
+        #ifdef _WIN32
+        if (m_data.data()) UnmapViewOfFile(m_data.data());
+        if (m_mapping) CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+        m_mapping = nullptr;
+        m_file = INVALID_HANDLE_VALUE;
+        #else
+        if (m_data.data()) munmap((void*)m_data.data(), m_data.size());
+        #endif
+        m_data = {};
+    }
+
+    std::span<const uint8_t> data() const { return m_data; }
+};
+
+class SessionLogReader {
+    MappedFile m_file;
+    std::span<const uint8_t> m_records;
+
+public:
+    // False if the file is missing or isn't a session log of this version.
+    bool open(std::filesystem::path const& path) {
+        m_records = {};
+        if (!m_file.open(path)) return false;
+        PacketReader header(m_file.data());
+        uint32_t magic = header.u32();
+        uint16_t version = header.u16();
+        header.u16();
+        if (!header.ok() || magic != kSessionLogMagic || version != kSessionLogVersion) return false;
+        m_records = m_file.data().subspan(kSessionLogHeaderSize);
+        return true;
+    }
+
+    // Calls fn(timeUs, frame) for every complete record.
+    template <class F>
+    void forEachRecord(F&& fn) const {
+        auto rest = m_records;
+        while (rest.size() >= kSessionLogTimeSize + kFrameHeaderSize) {
+            uint64_t timeUs = PacketReader::load32(rest.data()) | (uint64_t(PacketReader::load32(rest.data() + 4)) << 32);
+            uint32_t len = PacketReader::load32(rest.data() + kSessionLogTimeSize);
+            size_t size = kSessionLogTimeSize + kFrameHeaderSize + size_t(len);
+            if (len > kMaxPayloadSize || rest.size() < size) return;
+            forEachFrame(rest.subspan(kSessionLogTimeSize, size - kSessionLogTimeSize), [&](Frame const& frame) { fn(timeUs, frame); });
+            rest = rest.subspan(size);
+        }
+    }
+
+    // Walks the log from its first (or last) complete snapshot marker: calls
+    // onSnapshot(records, stamps) with the marker's level, then onEdits(timeUs, frame) for
+    // every edit frame after it. Later markers are skipped. Returns false
+    // if the log has no complete marker.
+    template <class S, class E>
+    bool replay(bool fromLastMarker, S&& onSnapshot, E&& onEdits) const {
+        size_t index = 0, markerStart = 0, chosen = SIZE_MAX;
+        uint32_t markerId = 0;
+        forEachRecord([&](uint64_t, Frame const& frame) {
+            PacketReader reader(frame.payload);
+            if (frame.type == MsgType::SnapshotBegin) {
+                markerId = reader.u32();
+                markerStart = index;
+            }
+            else if (frame.type == MsgType::SnapshotEnd && reader.u32() == markerId) {
+                if (fromLastMarker || chosen == SIZE_MAX) chosen = markerStart;
+            }
+            index++;
+        });
+        if (chosen == SIZE_MAX) return false;
+
+        std::vector<ObjectRecord> records;
+        std::vector<ObjectStamps> stamps;
+        bool inMarker = false, started = false;
+        index = 0;
+        forEachRecord([&](uint64_t timeUs, Frame const& frame) {
+            if (index++ < chosen) return;
+            if (!started) {
+                if (frame.type == MsgType::SnapshotBegin) inMarker = true;
+                else if (frame.type == MsgType::SnapshotChunk && inMarker) {
+                    PacketReader reader(frame.payload);
+                    SnapshotChunkHeader header;
+                    if (SnapshotChunkHeader::read(reader, header)) decodeSnapshotChunk(header, reader.rest(), records, stamps);
+                }
+                else if (frame.type == MsgType::SnapshotEnd) {
+                    started = true;
+                    onSnapshot(std::move(records), std::move(stamps));
+                }
+                return;
+            }
+            if (isEditFrame(frame.type)) onEdits(timeUs, frame);
+        });
+        return true;
+    }
+};
+
+// Rebuilds the level as it stood at the end of a log: its last snapshot marker with every
+// edit after it applied on top. False if there is no usable log at `path`.
+inline bool recoverSessionLog(std::filesystem::path const& path, std::vector<ObjectRecord>& objects, std::vector<ObjectStamps>& stamps) {
+    SessionLogReader log;
+    if (!log.open(path)) return false;
+    LevelState state;
+    bool ok = log.replay(true,
+        [&](std::vector<ObjectRecord>&& records, std::vector<ObjectStamps>&& recordStamps) { state.reset(std::move(records), std::move(recordStamps)); },
+        [&](uint64_t, Frame const& frame) { decodeEdits(frame, [&](EditOp&& op) { state.apply(op); }); });
+    if (!ok) return false;
+    objects = state.objects();
+    stamps = state.objectStamps();
+    return true;
+}
+
+} // namespace devious
@@ -0,0 +1,491 @@
+#pragma once
+
+#include "Transport.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace devious {
+
+// How packets fare on their way from one machine to another.
+struct LinkConditions {
+    // One-way delay, plus up to `jitter` more picked for every packet.
+    std::chrono::microseconds latency{0};
+    std::chrono::microseconds jitter{0};
+    // 0 means unlimited. Headers count against it.
+    double bytesPerSecond = 0;
+    // Chance that a packet is lost. A lost stream segment arrives a round trip late, as if
+    // fast retransmit resent it, and holds up everything behind it; a lost datagram is gone.
+    double loss = 0;
+    // Chance that a packet is held back one more latency, so later ones overtake it.
+    // Streams still deliver in order.
+    double reorder = 0;
+};
+
+struct SimStats {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;       // payload, without headers
+    uint64_t lost = 0;        // stream segments resent and datagrams dropped
+    uint64_t reordered = 0;
+    uint64_t resets = 0;      // streams cut by resetStreams()
+};
+
+// An in-process network of simulated machines on a virtual clock. Nothing moves until the
+// owner calls advance(): packets in flight arrive in time order, and every random choice
+// comes from one seeded generator, so the same seed and the same calls play out the same
+// way every time. Single threaded: engines on it run without an I/O thread (see
+// SyncConfig::ioThread) and are stepped with runOnce(). It must outlive them.
+//
+// Streams behave like TCP minus its handshake losses: connecting takes a round trip, bytes
+// arrive in order, kStreamWindow bytes in flight or unread push back on the writer, and a
+// close reaches the peer after the data. Machines are known by IPv4 address. 127.0.0.1 is
+// the machine itself, and traffic that stays on one machine is instant and never lost.
+class SimNetwork {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t kStreamWindow = 256 * 1024;
+    static constexpr size_t kSegmentSize = 1460;
+    static constexpr size_t kStreamHeader = 40;
+    static constexpr size_t kDatagramHeader = 28;
+    static constexpr size_t kListenBacklog = 16;
+    // Datagrams a socket holds before it drops more, like a full receive buffer.
+    static constexpr size_t kDatagramQueue = 256;
+    // How long the sender takes to notice a lost segment, on top of the round trip.
+    static constexpr auto kRetransmitDelay = std::chrono::milliseconds(5);
+
+private:
+    enum class Kind : uint8_t { Listener, Stream, Datagram };
+
+    struct Datagram {
+        sockaddr_in from;
+        std::vector<uint8_t> bytes;
+    };
+
+    struct Socket {
+        Kind kind = Kind::Stream;
+        uint32_t ip = 0;
+        uint16_t port = 0;
+        // Listener
+        std::deque<SocketType> backlog;
+        // Stream
+        SocketType peer = INVALID_SOCK;
+        uint32_t peerIp = 0;
+        uint16_t peerPort = 0;
+        bool connecting = false;
+        bool finished = false;  // the peer closed and all it sent has arrived
+        int error = 0;
+        std::vector<uint8_t> inbox;
+        size_t inboxRead = 0;
+        size_t inFlight = 0;    // sent by us, not arrived yet
+        Clock::time_point lastArrival;  // of what we sent, so nothing overtakes it
+        // Datagram
+        bool broadcast = false;
+        std::deque<Datagram> datagrams;
+
+        size_t unread() const { return inbox.size() - inboxRead; }
+    };
+
+    // A machine's view of the network.
+    class Machine final : public Transport {
+        SimNetwork& m_net;
+        uint32_t m_ip;
+
+    public:
+        Machine(SimNetwork& net, uint32_t ip) : m_net(net), m_ip(ip) {}
+
+        Clock::time_point now() override { return m_net.m_now; }
+        SocketType openListener(uint16_t port) override { return m_net.openListener(m_ip, port); }
+        SocketType accept(SocketType listener, sockaddr_in& from) override { return m_net.accept(listener, from); }
+        SocketType connect(sockaddr_in const& to, bool& pending) override { return m_net.connect(m_ip, to, pending); }
+        int connectError(SocketType s) override { return m_net.connectError(s); }
+        long send(SocketType s, std::span<const std::span<const uint8_t>> parts) override { return m_net.send(s, parts); }
+        long recv(SocketType s, std::span<uint8_t> into) override { return m_net.recv(s, into); }
+        SocketType openDatagram(uint16_t port, bool broadcast) override { return m_net.openDatagram(m_ip, port, broadcast); }
+        long sendTo(SocketType s, std::span<const uint8_t> datagram, sockaddr_in const& to) override { return m_net.sendTo(s, datagram, to); }
+        long recvFrom(SocketType s, std::span<uint8_t> into, sockaddr_in& from) override { return m_net.recvFrom(s, into, from); }
+        uint16_t localPort(SocketType s) override { return m_net.localPort(s); }
+        int poll(std::span<PollFd> fds, int) override { return m_net.poll(fds); }
+        void close(SocketType s) override { m_net.close(s); }
+    };
+
+    Clock::time_point m_now = Clock::time_point{} + std::chrono::hours(1);
+    std::mt19937_64 m_rng;
+    LinkConditions m_default;
+    std::map<std::pair<uint32_t, uint32_t>, LinkConditions> m_links;
+    std::map<std::pair<uint32_t, uint32_t>, Clock::time_point> m_linkFree;
+    std::set<uint32_t> m_machines;
+    std::map<uint32_t, uint16_t> m_nextPort;
+    // Ordered, so broadcasts and lookups visit sockets the same way every run.
+    std::map<SocketType, Socket> m_sockets;
+    SocketType m_nextSocket = 1;
+    std::map<std::pair<Clock::time_point, uint64_t>, std::function<void()>> m_events;
+    uint64_t m_nextOrder = 0;
+    SimStats m_stats;
+
+public:
+    explicit SimNetwork(uint64_t seed = 1) : m_rng(seed) {}
+
+    SimNetwork(SimNetwork const&) = delete;
+    SimNetwork& operator=(SimNetwork const&) = delete;
+
+    // A machine at `ip` (dotted quad), for one engine to run on.
+    std::shared_ptr<Transport> attach(std::string const& ip) {
+        uint32_t addr = parse(ip);
+        m_machines.insert(addr);
+        return std::make_shared<Machine>(*this, addr);
+    }
+
+    // Between every two machines, unless set for the pair.
+    void setConditions(LinkConditions const& conditions) { m_default = conditions; }
+    // From one machine to another; the way back is set separately.
+    void setConditions(std::string const& from, std::string const& to, LinkConditions const& conditions) {
+        m_links[{parse(from), parse(to)}] = conditions;
+    }
+
+    // Cuts every stream to or from the machine at `ip`, as if its cable was pulled. Both
+    // ends see the error at once; what was in flight is lost.
+    void resetStreams(std::string const& ip) {
+        uint32_t addr = parse(ip);
+        for (auto& [id, s] : m_sockets) {
+            if (s.kind != Kind::Stream || s.error || (s.ip != addr && s.peerIp != addr)) continue;
+            s.error = ECONNRESET;
+            s.connecting = false;
+            m_stats.resets++;
+        }
+    }
+
+    Clock::time_point now() const { return m_now; }
+
+    // When the next packet arrives; Clock::time_point::max() with nothing in flight.
+    Clock::time_point nextEvent() const {
+        return m_events.empty() ? Clock::time_point::max() : m_events.begin()->first.first;
+    }
+
+    // Delivers everything due by `until`, in order, and moves the clock there.
+    void advance(Clock::time_point until) {
+        while (!m_events.empty() && m_events.begin()->first.first <= until) {
+            auto event = m_events.extract(m_events.begin());
+            m_now = std::max(m_now, event.key().first);
+            event.mapped()();
+        }
+        m_now = std::max(m_now, until);
+    }
+
+    SimStats const& stats() const { return m_stats; }
+
+private:
+    static uint32_t parse(std::string const& ip) {
+        in_addr addr{};
+        inet_pton(AF_INET, ip.c_str(), &addr);
+        return ntohl(addr.s_addr);
+    }
+
+    // Uniform in [0, 1), computed here so a seed means the same thing on every standard library.
+    double uniform() { return double(m_rng() >> 11) * 0x1.0p-53; }
+
+    static Clock::duration seconds(double s) {
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(s));
+    }
+
+    LinkConditions const& conditions(uint32_t from, uint32_t to) const {
+        static LinkConditions const perfect;
+        if (from == to) return perfect;
+        auto it = m_links.find({from, to});
+        return it != m_links.end() ? it->second : m_default;
+    }
+
+    // When a packet of `wireBytes` sent now from `from` reaches `to`. A stream segment that
+    // gets lost is counted and arrives late instead; a lost datagram sets `lost`.
+    Clock::time_point transit(uint32_t from, uint32_t to, size_t wireBytes, bool stream, bool& lost) {
+        auto const& link = conditions(from, to);
+        auto sent = m_now;
+        if (link.bytesPerSecond > 0) {
+            auto& free = m_linkFree[{from, to}];
+            sent = std::max(sent, free) + seconds(double(wireBytes) / link.bytesPerSecond);
+            free = sent;
+        }
+        auto arrival = sent + link.latency;
+        if (link.jitter.count() > 0) arrival += seconds(uniform() * std::chrono::duration<double>(link.jitter).count());
+        if (link.reorder > 0 && uniform() < link.reorder) {
+            arrival += std::max<Clock::duration>(link.latency, std::chrono::milliseconds(1));
+            m_stats.reordered++;
+        }
+        lost = link.loss > 0 && uniform() < link.loss;
+        if (lost) m_stats.lost++;
+        if (lost && stream) {
+            arrival += kRetransmitDelay + 2 * link.latency;
+            lost = false;
+        }
+        return arrival;
+    }
+
+    void at(Clock::time_point when, std::function<void()> fn) {
+        m_events.emplace(std::make_pair(std::max(when, m_now), m_nextOrder++), std::move(fn));
+    }
+
+    Socket* find(SocketType s) {
+        auto it = m_sockets.find(s);
+        return it != m_sockets.end() ? &it->second : nullptr;
+    }
+
+    SocketType add(Socket socket) {
+        SocketType id = m_nextSocket++;
+        m_sockets.emplace(id, std::move(socket));
+        return id;
+    }
+
+    uint16_t ephemeralPort(uint32_t ip) {
+        auto& next = m_nextPort.try_emplace(ip, uint16_t(49152)).first->second;
+        return next++;
+    }
+
+    uint32_t resolve(uint32_t self, sockaddr_in const& to) const {
+        uint32_t addr = ntohl(to.sin_addr.s_addr);
+        return addr == INADDR_LOOPBACK ? self : addr;
+    }
+
+    SocketType openListener(uint32_t ip, uint16_t port) {
+        for (auto const& [id, s] : m_sockets) {
+            if (s.kind == Kind::Listener && s.ip == ip && s.port == port) return INVALID_SOCK;
+        }
+        Socket s;
+        s.kind = Kind::Listener;
+        s.ip = ip;
+        s.port = port ? port : ephemeralPort(ip);
+        return add(std::move(s));
+    }
+
+    SocketType accept(SocketType listener, sockaddr_in& from) {
+        auto* l = find(listener);
+        if (!l || l->kind != Kind::Listener || l->backlog.empty()) return INVALID_SOCK;
+        SocketType s = l->backlog.front();
+        l->backlog.pop_front();
+        auto const& accepted = m_sockets.at(s);
+        from = sock::address(accepted.peerIp, accepted.peerPort);
+        return s;
+    }
+
+    SocketType connect(uint32_t ip, sockaddr_in const& to, bool& pending) {
+        pending = true;
+        Socket c;
+        c.ip = ip;
+        c.port = ephemeralPort(ip);
+        c.peerIp = resolve(ip, to);
+        c.peerPort = ntohs(to.sin_port);
+        c.connecting = true;
+        c.lastArrival = m_now;
+        uint32_t dst = c.peerIp;
+        uint16_t dstPort = c.peerPort, srcPort = c.port;
+        SocketType id = add(std::move(c));
+        // Nobody at that address: the attempt never hears back.
+        if (!m_machines.contains(dst)) return id;
+
+        bool lost;
+        at(transit(ip, dst, kStreamHeader, false, lost), [this, id, ip, srcPort, dst, dstPort] {
+            bool lost;
+            auto answered = transit(dst, ip, kStreamHeader, false, lost);
+            Socket* listener = nullptr;
+            for (auto& [lid, s] : m_sockets) if (s.kind == Kind::Listener && s.ip == dst && s.port == dstPort) listener = &s;
+            if (!find(id)) return;
+            if (!listener || listener->backlog.size() >= kListenBacklog) {
+                at(answered, [this, id] {
+                    if (auto* c = find(id); c && c->connecting) {
+                        c->connecting = false;
+                        c->error = ECONNREFUSED;
+                    }
+                });
+                return;
+            }
+            Socket server;
+            server.ip = dst;
+            server.port = dstPort;
+            server.peer = id;
+            server.peerIp = ip;
+            server.peerPort = srcPort;
+            // What the server writes can't reach the client before the handshake does.
+            server.lastArrival = answered;
+            SocketType serverId = add(std::move(server));
+            listener->backlog.push_back(serverId);
+            find(id)->peer = serverId;
+            at(answered, [this, id] {
+                if (auto* c = find(id); c && c->connecting) c->connecting = false;
+            });
+        });
+        return id;
+    }
+
+    int connectError(SocketType s) {
+        auto* c = find(s);
+        return c ? c->error : ENOTSOCK;
+    }
+
+    long send(SocketType s, std::span<const std::span<const uint8_t>> parts) {
+        auto* c = find(s);
+        if (!c || c->kind != Kind::Stream || c->error) return kSocketError;
+        if (c->connecting) return kWouldBlock;
+        auto* peer = find(c->peer);
+        if (!peer) return kSocketError;
+        size_t used = c->inFlight + peer->unread();
+        if (used >= kStreamWindow) return kWouldBlock;
+        size_t room = kStreamWindow - used, sent = 0;
+        size_t part = 0, offset = 0;
+        while (sent < room && part < parts.size()) {
+            std::vector<uint8_t> segment;
+            size_t want = std::min(kSegmentSize, room - sent);
+            while (segment.size() < want && part < parts.size()) {
+                size_t take = std::min(want - segment.size(), parts[part].size() - offset);
+                segment.insert(segment.end(), parts[part].begin() + offset, parts[part].begin() + offset + take);
+                offset += take;
+                if (offset == parts[part].size()) {
+                    part++;
+                    offset = 0;
+                }
+            }
+            if (segment.empty()) break;
+            bool lost;
+            auto arrival = std::max(transit(c->ip, c->peerIp, segment.size() + kStreamHeader, true, lost), c->lastArrival);
+            c->lastArrival = arrival;
+            c->inFlight += segment.size();
+            sent += segment.size();
+            m_stats.packets++;
+            m_stats.bytes += segment.size();
+            at(arrival, [this, s, to = c->peer, bytes = std::move(segment)] {
+                if (auto* from = find(s)) from->inFlight -= bytes.size();
+                auto* peer = find(to);
+                if (peer && !peer->error) peer->inbox.insert(peer->inbox.end(), bytes.begin(), bytes.end());
+            });
+        }
+        return (long)sent;
+    }
+
+    long recv(SocketType s, std::span<uint8_t> into) {
+        auto* c = find(s);
+        if (!c || c->kind != Kind::Stream || c->error) return kSocketError;
+        if (size_t n = std::min(into.size(), c->unread())) {
+            std::memcpy(into.data(), c->inbox.data() + c->inboxRead, n);
+            c->inboxRead += n;
+            if (c->inboxRead == c->inbox.size()) {
+                c->inbox.clear();
+                c->inboxRead = 0;
+            }
+            return (long)n;
+        }
+        return c->finished ? 0 : kWouldBlock;
+    }
+
+    uint16_t localPort(SocketType s) {
+        auto* c = find(s);
+        return c ? c->port : 0;
+    }
+
+    SocketType openDatagram(uint32_t ip, uint16_t port, bool broadcast) {
+        if (port && !broadcast) {
+            for (auto const& [id, s] : m_sockets) {
+                if (s.kind == Kind::Datagram && s.ip == ip && s.port == port) return INVALID_SOCK;
+            }
+        }
+        Socket s;
+        s.kind = Kind::Datagram;
+        s.ip = ip;
+        s.port = port ? port : ephemeralPort(ip);
+        s.broadcast = broadcast;
+        return add(std::move(s));
+    }
+
+    long sendTo(SocketType s, std::span<const uint8_t> datagram, sockaddr_in const& to) {
+        auto* c = find(s);
+        if (!c || c->kind != Kind::Datagram) return kSocketError;
+        bool everyone = ntohl(to.sin_addr.s_addr) == INADDR_BROADCAST;
+        if (everyone && !c->broadcast) return kSocketError;
+        uint32_t dst = resolve(c->ip, to);
+        uint16_t port = ntohs(to.sin_port);
+        auto from = sock::address(c->ip, c->port);
+        uint32_t src = c->ip;
+        for (auto const& [id, target] : m_sockets) {
+            if (target.kind != Kind::Datagram || target.port != port || (!everyone && target.ip != dst)) continue;
+            bool lost;
+            auto arrival = transit(src, target.ip, datagram.size() + kDatagramHeader, false, lost);
+            m_stats.packets++;
+            m_stats.bytes += datagram.size();
+            if (!lost) {
+                at(arrival, [this, id, from, bytes = std::vector<uint8_t>(datagram.begin(), datagram.end())]() mutable {
+                    auto* target = find(id);
+                    if (target && target->datagrams.size() < kDatagramQueue) target->datagrams.push_back({from, std::move(bytes)});
+                });
+            }
+            // Unicast goes to the first socket on the port, like SO_REUSEADDR on most systems.
+            if (!everyone) break;
+        }
+        return (long)datagram.size();
+    }
+
+    long recvFrom(SocketType s, std::span<uint8_t> into, sockaddr_in& from) {
+        auto* c = find(s);
+        if (!c || c->kind != Kind::Datagram) return kSocketError;
+        if (c->datagrams.empty()) return kWouldBlock;
+        auto& d = c->datagrams.front();
+        size_t n = std::min(into.size(), d.bytes.size());
+        std::memcpy(into.data(), d.bytes.data(), n);
+        from = d.from;
+        c->datagrams.pop_front();
+        return (long)n;
+    }
+
+    // Never waits: time only moves in advance().
+    int poll(std::span<PollFd> fds) {
+        int ready = 0;
+        for (auto& pfd : fds) {
+            pfd.revents = 0;
+            auto* s = find(pfd.fd);
+            if (!s) continue;
+            short events = 0;
+            if (s->kind == Kind::Listener && !s->backlog.empty()) events = POLLIN;
+            else if (s->kind == Kind::Datagram && !s->datagrams.empty()) events = POLLIN;
+            else if (s->kind == Kind::Stream) {
+                if (s->error) events = POLLERR | POLLHUP;
+                else if (!s->connecting) {
+                    if (s->unread() || s->finished) events |= POLLIN;
+                    auto* peer = find(s->peer);
+                    if (peer && s->inFlight + peer->unread() < kStreamWindow) events |= POLLOUT;
+                }
+            }
+            pfd.revents = short(events & (pfd.events | POLLERR | POLLHUP));
+            if (pfd.revents) ready++;
+        }
+        return ready;
+    }
+
+    void close(SocketType s) {
+        auto it = m_sockets.find(s);
+        if (it == m_sockets.end()) return;
+        auto& c = it->second;
+        if (c.kind == Kind::Listener) {
+            auto waiting = std::move(c.backlog);
+            for (SocketType w : waiting) close(w);
+            it = m_sockets.find(s);
+        }
+        else if (c.kind == Kind::Stream && !c.error && find(c.peer)) {
+            bool lost;
+            auto arrival = std::max(transit(c.ip, c.peerIp, kStreamHeader, true, lost), c.lastArrival);
+            at(arrival, [this, to = c.peer] {
+                if (auto* peer = find(to)) peer->finished = true;
+            });
+        }
+        m_sockets.erase(it);
+    }
+};
+
+} // namespace devious
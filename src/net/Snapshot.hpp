@@ -0,0 +1,158 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "Compression.hpp"
+#include "LevelState.hpp"
+#include "Protocol.hpp"
+#include "SendQueue.hpp"
+
+namespace devious {
+
+constexpr size_t kSnapshotChunkRecords = 4096;
+
+// Chunk body before compression: the records' fields stored column by column, followed
+// by their stamps the same way, then byte-shuffled so equal high bytes of neighbouring
+// values line up for the LZ stage. Every field is handled as 4-byte words.
+namespace snapshot_detail {
+    constexpr size_t kRecordBytes = sizeof(ObjectRecord);
+    constexpr size_t kStampBytes = sizeof(ObjectStamps);
+    static_assert(sizeof(ObjectRecord) % 4 == 0 && std::is_trivially_copyable_v<ObjectRecord>);
+    static_assert(sizeof(ObjectStamps) % 4 == 0 && std::is_trivially_copyable_v<ObjectStamps>);
+
+    // Appends the columns of `items` to `raw`.
+    template <class T>
+    void packColumns(std::span<const T> items, std::vector<uint8_t>& raw) {
+        constexpr size_t words = sizeof(T) / 4;
+        size_t n = items.size();
+        size_t base = raw.size();
+        raw.resize(base + n * sizeof(T));
+        for (size_t i = 0; i < n; ++i) {
+            auto bytes = reinterpret_cast<const uint8_t*>(&items[i]);
+            for (size_t w = 0; w < words; ++w) std::memcpy(raw.data() + base + (w * n + i) * 4, bytes + w * 4, 4);
+        }
+    }
+
+    template <class T>
+    void unpackColumns(std::span<const uint8_t> raw, size_t n, std::vector<T>& out) {
+        constexpr size_t words = sizeof(T) / 4;
+        size_t base = out.size();
+        out.resize(base + n);
+        for (size_t i = 0; i < n; ++i) {
+            auto bytes = reinterpret_cast<uint8_t*>(&out[base + i]);
+            for (size_t w = 0; w < words; ++w) std::memcpy(bytes + w * 4, raw.data() + (w * n + i) * 4, 4);
+        }
+    }
+}
+
+// A point-in-time copy of the level. Chunk frames are compressed on first use and then
+// shared, so several peers joining at once only pay for compression once. Records are
+// sorted by grid cell, so each chunk covers a compact stretch of the level and a joiner
+// can be sent the chunks around its viewport first.
+class Snapshot {
+    std::vector<ObjectRecord> m_records;
+    std::vector<ObjectStamps> m_stamps;
+    std::vector<Packet> m_chunkFrames;
+    std::vector<Rect> m_chunkBounds;
+
+public:
+    uint32_t id;
+    uint64_t stateVersion;
+
+    Snapshot(uint32_t snapshotId, LevelState const& state) : id(snapshotId), stateVersion(state.version()) {
+        // The grid already files objects by cell, so only the cells and each cell's ids
+        // need sorting, not the whole level. This runs on the I/O thread.
+        std::vector<std::pair<uint64_t, std::span<const uint32_t>>> cells;
+        state.grid().forEachCell([&](uint64_t key, std::span<const uint32_t> ids) {
+            if (!ids.empty()) cells.push_back({key, ids});
+        });
+        std::sort(cells.begin(), cells.end(), [](auto const& a, auto const& b) { return a.first < b.first; });
+        m_records.reserve(state.size());
+        m_stamps.reserve(state.size());
+        std::vector<uint32_t> ids;
+        for (auto const& [key, cellIds] : cells) {
+            ids.assign(cellIds.begin(), cellIds.end());
+            std::sort(ids.begin(), ids.end());
+            for (uint32_t netId : ids) {
+                m_records.push_back(*state.find(netId));
+                m_stamps.push_back(*state.stamps(netId));
+            }
+        }
+        m_chunkFrames.resize(chunkCount());
+        m_chunkBounds.resize(chunkCount());
+        for (size_t i = 0; i < m_records.size(); ++i) {
+            auto& bounds = m_chunkBounds[i / kSnapshotChunkRecords];
+            float x = m_records[i].x, y = m_records[i].y;
+            if (i % kSnapshotChunkRecords == 0) bounds = {x, y, x, y};
+            bounds = {std::min(bounds.minX, x), std::min(bounds.minY, y), std::max(bounds.maxX, x), std::max(bounds.maxY, y)};
+        }
+    }
+
+    uint32_t objectCount() const { return (uint32_t)m_records.size(); }
+    uint16_t chunkCount() const { return (uint16_t)((m_records.size() + kSnapshotChunkRecords - 1) / kSnapshotChunkRecords); }
+
+    // Chunk indices from `first` on, those overlapping `focus` first and the rest by
+    // horizontal distance from it. Without a focus it is plain index order.
+    std::vector<uint16_t> sendOrder(uint16_t first, Rect const* focus) const {
+        std::vector<uint16_t> order;
+        for (uint16_t i = first; i < chunkCount(); ++i) order.push_back(i);
+        if (!focus) return order;
+        float centre = (focus->minX + focus->maxX) * 0.5f;
+        auto distance = [&](uint16_t i) {
+            auto const& b = m_chunkBounds[i];
+            if (b.intersects(*focus)) return 0.f;
+            return std::min(std::abs(b.minX - centre), std::abs(b.maxX - centre));
+        };
+        std::stable_sort(order.begin(), order.end(), [&](uint16_t a, uint16_t b) { return distance(a) < distance(b); });
+        return order;
+    }
+
+    Packet const& chunkFrame(uint16_t index) {
+        auto& packet = m_chunkFrames[index];
+        if (packet) return packet;
+
+        size_t begin = (size_t)index * kSnapshotChunkRecords;
+        size_t end = std::min(m_records.size(), begin + kSnapshotChunkRecords);
+        std::vector<uint8_t> raw, shuffled;
+        snapshot_detail::packColumns<ObjectRecord>({m_records.data() + begin, end - begin}, raw);
+        snapshot_detail::packColumns<ObjectStamps>({m_stamps.data() + begin, end - begin}, raw);
+        shuffled.resize(raw.size());
+        byteShuffle(raw, shuffled, 4);
+
+        std::vector<uint8_t> frame;
+        PacketWriter w(frame);
+        w.begin(MsgType::SnapshotChunk);
+        w.u32(id);
+        w.u16(index);
+        w.u16(uint16_t(end - begin));
+        w.u32((uint32_t)raw.size());
+        lzCompress(shuffled, frame);
+        w.finish();
+        packet = makePacket(std::move(frame));
+        return packet;
+    }
+};
+
+// Appends the records of one chunk payload (after its header) to `out`, and their
+// stamps to `stamps`.
+inline bool decodeSnapshotChunk(SnapshotChunkHeader const& header, std::span<const uint8_t> compressed,
+                                std::vector<ObjectRecord>& out, std::vector<ObjectStamps>& stamps) {
+    size_t recordBytes = header.recordCount * snapshot_detail::kRecordBytes;
+    if (header.rawSize != header.recordCount * (snapshot_detail::kRecordBytes + snapshot_detail::kStampBytes)) return false;
+    thread_local std::vector<uint8_t> shuffled, raw;
+    shuffled.resize(header.rawSize);
+    raw.resize(header.rawSize);
+    if (!lzDecompress(compressed, shuffled)) return false;
+    byteUnshuffle(shuffled, raw, 4);
+    snapshot_detail::unpackColumns(std::span<const uint8_t>(raw).first(recordBytes), header.recordCount, out);
+    snapshot_detail::unpackColumns(std::span<const uint8_t>(raw).subspan(recordBytes), header.recordCount, stamps);
+    return true;
+}
+
+} // namespace devious
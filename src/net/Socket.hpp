@@ -0,0 +1,107 @@
+#pragma once
+
+// --- WINDOWS HEADERS MUST BE FIRST ---
+// Include this before anything that pulls in <windows.h> (Geode does), or winsock2
+// clashes with the old winsock.h it drags in.
+#ifdef _WIN32
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+    #pragma comment(lib, "ws2_32.lib")
+    typedef SOCKET SocketType;
+    typedef WSAPOLLFD PollFd;
+    typedef int SockLen;
+    #define CLOSE_SOCKET closesocket
+    #define IS_VALID(s) (s != INVALID_SOCKET)
+    #define POLL_SOCKETS WSAPoll
+    #define INVALID_SOCK INVALID_SOCKET
+    #define SEND_FLAGS 0
+#else
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <arpa/inet.h>
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <sys/uio.h>
+    #include <cerrno>
+    typedef int SocketType;
+    typedef pollfd PollFd;
+    typedef socklen_t SockLen;
+    #define CLOSE_SOCKET close
+    #define IS_VALID(s) (s >= 0)
+    #define POLL_SOCKETS poll
+    #define INVALID_SOCK -1
+    #ifdef MSG_NOSIGNAL
+        #define SEND_FLAGS MSG_NOSIGNAL
+    #else
+        #define SEND_FLAGS 0
+    #endif
+#endif
+
+#include <cstring>
+
+namespace devious::sock {
+
+// WSAStartup is reference counted, so every owner of sockets can call this once.
+inline void startup() {
+    #ifdef _WIN32
+    WSADATA wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+    #endif
+}
+
+inline void setNonBlocking(SocketType s) {
+    #ifdef _WIN32
+    u_long mode = 1;
+    ioctlsocket(s, FIONBIO, &mode);
+    #else
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+    #endif
+    #ifdef SO_NOSIGPIPE
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+    #endif
+}
+
+inline void setReuseAddr(SocketType s) {
+    #ifndef _WIN32
+    int opt = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    #endif
+}
+
+// Writes are already coalesced into batches and gathered per poll round, so Nagle would
+// only hold each batch back until the previous one is acked.
+inline void setNoDelay(SocketType s) {
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&one, sizeof(one));
+}
+
+inline bool wouldBlock() {
+    #ifdef _WIN32
+    int err = WSAGetLastError();
+    return err == WSAEWOULDBLOCK || err == WSAEINPROGRESS;
+    #else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS;
+    #endif
+}
+
+inline void closeIfValid(SocketType& s) {
+    if (IS_VALID(s)) CLOSE_SOCKET(s);
+    s = INVALID_SOCK;
+}
+
+inline sockaddr_in address(uint32_t hostOrderAddr, uint16_t port) {
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(hostOrderAddr);
+    return addr;
+}
+
+} // namespace devious::sock
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include "FlatMap.hpp"
+
+namespace devious {
+
+struct Rect {
+    float minX = 0.f;
+    float minY = 0.f;
+    float maxX = 0.f;
+    float maxY = 0.f;
+
+    bool operator==(Rect const&) const = default;
+
+    bool contains(float x, float y) const { return x >= minX && x <= maxX && y >= minY && y <= maxY; }
+    bool intersects(Rect const& o) const { return minX <= o.maxX && o.minX <= maxX && minY <= o.maxY && o.minY <= maxY; }
+};
+
+// Uniform grid over level space, kCellSize units square (a block is 30 units). Cells are
+// created on demand and hold the net ids inside them, so "what is in this viewport" walks
+// a handful of cells instead of the whole level. Objects are filed by the position last
+// seen in the sync stream; callers pass the old position when moving or removing one.
+class SpatialGrid {
+public:
+    static constexpr float kCellSize = 512.f;
+    static constexpr size_t kInitialCellCapacity = 16;
+
+private:
+    struct Cell {
+        int32_t cx = 0;
+        int32_t cy = 0;
+        std::vector<uint32_t> ids;
+    };
+
+    FlatMap<uint64_t, uint32_t> m_index;  // cell key -> m_cells slot
+    std::vector<Cell> m_cells;
+
+public:
+    static int32_t coord(float v) {
+        if (!(v == v)) return 0; // NaN
+        return (int32_t)std::clamp(std::floor(v / kCellSize), -1e9f, 1e9f);
+    }
+
+    // Never 0 (FlatMap's empty key), and ordered x-major so sorting by key walks a level
+    // left to right.
+    static uint64_t key(int32_t cx, int32_t cy) {
+        return (uint64_t(uint32_t(cx) ^ 0x80000000u) << 32) | (uint32_t(cy) ^ 0x80000000u);
+    }
+
+    static uint64_t keyAt(float x, float y) { return key(coord(x), coord(y)); }
+
+    void clear() {
+        m_index.clear();
+        m_cells.clear();
+    }
+
+    void insert(uint32_t netId, float x, float y) {
+        int32_t cx = coord(x), cy = coord(y);
+        uint64_t k = key(cx, cy);
+        auto slot = m_index.find(k);
+        if (!slot) {
+            slot = &m_index.insert(k, (uint32_t)m_cells.size());
+            m_cells.push_back({cx, cy, {}});
+            // Cells in a built-up level hold dozens of objects; skip the first few regrowths.
+            m_cells.back().ids.reserve(kInitialCellCapacity);
+        }
+        m_cells[*slot].ids.push_back(netId);
+    }
+
+    void remove(uint32_t netId, float x, float y) {
+        auto slot = m_index.find(keyAt(x, y));
+        if (!slot) return;
+        auto& ids = m_cells[*slot].ids;
+        auto it = std::find(ids.begin(), ids.end(), netId);
+        if (it == ids.end()) return;
+        *it = ids.back();
+        ids.pop_back();
+    }
+
+    void move(uint32_t netId, float fromX, float fromY, float toX, float toY) {
+        if (keyAt(fromX, fromY) == keyAt(toX, toY)) return;
+        remove(netId, fromX, fromY);
+        insert(netId, toX, toY);
+    }
+
+    // Calls fn(cellKey, ids) for every cell.
+    template <class F>
+    void forEachCell(F&& fn) const {
+        for (auto const& cell : m_cells) fn(key(cell.cx, cell.cy), std::span<const uint32_t>(cell.ids));
+    }
+
+    // Calls fn(netId) for every object filed in a cell that overlaps `area`.
+    template <class F>
+    void forEachIn(Rect const& area, F&& fn) const {
+        int32_t x0 = coord(area.minX), x1 = coord(area.maxX);
+        int32_t y0 = coord(area.minY), y1 = coord(area.maxY);
+        // Zoomed far out it is cheaper to test every existing cell than every covered one.
+        if (uint64_t(x1 - x0 + 1) * uint64_t(y1 - y0 + 1) > m_cells.size()) {
+            for (auto const& cell : m_cells) {
+                if (cell.cx < x0 || cell.cx > x1 || cell.cy < y0 || cell.cy > y1) continue;
+                for (uint32_t id : cell.ids) fn(id);
+            }
+            return;
+        }
+        for (int32_t cx = x0; cx <= x1; ++cx) {
+            for (int32_t cy = y0; cy <= y1; ++cy) {
+                auto slot = m_index.find(key(cx, cy));
+                if (!slot) continue;
+                for (uint32_t id : m_cells[*slot].ids) fn(id);
+            }
+        }
+    }
+};
+
+} // namespace devious
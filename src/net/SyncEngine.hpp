@@ -0,0 +1,1940 @@
+#pragma once
+
+#include "Socket.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "Discovery.hpp"
+#include "LevelState.hpp"
+#include "Metrics.hpp"
+#include "MpscRing.hpp"
+#include "ObjectBlock.hpp"
+#include "Protocol.hpp"
+#include "SendQueue.hpp"
+#include "SessionLog.hpp"
+#include "Snapshot.hpp"
+#include "SpatialGrid.hpp"
+#include "TransformBlock.hpp"
+#include "Transport.hpp"
+
+namespace devious {
+
+// Things the user should hear about. Reported from the I/O thread.
+enum class SyncEvent {
+    Hosting,
+    PortInUse,
+    // Something that doesn't share it holds the discovery port: beacons and queries still
+    // go out, but nothing sent to that port is heard here.
+    DiscoveryPortInUse,
+    Connected,
+    // Client: the host refused the connection or couldn't be reached.
+    ConnectFailed,
+    // Client: no handshake within connectTimeoutMs.
+    ConnectTimedOut,
+    // Client: the host speaks another protocol version.
+    VersionMismatch,
+    // Client: the host serves no session by the name we asked for.
+    UnknownSession,
+    // No peer id is left in the session. Host: a new peer was turned away; client: we were.
+    SessionFull,
+    PeerDropped,
+    LevelSynced,
+    // Client: the link to the host dropped; we are dialing it again to resume.
+    Reconnecting,
+    Resumed,
+    // Client: gave up reconnecting.
+    ConnectionLost,
+};
+
+struct SyncConfig {
+    uint16_t port = 54321;
+    uint16_t discoveryPort = 54322;
+    // Host: accept connections on `port`. Off for a session whose links a SessionHub
+    // accepts and hands over (see SessionHub.hpp); its transient channel then takes any
+    // free UDP port, and its beacons still advertise `port`.
+    bool listen = true;
+    // A headless relay has no editor draining the inbound ring; it only keeps LevelState.
+    bool deliverInbound = true;
+    // Open the UDP channel for transient state (same port number as TCP).
+    bool transient = true;
+    // Client: how often to check our copy of the level against the host's. 0 turns it off.
+    uint32_t verifyIntervalMs = 5000;
+    // Host: append every applied edit to this session log (see SessionLog.hpp). Empty turns it off.
+    std::string sessionLog;
+    // Where servers found on the LAN are remembered between runs (see Discovery.hpp). Empty turns it off.
+    std::string discoveryCache;
+    // Per peer, how fast bulk traffic (late-join snapshots, big pastes) may go out, so it
+    // never fills the socket buffer ahead of edits. 0 means unlimited.
+    double bulkBytesPerSecond = 32.0 * 1024 * 1024;
+    // A link that hasn't finished its handshake this long after it was opened (dialed or
+    // accepted) is given up, so an unreachable host fails in bounded time.
+    uint32_t connectTimeoutMs = 5000;
+    // How long the host keeps a dropped peer's session, and the client keeps trying to
+    // resume it.
+    uint32_t resumeWindowMs = 30000;
+    // Without an I/O thread nothing happens until the owner calls runOnce(), on one thread
+    // with every other call. For simulated networks (see SimNetwork.hpp).
+    bool ioThread = true;
+};
+
+// The session core shared by the mod and the headless relay. Everything below runs on
+// one I/O thread that multiplexes the listen socket, peer connections and discovery
+// sockets with poll(), all through its Transport. Other threads never touch a socket: they
+// hand work over through post()/sendPacket() and wake the loop. Decoded remote edits come
+// out of inbound().
+class SyncEngine {
+    struct Connection {
+        SocketType sock = INVALID_SOCK;
+        bool connecting = false;
+        bool closed = false;
+        // Set once the Hello / HelloAck exchange went through. Until then nothing but the
+        // handshake is sent or accepted, and the link is dropped at handshakeDeadline.
+        bool greeted = false;
+        std::chrono::steady_clock::time_point handshakeDeadline;
+        // Closed as soon as its send queue is flushed; nothing more is read from it.
+        bool closing = false;
+        FrameDecoder decoder;
+        SendQueue sendQueue;
+        TokenBucket bulkBucket;
+        size_t bulkEdits = 0;  // edit frames waiting in the bulk lane
+        // Host side: set once the peer's snapshot has started; live edits are only
+        // relayed after that point so they are never applied twice.
+        bool joined = false;
+        uint8_t peerId = 0;
+        std::shared_ptr<Snapshot> snapshot;
+        std::vector<uint16_t> chunkOrder;
+        size_t chunkPos = 0;
+        LinkMetrics stats;
+        // Transient channel: the peer's TCP address (datagrams must come from the same
+        // host) and, once its first datagram arrived, where to send UDP back to.
+        in_addr remoteIp{};
+        sockaddr_in udpAddr{};
+        bool udpKnown = false;
+        // Interest management, host side: once the peer reports a viewport, edits outside
+        // it are held back and the objects remembered here. They are resent as whole
+        // records (or deletes) when they scroll into view, or a slice at a time otherwise.
+        Rect viewport;
+        bool hasViewport = false;
+        FlatMap<uint32_t, uint8_t> deferred;
+        std::chrono::steady_clock::time_point nextDeferredFlush;
+        // Resume (see RetransmitBuffer). A link that drops unexpectedly is parked with
+        // everything above, so the peer can pick it up from a new socket. Parked links
+        // keep collecting what would have been sent to them in `unacked`.
+        uint64_t token = 0;
+        uint64_t sentSeq = 0;
+        uint64_t receivedSeq = 0;
+        uint64_t ackedSeq = 0;    // the newest Ack the peer sent
+        uint64_t ackSentSeq = 0;  // the newest Ack we sent
+        RetransmitBuffer unacked;
+        bool resumable = true;    // cleared when we drop the link on purpose
+        bool resuming = false;    // client: a new link waiting for Resumed
+        bool parked = false;
+        std::chrono::steady_clock::time_point parkedUntil;
+        std::chrono::steady_clock::time_point lastHeard;
+
+        size_t pendingBytes() const { return sendQueue.bytes(); }
+    };
+
+    // Where an edit record sits in its batch payload, and where its object was before and
+    // after the edit. Taken before the edit is applied to m_state.
+    struct RecordSpan {
+        uint32_t netId = 0;
+        uint32_t begin = 0;
+        uint32_t end = 0;
+        bool hasFrom = false;
+        bool hasTo = false;
+        float fromX = 0.f, fromY = 0.f, toX = 0.f, toY = 0.f;
+
+        // Moves across the edge count on both sides. Objects we know nothing about are
+        // always sent rather than guessed at.
+        bool visibleIn(Rect const& area) const {
+            if (!hasFrom && !hasTo) return true;
+            return (hasFrom && area.contains(fromX, fromY)) || (hasTo && area.contains(toX, toY));
+        }
+    };
+
+    // Snapshot chunks are topped up only while a peer's send queue is below this, so a
+    // 50k-object transfer never sits in memory as one giant buffer.
+    static constexpr size_t kSnapshotWindowBytes = 256 * 1024;
+    // What the bulk lane may send at once after being idle.
+    static constexpr double kBulkBurstBytes = 256 * 1024;
+    // A peer whose queue passes the soft limit is throttled: we stop reading from it until
+    // it drains, so it can't produce edits faster than it takes them in. Past the hard
+    // limit it is disconnected rather than letting one slow link hold memory for everyone.
+    static constexpr size_t kSendSoftLimit = 1024 * 1024;
+    static constexpr size_t kSendHardLimit = 16 * 1024 * 1024;
+    static constexpr size_t kMaxGather = 64;
+    static constexpr auto kMetricsInterval = std::chrono::milliseconds(250);
+    static constexpr auto kPingInterval = std::chrono::seconds(2);
+    // A link that hears nothing, not even a ping, for this long is taken for dead.
+    static constexpr auto kLinkTimeout = std::chrono::seconds(10);
+    static constexpr auto kAckInterval = std::chrono::milliseconds(100);
+    // Reconnect attempts back off from the min to the max delay.
+    static constexpr auto kReconnectMinDelay = std::chrono::milliseconds(250);
+    static constexpr auto kReconnectMaxDelay = std::chrono::seconds(4);
+    static constexpr auto kDeferredFlushInterval = std::chrono::seconds(1);
+    static constexpr size_t kDeferredFlushRecords = 2048;
+    // A new snapshot marker goes into the session log after this many bytes of edits, or
+    // after the interval if anything at all was logged since the last one.
+    static constexpr uint64_t kLogMarkerBytes = 8 * 1024 * 1024;
+    static constexpr auto kLogMarkerInterval = std::chrono::seconds(60);
+
+    SyncConfig m_config;
+    std::shared_ptr<Transport> m_transport;
+
+    std::atomic<bool> m_running = false;
+    std::atomic<bool> m_isHost = false;
+    std::atomic<bool> m_connected = false;
+    std::atomic<uint8_t> m_localPeer = 0;
+    std::atomic<uint64_t> m_sendCalls = 0;
+    std::atomic<size_t> m_peerCount = 0;
+    std::atomic<bool> m_transientReady = false;
+    // Lamport counter: bumped for every local stamp and moved past every stamp received.
+    std::atomic<uint64_t> m_clock = 0;
+    std::thread m_ioThread;
+    // Open for the engine's whole life, so wake() never races a thread opening or closing it.
+    SocketType m_wakeSocket = INVALID_SOCK;
+    // Reused by every round of the loop.
+    std::vector<PollFd> m_pollFds;
+    std::vector<std::function<void()>> m_roundCommands;
+    std::vector<uint8_t> m_roundOut;
+
+    // Decoded remote edits, pushed by the I/O thread and drained by the consumer. When the
+    // ring is full the I/O thread parks the rest in m_inboundOverflow and stops reading
+    // sockets until the consumer catches up, so TCP pushes back on the sender.
+    MpscRing<EditOp> m_inbound{16384};
+    std::vector<EditOp> m_inboundOverflow;
+    std::atomic<size_t> m_inboundOverflowSize = 0;
+
+    // Owned by the I/O thread.
+    SocketType m_listenSocket = INVALID_SOCK;
+    SocketType m_beaconSocket = INVALID_SOCK;
+    SocketType m_discoverySocket = INVALID_SOCK;
+    SocketType m_querySocket = INVALID_SOCK;
+    SocketType m_udpSocket = INVALID_SOCK;
+    std::vector<std::unique_ptr<Connection>> m_clients;
+    // Dropped links waiting to be resumed. Kept apart so poll indices stay aligned with m_clients.
+    std::vector<std::unique_ptr<Connection>> m_parked;
+    std::string m_hostName;
+    // The session we host, or asked the host for.
+    std::string m_sessionId;
+    std::chrono::steady_clock::time_point m_nextBeacon;
+    uint32_t m_queryAnswers = 0;  // since the last beacon
+    bool m_cacheLoaded = false;
+    bool m_searching = false;
+    std::chrono::steady_clock::time_point m_nextProbe;
+    std::chrono::steady_clock::time_point m_nextPing;
+    std::chrono::steady_clock::time_point m_nextPublish;
+    std::chrono::steady_clock::time_point m_nextAck;
+    LinkMetrics m_retired;
+
+    // The level as the session stream has it: authoritative on the host, a mirror that is
+    // verified against the host's on clients. The host also keeps its newest snapshot.
+    LevelState m_state;
+    std::shared_ptr<Snapshot> m_lastSnapshot;
+    uint32_t m_nextSnapshotId = 1;
+    uint16_t m_nextPeerId = kHostPeerId + 1;
+    std::mt19937_64 m_tokens{std::random_device{}()};
+    SessionLogWriter m_log;
+    std::chrono::steady_clock::time_point m_nextLogMarker;
+
+    // Client: progress of the late-join transfer, kept across reconnects for resuming.
+    bool m_awaitingSnapshot = false;
+    bool m_snapshotComplete = false;
+    uint32_t m_snapshotId = 0;
+    uint16_t m_snapshotNextChunk = 0;  // first chunk not received yet
+    std::vector<bool> m_snapshotReceived;
+    std::vector<EditOp> m_heldOps;
+    Rect m_viewport;
+    bool m_hasViewport = false;
+    std::chrono::steady_clock::time_point m_nextVerify;
+    sockaddr_in m_hostAddr{};
+    std::chrono::steady_clock::time_point m_nextReconnect;
+    std::chrono::milliseconds m_reconnectDelay{0};
+
+    // Transient channel. The last state we sent is re-sent with a fresh sequence number
+    // on every ping so peers learn our address and idle cursors don't time out.
+    sockaddr_in m_udpHost{};
+    uint32_t m_transientSeq = 0;
+    std::vector<uint8_t> m_transientBody;
+    std::array<uint32_t, 256> m_peerTransientSeq{};
+    std::array<bool, 256> m_peerTransientSeen{};
+
+    // Handed over from other threads.
+    std::mutex m_commandMutex;
+    std::vector<std::function<void()>> m_commands;
+    std::vector<uint8_t> m_pendingOut;
+    std::vector<uint8_t> m_pendingTransient;
+    bool m_transientDirty = false;
+
+    // Newest transient state per remote peer, not yet taken by the consumer.
+    std::mutex m_transientMutex;
+    std::map<uint8_t, TransientState> m_transientIn;
+
+    std::mutex m_discoveryMutex;
+    ServerDirectory m_servers;
+    ServerInfo m_joined;
+
+    // Published by the I/O thread every kMetricsInterval; the lock is never taken per packet.
+    std::mutex m_metricsMutex;
+    NetMetrics m_metrics;
+
+public:
+    // Called on the I/O thread; must not block.
+    std::function<void(SyncEvent)> onEvent;
+
+    // Runs over the real network unless given another transport.
+    explicit SyncEngine(SyncConfig config = {}, std::shared_ptr<Transport> transport = nullptr)
+        : m_config(config), m_transport(transport ? std::move(transport) : std::make_shared<SystemTransport>()) {
+        if (m_config.ioThread) openWakeSocket();
+    }
+    ~SyncEngine() {
+        stop();
+        sock::closeIfValid(m_wakeSocket);
+    }
+
+    SyncEngine(SyncEngine const&) = delete;
+    SyncEngine& operator=(SyncEngine const&) = delete;
+
+    // Stops the I/O thread and closes every socket it owns.
+    void stop() {
+        if (!m_running.exchange(false)) return;
+        if (!m_config.ioThread) {
+            shutdown();
+            return;
+        }
+        wake();
+        if (m_ioThread.joinable()) m_ioThread.join();
+    }
+
+    // Without an I/O thread: one turn of its loop on the calling thread, handling whatever
+    // was posted and whatever the sockets have ready. Never blocks.
+    void runOnce() {
+        if (m_running && !m_config.ioThread) runRound(false);
+    }
+
+    // `objects` seed the level state; late joiners receive them as a snapshot. Their net
+    // ids must already belong to kHostPeerId. `session` is the id clients name in their
+    // Hello; empty for the only session on the port.
+    void startHost(std::string name, std::vector<ObjectRecord> objects, std::string session = {}) {
+        if (m_isHost.exchange(true)) return;
+        m_localPeer = kHostPeerId;
+        post([this, name = std::move(name), objects = std::move(objects), session = std::move(session)]() mutable {
+            m_state.reset(std::move(objects));
+            m_sessionId = std::move(session);
+            if (!m_config.sessionLog.empty() && m_log.open(m_config.sessionLog)) writeLogMarker();
+            if (m_config.listen) {
+                m_listenSocket = m_transport->openListener(m_config.port);
+                if (!IS_VALID(m_listenSocket)) {
+                    m_isHost = false;
+                    m_localPeer = 0;
+                    emit(SyncEvent::PortInUse);
+                    return;
+                }
+            }
+            if (m_config.transient) openUdp(m_config.listen ? m_config.port : 0);
+
+            // Bound to the discovery port, shared with any browser on this machine, to hear queries.
+            m_beaconSocket = openBroadcastSocket(m_config.discoveryPort);
+            m_hostName = name;
+            m_nextBeacon = m_transport->now();
+            emit(SyncEvent::Hosting);
+        });
+    }
+
+    // Listens for beacons and asks every host on the LAN to answer now. Called whenever a
+    // browser opens; the first call also lists the servers remembered from the last run.
+    void startSearching() {
+        post([this]() {
+            if (!IS_VALID(m_discoverySocket)) m_discoverySocket = openBroadcastSocket(m_config.discoveryPort);
+            // Answers come back to this one, so they reach us even if another process
+            // on this machine holds the discovery port too.
+            if (!IS_VALID(m_querySocket)) m_querySocket = openBroadcastSocket(0);
+            if (!m_cacheLoaded && !m_config.discoveryCache.empty()) {
+                auto expires = m_transport->now() + kRememberedTtl;
+                std::lock_guard<std::mutex> lock(m_discoveryMutex);
+                for (auto& server : loadServerCache(m_config.discoveryCache)) m_servers.remembered(std::move(server), expires);
+            }
+            m_cacheLoaded = true;
+            m_searching = true;
+            m_nextProbe = m_transport->now();
+            std::vector<uint8_t> query;
+            PacketWriter w(query);
+            DiscoveryQuery::write(w);
+            m_transport->sendTo(m_querySocket, query, sock::address(INADDR_BROADCAST, m_config.discoveryPort));
+        });
+    }
+
+    // Stops probing once no browser is open. Beacons still keep the list current.
+    void stopSearching() {
+        post([this]() { m_searching = false; });
+    }
+
+    // Client: the host as its handshake described it.
+    ServerInfo joinedServer() {
+        std::lock_guard<std::mutex> lock(m_discoveryMutex);
+        return m_joined;
+    }
+
+    std::vector<ServerInfo> getFoundServers() {
+        std::lock_guard<std::mutex> lock(m_discoveryMutex);
+        return m_servers.list();
+    }
+
+    // Thread-safe. Writes the discovery cache on the calling thread, if the live servers
+    // changed since the last save; the I/O thread never touches the disk for it.
+    void saveFoundServers() {
+        if (m_config.discoveryCache.empty()) return;
+        std::vector<ServerInfo> live;
+        {
+            std::lock_guard<std::mutex> lock(m_discoveryMutex);
+            if (!m_servers.takeCacheDirty()) return;
+            live = m_servers.list();
+        }
+        saveServerCache(m_config.discoveryCache, live);
+    }
+
+    // Thread-safe. Appends the server list changes after version `since` (0 for all of
+    // it) to `out` and returns the version to pass next time.
+    uint64_t serverChanges(uint64_t since, std::vector<ServerChange>& out) {
+        std::lock_guard<std::mutex> lock(m_discoveryMutex);
+        return m_servers.changesSince(since, out);
+    }
+
+    // Thread-safe. How long links opened or accepted after this get to finish their handshake.
+    void setConnectTimeout(uint32_t ms) {
+        post([this, ms] { m_config.connectTimeoutMs = ms; });
+    }
+
+    // `session` picks one of the sessions the host serves; empty for its only one.
+    void connectToServer(std::string ip, std::string session = {}) {
+        m_isHost = false;
+        post([this, ip, session = std::move(session)]() {
+            auto addr = sock::address(0, m_config.port);
+            inet_pton(AF_INET, ip.c_str(), &addr.sin_addr);
+            m_hostAddr = addr;
+            m_udpHost = addr;
+            m_sessionId = session;
+            // A session we were still trying to resume is given up for the new one.
+            for (auto& c : m_parked) retire(*c);
+            m_parked.clear();
+            if (m_config.transient && !IS_VALID(m_udpSocket)) openUdp(0);
+            openLink(false);
+        });
+    }
+
+    // Host: takes over a link a SessionHub accepted for this session. `received` is what
+    // the hub read from it so far, the client's Hello first.
+    void adopt(SocketType s, sockaddr_in const& from, std::vector<uint8_t> received) {
+        post([this, s, from, received = std::move(received)]() {
+            auto& c = addLink(s, from);
+            auto space = c.decoder.prepare(received.size());
+            std::copy(received.begin(), received.end(), space.begin());
+            c.decoder.commit(received.size());
+            c.stats.bytesIn += received.size();
+            drainFrames(c);
+        });
+    }
+
+    // Thread-safe. Queues an already-encoded frame for every peer (host) or the server (client).
+    void sendPacket(std::span<const uint8_t> packet) {
+        {
+            std::lock_guard<std::mutex> lock(m_commandMutex);
+            m_pendingOut.insert(m_pendingOut.end(), packet.begin(), packet.end());
+        }
+        wake();
+    }
+
+    // Client: the part of the level our editor shows, in level units. The host relays edits
+    // inside it first and holds back the rest. Remembered and resent on every reconnect.
+    void setViewport(Rect const& area) {
+        post([this, area] {
+            m_viewport = area;
+            m_hasViewport = true;
+            if (m_isHost) return;
+            for (auto& c : m_clients) if (!c->connecting && !c->closed && !c->resuming) queueMessage(*c, viewportMsg());
+        });
+    }
+
+    // Thread-safe, latest wins: only the newest state queued before the I/O thread gets
+    // to it is sent.
+    void sendTransient(TransientState const& state) {
+        {
+            std::lock_guard<std::mutex> lock(m_commandMutex);
+            m_pendingTransient.clear();
+            PacketWriter w(m_pendingTransient);
+            state.write(w, kMaxDatagramSize - kTransientHeaderSize);
+            m_transientDirty = true;
+        }
+        wake();
+    }
+
+    // Calls fn(peerId, TransientState&) for every peer whose state changed since the last call.
+    template <class F>
+    void takeTransient(F&& fn) {
+        std::map<uint8_t, TransientState> updates;
+        {
+            std::lock_guard<std::mutex> lock(m_transientMutex);
+            updates.swap(m_transientIn);
+        }
+        for (auto& [peer, state] : updates) fn(peer, state);
+    }
+
+    // Runs `command` on the I/O thread, starting it if needed.
+    void post(std::function<void()> command) {
+        {
+            std::lock_guard<std::mutex> lock(m_commandMutex);
+            m_commands.push_back(std::move(command));
+        }
+        ensureIoThread();
+        wake();
+    }
+
+    // A private copy of the host's level, taken on the I/O thread. Nothing else references
+    // it, so the caller may compress its chunks on any thread.
+    std::future<std::shared_ptr<Snapshot>> captureSnapshot() {
+        auto promise = std::make_shared<std::promise<std::shared_ptr<Snapshot>>>();
+        auto future = promise->get_future();
+        post([this, promise] { promise->set_value(std::make_shared<Snapshot>(0, m_state)); });
+        return future;
+    }
+
+    // The latest published counters. inboundDepth is live; the apply fields are left to
+    // the consumer.
+    NetMetrics metrics() {
+        NetMetrics out;
+        {
+            std::lock_guard<std::mutex> lock(m_metricsMutex);
+            out = m_metrics;
+        }
+        out.inboundDepth = pendingInbound();
+        return out;
+    }
+
+    // Thread-safe. A stamp newer than every edit this peer has made or received so far.
+    uint64_t stamp() { return makeStamp(m_clock.fetch_add(1) + 1, m_localPeer); }
+
+    bool isHost() const { return m_isHost; }
+    // True once the UDP socket is open; without it callers send drags as edits instead.
+    bool transientReady() const { return m_transientReady; }
+    bool isConnected() const { return m_connected; }
+    uint8_t localPeer() const { return m_localPeer; }
+    bool inSession() const { return (m_isHost || m_connected) && m_localPeer != 0; }
+    size_t peerCount() const { return m_peerCount.load(std::memory_order_relaxed); }
+    uint64_t sendCalls() const { return m_sendCalls; }
+
+    // The hash of the level as this engine holds it (see HashTree): peers holding the same
+    // level agree on it. Reads loop state, so only without an I/O thread.
+    uint64_t levelHash() const { return m_state.tree().root(); }
+
+    // Single consumer.
+    MpscRing<EditOp>& inbound() { return m_inbound; }
+    size_t pendingInbound() const { return m_inbound.size() + m_inboundOverflowSize.load(std::memory_order_relaxed); }
+
+private:
+    void emit(SyncEvent event) {
+        if (onEvent) onEvent(event);
+    }
+
+    void observe(uint64_t stamp) {
+        uint64_t counter = stampCounter(stamp);
+        uint64_t current = m_clock.load();
+        while (counter > current && !m_clock.compare_exchange_weak(current, counter)) {}
+    }
+
+    uint64_t nowUs() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(m_transport->now().time_since_epoch()).count();
+    }
+
+    void ensureIoThread() {
+        if (m_running.exchange(true) || !m_config.ioThread) return;
+        if (m_ioThread.joinable()) m_ioThread.join();
+        m_ioThread = std::thread(&SyncEngine::ioLoop, this);
+    }
+
+    // A loopback UDP socket connected to itself. Writing a byte makes poll() return.
+    void openWakeSocket() {
+        m_wakeSocket = socket(AF_INET, SOCK_DGRAM, 0);
+        auto addr = sock::address(INADDR_LOOPBACK, 0);
+        bind(m_wakeSocket, (sockaddr*)&addr, sizeof(addr));
+        SockLen len = sizeof(addr);
+        getsockname(m_wakeSocket, (sockaddr*)&addr, &len);
+        connect(m_wakeSocket, (sockaddr*)&addr, sizeof(addr));
+        sock::setNonBlocking(m_wakeSocket);
+    }
+
+    void closeSocket(SocketType& s) {
+        if (IS_VALID(s)) m_transport->close(s);
+        s = INVALID_SOCK;
+    }
+
+    void wake() {
+        if (!IS_VALID(m_wakeSocket)) return;
+        char b = 0;
+        send(m_wakeSocket, &b, 1, 0);
+    }
+
+    void ioLoop() {
+        while (m_running) runRound(true);
+        shutdown();
+    }
+
+    // One turn of the loop: run what other threads handed over, wait for the sockets (until
+    // the next timer is due, if `block`), then serve them and the timers.
+    void runRound(bool block) {
+        bool transientDirty;
+        {
+            std::lock_guard<std::mutex> lock(m_commandMutex);
+            m_roundCommands.swap(m_commands);
+            m_roundOut.swap(m_pendingOut);
+            transientDirty = m_transientDirty;
+            if (transientDirty) m_transientBody.swap(m_pendingTransient);
+            m_transientDirty = false;
+        }
+        for (auto& command : m_roundCommands) command();
+        m_roundCommands.clear();
+        if (!m_roundOut.empty()) {
+            forEachFrame(m_roundOut, [&](Frame const& frame) { handleFrame(frame, nullptr); });
+            m_roundOut.clear();
+        }
+        if (transientDirty) sendOwnTransient();
+        pumpSnapshots();
+        pumpDeferred();
+        startVerify();
+
+        auto& fds = m_pollFds;
+        fds.clear();
+        auto watch = [&](SocketType s, short events) {
+            PollFd pfd;
+            pfd.fd = s;
+            pfd.events = events;
+            pfd.revents = 0;
+            fds.push_back(pfd);
+        };
+        size_t wakeIdx = fds.size();
+        if (IS_VALID(m_wakeSocket)) watch(m_wakeSocket, POLLIN);
+        size_t listenIdx = fds.size();
+        if (IS_VALID(m_listenSocket)) watch(m_listenSocket, POLLIN);
+        size_t beaconIdx = fds.size();
+        if (IS_VALID(m_beaconSocket)) watch(m_beaconSocket, POLLIN);
+        size_t discoveryIdx = fds.size();
+        if (IS_VALID(m_discoverySocket)) watch(m_discoverySocket, POLLIN);
+        size_t queryIdx = fds.size();
+        if (IS_VALID(m_querySocket)) watch(m_querySocket, POLLIN);
+        size_t udpIdx = fds.size();
+        if (IS_VALID(m_udpSocket)) watch(m_udpSocket, POLLIN);
+        bool inboundBlocked = !retryInboundOverflow();
+        size_t clientIdx = fds.size();
+        auto now = m_transport->now();
+        auto nextBulk = std::chrono::steady_clock::time_point::max();
+        auto nextDeadline = std::chrono::steady_clock::time_point::max();
+        for (auto& c : m_clients) {
+            bool throttled = inboundBlocked || c->pendingBytes() > kSendSoftLimit;
+            // A link we aren't reading from can't be judged silent.
+            if (throttled) c->lastHeard = now;
+            if (!c->greeted) nextDeadline = std::min(nextDeadline, c->handshakeDeadline);
+            short events = c->connecting ? POLLOUT : (throttled || c->closing ? 0 : POLLIN);
+            if (!c->connecting && (!c->sendQueue.wireEmpty() || c->sendQueue.canSchedule(c->bulkBucket, now))) events |= POLLOUT;
+            // Bulk held back by the token bucket wakes us when it may go again.
+            else if (!c->connecting && c->sendQueue.laneBytes(Lane::Bulk)) nextBulk = std::min(nextBulk, c->bulkBucket.readyAt());
+            watch(c->sock, events);
+        }
+
+        int timeoutMs = 1000;
+        if (IS_VALID(m_beaconSocket)) {
+            auto untilBeacon = std::chrono::duration_cast<std::chrono::milliseconds>(m_nextBeacon - m_transport->now()).count();
+            timeoutMs = (int)std::clamp<long long>(untilBeacon, 0, 1000);
+        }
+        auto untilPublish = std::chrono::duration_cast<std::chrono::milliseconds>(m_nextPublish - m_transport->now()).count();
+        timeoutMs = (int)std::clamp<long long>(untilPublish, 0, timeoutMs);
+        auto untilExpiry = std::chrono::duration_cast<std::chrono::milliseconds>(pumpDiscovery() - m_transport->now()).count();
+        timeoutMs = (int)std::clamp<long long>(untilExpiry, 0, timeoutMs);
+        if (!m_isHost && !m_parked.empty()) {
+            auto untilReconnect = std::chrono::duration_cast<std::chrono::milliseconds>(m_nextReconnect - m_transport->now()).count();
+            timeoutMs = (int)std::clamp<long long>(untilReconnect, 0, timeoutMs);
+        }
+        if (nextBulk != std::chrono::steady_clock::time_point::max()) {
+            auto untilBulk = std::chrono::duration_cast<std::chrono::milliseconds>(nextBulk - now).count() + 1;
+            timeoutMs = (int)std::clamp<long long>(untilBulk, 0, timeoutMs);
+        }
+        if (nextDeadline != std::chrono::steady_clock::time_point::max()) {
+            auto untilDeadline = std::chrono::duration_cast<std::chrono::milliseconds>(nextDeadline - now).count() + 1;
+            timeoutMs = (int)std::clamp<long long>(untilDeadline, 0, timeoutMs);
+        }
+        if (m_searching) {
+            auto untilProbe = std::chrono::duration_cast<std::chrono::milliseconds>(m_nextProbe - now).count();
+            timeoutMs = (int)std::clamp<long long>(untilProbe, 0, timeoutMs);
+        }
+        if (inboundBlocked) timeoutMs = std::min(timeoutMs, 2);
+        if (m_transport->poll(fds, block ? timeoutMs : 0) < 0) return;
+
+        char drain[256];
+        if (wakeIdx < listenIdx && (fds[wakeIdx].revents & POLLIN)) while (recv(m_wakeSocket, drain, sizeof(drain), 0) > 0) {}
+        if (listenIdx < beaconIdx && (fds[listenIdx].revents & POLLIN)) acceptClients();
+        if (beaconIdx < discoveryIdx && (fds[beaconIdx].revents & POLLIN)) readQueries();
+        if (discoveryIdx < queryIdx && (fds[discoveryIdx].revents & POLLIN)) readDiscovery(m_discoverySocket);
+        if (queryIdx < udpIdx && (fds[queryIdx].revents & POLLIN)) readDiscovery(m_querySocket);
+        if (udpIdx < clientIdx && (fds[udpIdx].revents & POLLIN)) readTransient();
+
+        // Indices stay aligned with fds because new connections are only appended.
+        size_t clientCount = fds.size() - clientIdx;
+        for (size_t i = 0; i < clientCount; ++i) {
+            auto& c = *m_clients[i];
+            short revents = fds[clientIdx + i].revents;
+            if (c.connecting) {
+                if (revents & (POLLOUT | POLLERR | POLLHUP)) finishConnect(c);
+                continue;
+            }
+            if ((revents & (POLLIN | POLLERR | POLLHUP)) && !inboundBlocked && c.pendingBytes() <= kSendSoftLimit) readClient(c);
+            if (!c.closed && c.pendingBytes()) flushClient(c);
+            if (c.closing && !c.pendingBytes()) c.closed = true;
+        }
+        expireHandshakes();
+        for (auto& c : m_clients) {
+            if (!c->closed) continue;
+            m_transport->close(c->sock);
+            if (canPark(*c)) park(std::move(c));
+            else retire(*c);
+        }
+        std::erase_if(m_clients, [](auto const& c) { return !c || c->closed; });
+        expireParked();
+        pumpReconnect();
+        m_peerCount.store(m_clients.size(), std::memory_order_relaxed);
+        if (!m_isHost && m_clients.empty() && m_parked.empty()) m_connected = false;
+        pumpLog();
+
+        now = m_transport->now();
+        if (now >= m_nextAck) {
+            pumpAcks();
+            m_nextAck = now + kAckInterval;
+        }
+        if (now >= m_nextPing) {
+            for (auto& c : m_clients) {
+                if (c->connecting || c->closed || !c->greeted) continue;
+                if (now - c->lastHeard > kLinkTimeout) c->closed = true;
+                else queueMessage(*c, PingMsg{nowUs()});
+            }
+            sendOwnTransient();
+            m_nextPing = now + kPingInterval;
+        }
+        if (now >= m_nextPublish) {
+            publishMetrics();
+            m_nextPublish = now + kMetricsInterval;
+        }
+        if (m_searching && now >= m_nextProbe) {
+            sendProbes();
+            m_nextProbe = now + kProbeInterval;
+        }
+
+        if (IS_VALID(m_beaconSocket) && m_transport->now() >= m_nextBeacon) {
+            sendBeacon(sock::address(INADDR_BROADCAST, m_config.discoveryPort));
+            m_queryAnswers = 0;
+            m_nextBeacon = m_transport->now() + kBeaconInterval;
+        }
+    }
+
+    // Closes everything the loop owns once it stopped, and forgets the session, so the
+    // engine can host or join another one.
+    void shutdown() {
+        for (auto& c : m_clients) m_transport->close(c->sock);
+        m_clients.clear();
+        m_parked.clear();
+        m_peerCount = 0;
+        closeSocket(m_listenSocket);
+        closeSocket(m_beaconSocket);
+        closeSocket(m_discoverySocket);
+        closeSocket(m_querySocket);
+        closeSocket(m_udpSocket);
+        m_log.close();
+        m_searching = false;
+        m_transientReady = false;
+        m_transientBody.clear();
+        m_peerTransientSeq = {};
+        m_peerTransientSeen = {};
+        m_isHost = false;
+        m_connected = false;
+        m_localPeer = 0;
+        m_sessionId.clear();
+        m_state.reset({});
+        m_lastSnapshot.reset();
+        m_nextPeerId = kHostPeerId + 1;
+        m_awaitingSnapshot = false;
+        m_snapshotComplete = false;
+        m_snapshotId = 0;
+        m_snapshotNextChunk = 0;
+        m_snapshotReceived.clear();
+        m_heldOps.clear();
+        m_reconnectDelay = std::chrono::milliseconds(0);
+        std::lock_guard<std::mutex> lock(m_commandMutex);
+        m_commands.clear();
+        m_pendingOut.clear();
+    }
+
+    void acceptClients() {
+        while (true) {
+            sockaddr_in clientAddr;
+            SocketType client = m_transport->accept(m_listenSocket, clientAddr);
+            if (!IS_VALID(client)) return;
+            addLink(client, clientAddr);
+        }
+    }
+
+    // Host: a peer's new link, accepted here or by a SessionHub.
+    Connection& addLink(SocketType s, sockaddr_in const& from) {
+        auto conn = std::make_unique<Connection>();
+        conn->sock = s;
+        conn->remoteIp = from.sin_addr;
+        conn->lastHeard = m_transport->now();
+        conn->handshakeDeadline = conn->lastHeard + std::chrono::milliseconds(m_config.connectTimeoutMs);
+        conn->bulkBucket.configure(m_config.bulkBytesPerSecond, kBulkBurstBytes, m_transport->now());
+        m_clients.push_back(std::move(conn));
+        return *m_clients.back();
+    }
+
+    void finishConnect(Connection& c) {
+        if (m_transport->connectError(c.sock) != 0) {
+            c.closed = true;
+            if (!c.resuming) emit(SyncEvent::ConnectFailed);
+            return;
+        }
+        c.connecting = false;
+        onConnected(c);
+    }
+
+    // Client: dials the host, either for a new session or to resume the parked one.
+    void openLink(bool resuming) {
+        auto conn = std::make_unique<Connection>();
+        conn->peerId = kHostPeerId;
+        conn->resuming = resuming;
+        conn->remoteIp = m_hostAddr.sin_addr;
+        conn->lastHeard = m_transport->now();
+        conn->handshakeDeadline = conn->lastHeard + std::chrono::milliseconds(m_config.connectTimeoutMs);
+        conn->bulkBucket.configure(m_config.bulkBytesPerSecond, kBulkBurstBytes, m_transport->now());
+        conn->sock = m_transport->connect(m_hostAddr, conn->connecting);
+        if (!IS_VALID(conn->sock)) {
+            if (!resuming) emit(SyncEvent::ConnectFailed);
+            return;
+        }
+        if (!conn->connecting) onConnected(*conn);
+        m_clients.push_back(std::move(conn));
+    }
+
+    // The handshake goes first; the session's opening follows without waiting for the
+    // answer, since a host that refuses us reads no further.
+    void onConnected(Connection& c) {
+        queueMessage(c, HelloMsg{kProtocolVersion, m_sessionId});
+        if (c.resuming && !m_parked.empty()) {
+            queueMessage(c, ResumeMsg{m_parked.front()->token, m_parked.front()->receivedSeq});
+            return;
+        }
+        c.resuming = false;
+        beginSession(c);
+    }
+
+    void beginSession(Connection& c) {
+        // A new host numbers its peers' datagrams from scratch.
+        m_peerTransientSeen = {};
+        m_awaitingSnapshot = true;
+        // Ahead of the request, so the host can start the snapshot where we are looking.
+        if (m_hasViewport) queueMessage(c, viewportMsg());
+        SnapshotRequestMsg request;
+        if (!m_snapshotComplete) {
+            request.resumeSnapshotId = m_snapshotId;
+            request.nextChunk = m_snapshotNextChunk;
+        }
+        queueMessage(c, request);
+    }
+
+    // --- HANDSHAKE ---
+
+    // Host: answers a client's Hello. One speaking another version, or asking for a
+    // session we don't serve, is told so and dropped.
+    void greet(Connection& c, HelloMsg const& msg) {
+        auto status = HelloStatus::Accepted;
+        if (msg.version != kProtocolVersion) status = HelloStatus::VersionMismatch;
+        else if (!msg.session.empty() && msg.session != m_sessionId) status = HelloStatus::UnknownSession;
+        if (status == HelloStatus::Accepted) {
+            queueMessage(c, helloAck(status));
+            c.greeted = true;
+            return;
+        }
+        refuse(c, status);
+    }
+
+    HelloAckMsg helloAck(HelloStatus status) {
+        HelloAckMsg ack;
+        ack.status = status;
+        ack.players = playerCount();
+        ack.objects = (uint32_t)m_state.size();
+        ack.name = m_hostName;
+        if (IS_VALID(m_udpSocket)) ack.transientPort = m_transport->localPort(m_udpSocket);
+        return ack;
+    }
+
+    // Host: tells the client why it can't join and drops it once that is out.
+    void refuse(Connection& c, HelloStatus status) {
+        queueMessage(c, helloAck(status));
+        c.closing = true;
+        c.resumable = false;
+    }
+
+    // Client: the host's answer to our Hello, or its refusal of a new peer that came after.
+    void finishHandshake(Connection& c, HelloAckMsg const& msg) {
+        if (msg.status != HelloStatus::Accepted) {
+            c.closed = true;
+            c.resumable = false;
+            // A host that changed under us can't resume the session either.
+            for (auto& p : m_parked) retire(*p);
+            m_parked.clear();
+            switch (msg.status) {
+                case HelloStatus::UnknownSession: emit(SyncEvent::UnknownSession); break;
+                case HelloStatus::SessionFull: emit(SyncEvent::SessionFull); break;
+                default: emit(SyncEvent::VersionMismatch); break;
+            }
+            return;
+        }
+        c.greeted = true;
+        m_connected = true;
+        if (msg.transientPort) m_udpHost.sin_port = htons(msg.transientPort);
+        {
+            char ip[INET_ADDRSTRLEN] = {};
+            inet_ntop(AF_INET, &m_hostAddr.sin_addr, ip, sizeof(ip));
+            std::lock_guard<std::mutex> lock(m_discoveryMutex);
+            m_joined.ip = ip;
+            m_joined.session = m_sessionId;
+            m_joined.port = ntohs(m_hostAddr.sin_port);
+            m_joined.name = msg.name;
+            m_joined.players = msg.players;
+            m_joined.objects = msg.objects;
+            m_joined.version = msg.version;
+        }
+        if (!c.resuming) emit(SyncEvent::Connected);
+    }
+
+    // Drops links that are still connecting or haven't finished the handshake in time.
+    void expireHandshakes() {
+        auto now = m_transport->now();
+        for (auto& c : m_clients) {
+            if (c->greeted || c->closed || now < c->handshakeDeadline) continue;
+            c->closed = true;
+            c->resumable = false;
+            if (!m_isHost && !c->resuming) emit(SyncEvent::ConnectTimedOut);
+        }
+    }
+
+    // --- DISCOVERY ---
+
+    // A UDP socket that may broadcast, bound to `port` (shared) or, for 0, any free one.
+    // If `port` can't be had, one on a free port still sends, and the user is told.
+    SocketType openBroadcastSocket(uint16_t port) {
+        SocketType s = m_transport->openDatagram(port, true);
+        if (IS_VALID(s) || !port) return s;
+        emit(SyncEvent::DiscoveryPortInUse);
+        return m_transport->openDatagram(0, true);
+    }
+
+    uint16_t playerCount() const {
+        // A headless relay isn't anyone editing.
+        uint16_t players = m_config.deliverInbound ? 1 : 0;
+        for (auto& c : m_clients) if (c->joined) players++;
+        return players;
+    }
+
+    void sendBeacon(sockaddr_in const& to) {
+        DiscoveryBeacon beacon;
+        beacon.server.name = m_hostName;
+        beacon.server.session = m_sessionId;
+        beacon.server.version = kProtocolVersion;
+        beacon.server.port = m_config.port;
+        beacon.server.players = playerCount();
+        beacon.server.objects = (uint32_t)m_state.size();
+        thread_local std::vector<uint8_t> datagram;
+        datagram.clear();
+        PacketWriter w(datagram);
+        beacon.write(w);
+        m_transport->sendTo(m_beaconSocket, datagram, to);
+    }
+
+    // Host: answers queries on the beacon socket. Everything else arriving there, our own
+    // beacons and other hosts', is ignored.
+    void readQueries() {
+        uint8_t buffer[512];
+        while (true) {
+            sockaddr_in from;
+            long n = m_transport->recvFrom(m_beaconSocket, buffer, from);
+            if (n <= 0) return;
+            PacketReader reader(std::span<const uint8_t>(buffer, (size_t)n));
+            if (DiscoveryQuery::read(reader) && m_queryAnswers < kMaxQueryAnswers) {
+                m_queryAnswers++;
+                sendBeacon(from);
+            }
+        }
+    }
+
+    // Beacons, broadcast or in answer to our query, and echoes of our probes.
+    void readDiscovery(SocketType s) {
+        uint8_t buffer[512];
+        while (true) {
+            sockaddr_in from;
+            long n = m_transport->recvFrom(s, buffer, from);
+            if (n <= 0) return;
+            PacketReader reader(std::span<const uint8_t>(buffer, (size_t)n));
+            char ip[INET_ADDRSTRLEN] = {};
+            inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
+            if (n >= 4 && PacketReader::load32(buffer) == kProbeEchoMagic) {
+                DiscoveryEcho echo;
+                if (!DiscoveryEcho::read(reader, echo)) continue;
+                uint64_t arrived = nowUs();
+                std::lock_guard<std::mutex> lock(m_discoveryMutex);
+                m_servers.measured(ip, echo.rttMs(arrived), echo.clockOffsetUs(arrived));
+                continue;
+            }
+            DiscoveryBeacon beacon;
+            if (!DiscoveryBeacon::read(reader, beacon)) continue;
+            beacon.server.ip = ip;
+            auto ttl = std::chrono::milliseconds(std::clamp<uint16_t>(beacon.ttlMs, 1000, 30000));
+            std::lock_guard<std::mutex> lock(m_discoveryMutex);
+            m_servers.seen(beacon.server, m_transport->now() + ttl);
+        }
+    }
+
+    // One probe to every listed server, all sent in the same round.
+    void sendProbes() {
+        thread_local std::vector<ServerInfo> targets;
+        targets.clear();
+        {
+            std::lock_guard<std::mutex> lock(m_discoveryMutex);
+            m_servers.probing(targets);
+        }
+        if (targets.empty()) return;
+        thread_local std::vector<uint8_t> bytes;
+        bytes.clear();
+        PacketWriter w(bytes);
+        DiscoveryProbe{nowUs()}.write(w);
+        for (auto const& server : targets) {
+            auto to = sock::address(0, server.port);
+            if (inet_pton(AF_INET, server.ip.c_str(), &to.sin_addr) == 1) m_transport->sendTo(m_querySocket, bytes, to);
+        }
+    }
+
+    // Host: a probe arrived on the session port; echo it with our clock.
+    void answerProbe(PacketReader& reader, sockaddr_in const& from) {
+        DiscoveryProbe probe;
+        if (!DiscoveryProbe::read(reader, probe)) return;
+        uint64_t received = nowUs();
+        thread_local std::vector<uint8_t> bytes;
+        bytes.clear();
+        PacketWriter w(bytes);
+        DiscoveryEcho{probe.sentUs, received, nowUs()}.write(w);
+        sendDatagram(bytes, from);
+    }
+
+    // Drops servers whose TTL ran out. Returns when the next entry expires.
+    std::chrono::steady_clock::time_point pumpDiscovery() {
+        std::lock_guard<std::mutex> lock(m_discoveryMutex);
+        m_servers.expire(m_transport->now());
+        return m_servers.nextExpiry();
+    }
+
+    void readClient(Connection& c) {
+        while (true) {
+            auto space = c.decoder.prepare();
+            long n = m_transport->recv(c.sock, space);
+            if (n == 0 || n == kSocketError) { c.closed = true; return; }
+            if (n < 0) return;
+            c.decoder.commit((size_t)n);
+            c.stats.bytesIn += (uint64_t)n;
+            c.lastHeard = m_transport->now();
+            if (!drainFrames(c)) return;
+        }
+    }
+
+    // Handles every complete frame the link has buffered. False once it stops reading.
+    bool drainFrames(Connection& c) {
+        bool ok = c.decoder.drain([&](Frame const& frame) {
+            // A refused client's frames after its Hello are left unread.
+            if (c.closing) return;
+            c.stats.packetsIn++;
+            if (!isLinkControl(frame.type)) c.receivedSeq++;
+            handleFrame(frame, &c);
+        });
+        if (c.closing) return false;
+        if (!ok) {
+            c.stats.decodeErrors++;
+            c.closed = true;
+            c.resumable = false;
+            return false;
+        }
+        return true;
+    }
+
+    // Writes as much of the peer's queue as the socket takes, in one scatter-gather call
+    // per round instead of one send() per packet.
+    void flushClient(Connection& c) {
+        std::span<const uint8_t> parts[kMaxGather];
+        auto now = m_transport->now();
+        while (true) {
+            c.sendQueue.schedule(c.bulkBucket, now, [&](Packet const& packet, Lane lane) { commit(c, packet, lane); });
+            if (c.sendQueue.wireEmpty()) return;
+            size_t count = c.sendQueue.gather(parts);
+            long n = m_transport->send(c.sock, std::span(parts, count));
+            m_sendCalls.fetch_add(1, std::memory_order_relaxed);
+            c.stats.sendCalls++;
+            if (n < 0) {
+                if (n == kSocketError) c.closed = true;
+                return;
+            }
+            c.sendQueue.consume((size_t)n);
+            c.stats.bytesOut += (uint64_t)n;
+        }
+    }
+
+    static Lane laneOf(MsgType type) {
+        switch (type) {
+            case MsgType::SnapshotBegin:
+            case MsgType::SnapshotChunk:
+            case MsgType::SnapshotEnd:
+            case MsgType::ObjectBlock:
+                return Lane::Bulk;
+            case MsgType::Batch:
+            case MsgType::TransformBlock:
+            case MsgType::TreeDigest:
+            case MsgType::TreeQuery:
+            case MsgType::BucketDigest:
+                return Lane::Interactive;
+            default:
+                return Lane::Control;
+        }
+    }
+
+    // Every packet holds exactly one frame; its type sits right after the length.
+    void enqueue(Connection& c, Packet const& packet) {
+        MsgType type = MsgType((*packet)[5]);
+        if (c.parked) {
+            commit(c, packet, Lane::Control);
+            return;
+        }
+        Lane lane = laneOf(type);
+        // Nothing overtakes an edit still waiting in the bulk lane: a receiver drops edits
+        // to objects it hasn't been sent yet.
+        if (lane == Lane::Interactive && c.bulkEdits) lane = Lane::Bulk;
+        if (lane == Lane::Bulk && isEditFrame(type)) c.bulkEdits++;
+        if (lane == Lane::Control) commit(c, packet, lane);
+        c.sendQueue.push(packet, lane);
+        c.stats.packetsOut++;
+        c.stats.peakQueueBytes = std::max(c.stats.peakQueueBytes, c.pendingBytes());
+        if (c.pendingBytes() > kSendHardLimit) {
+            c.closed = true;
+            c.resumable = false;
+            emit(SyncEvent::PeerDropped);
+        }
+    }
+
+    // A packet takes its place on the wire. Numbering here rather than in enqueue() keeps
+    // the numbers in the order the peer receives them, whichever lane they waited in.
+    void commit(Connection& c, Packet const& packet, Lane lane) {
+        MsgType type = MsgType((*packet)[5]);
+        if (lane == Lane::Bulk && isEditFrame(type)) c.bulkEdits--;
+        if (isLinkControl(type)) return;
+        c.sentSeq++;
+        c.unacked.push(packet);
+    }
+
+    template <class Msg>
+    void queueMessage(Connection& c, Msg const& msg) {
+        PacketBuffer buffer;
+        PacketWriter writer(buffer.bytes());
+        msg.write(writer);
+        enqueue(c, buffer.take());
+    }
+
+    // `from` is the peer the frame arrived on, or null for edits made locally.
+    void handleFrame(Frame const& frame, Connection* from) {
+        PacketReader reader(frame.payload);
+        if (from && !from->greeted && !isHandshake(frame.type)) {
+            from->closed = true;
+            from->resumable = false;
+            return;
+        }
+        switch (frame.type) {
+            case MsgType::Hello: {
+                HelloMsg msg;
+                if (m_isHost && from && !from->greeted && !from->closing && HelloMsg::read(reader, msg)) greet(*from, msg);
+                return;
+            }
+            case MsgType::HelloAck: {
+                HelloAckMsg msg;
+                if (!m_isHost && from && HelloAckMsg::read(reader, msg) && (!from->greeted || msg.status == HelloStatus::SessionFull)) finishHandshake(*from, msg);
+                return;
+            }
+            case MsgType::SnapshotRequest: {
+                SnapshotRequestMsg msg;
+                if (m_isHost && from && SnapshotRequestMsg::read(reader, msg)) startSnapshot(*from, msg);
+                return;
+            }
+            case MsgType::Welcome: {
+                WelcomeMsg msg;
+                if (!m_isHost && from && WelcomeMsg::read(reader, msg)) {
+                    m_localPeer = msg.peerId;
+                    from->token = msg.token;
+                    sendOwnTransient();
+                }
+                return;
+            }
+            case MsgType::Ack: {
+                AckMsg msg;
+                if (from && AckMsg::read(reader, msg) && msg.received <= from->sentSeq) {
+                    from->ackedSeq = std::max(from->ackedSeq, msg.received);
+                    from->unacked.ack(msg.received);
+                }
+                return;
+            }
+            case MsgType::Resume: {
+                ResumeMsg msg;
+                if (m_isHost && from && !from->joined && ResumeMsg::read(reader, msg)) resumeSession(*from, msg);
+                return;
+            }
+            case MsgType::Resumed: {
+                ResumedMsg msg;
+                if (!m_isHost && from && from->resuming && ResumedMsg::read(reader, msg)) finishResume(*from, msg);
+                return;
+            }
+            case MsgType::Ping: {
+                PingMsg msg;
+                if (from && PingMsg::read(reader, msg)) queueMessage(*from, PongMsg{msg.sentUs});
+                return;
+            }
+            case MsgType::Pong: {
+                PongMsg msg;
+                if (from && PongMsg::read(reader, msg)) from->stats.rttMs = double(nowUs() - msg.sentUs) / 1000.0;
+                return;
+            }
+            case MsgType::Viewport: {
+                ViewportMsg msg;
+                if (m_isHost && from && ViewportMsg::read(reader, msg)) setPeerViewport(*from, {msg.minX, msg.minY, msg.maxX, msg.maxY});
+                return;
+            }
+            case MsgType::ObjectBlock: {
+                auto block = std::make_shared<ObjectBlock>();
+                uint64_t stamp = 0;
+                if (!readObjectBlock(reader, *block, stamp)) {
+                    if (from) from->stats.decodeErrors++;
+                    return;
+                }
+                m_log.append(frame.bytes);
+                observe(stamp);
+                applyRecord({ObjectBlockMsg{std::move(block)}, stamp}, from);
+                relay(frame, from, {});
+                return;
+            }
+            case MsgType::TransformBlock: {
+                thread_local std::vector<TransformObjectMsg> transforms;
+                thread_local std::vector<RecordSpan> records;
+                uint64_t stamp = 0;
+                if (!readTransformBlock(reader, transforms, stamp)) {
+                    if (from) from->stats.decodeErrors++;
+                    return;
+                }
+                m_log.append(frame.bytes);
+                observe(stamp);
+                records.clear();
+                for (uint32_t i = 0; i < transforms.size(); ++i) {
+                    EditOp op{transforms[i], stamp};
+                    if (m_isHost) records.push_back(locate(op, i, i + 1));
+                    applyRecord(std::move(op), from);
+                }
+                relay(frame, from, records, transforms, stamp);
+                return;
+            }
+            case MsgType::TreeDigest: {
+                TreeDigestMsg msg;
+                if (m_isHost && from && TreeDigestMsg::read(reader, msg)) checkDigest(*from, msg);
+                return;
+            }
+            case MsgType::TreeQuery: {
+                TreeQueryMsg msg;
+                if (!m_isHost && from && TreeQueryMsg::read(reader, msg)) answerQuery(*from, msg);
+                return;
+            }
+            case MsgType::BucketDigest: {
+                BucketDigestMsg msg;
+                if (m_isHost && from && from->joined && BucketDigestMsg::read(reader, msg)) repairBuckets(*from, msg);
+                return;
+            }
+            case MsgType::SnapshotBegin:
+            case MsgType::SnapshotChunk:
+            case MsgType::SnapshotEnd:
+                if (!m_isHost && from) receiveSnapshot(frame.type, reader);
+                return;
+            case MsgType::Batch: {
+                BatchHeader header;
+                if (!BatchHeader::read(reader, header)) return;
+                // The whole batch is decoded before any of it is applied: a malformed record
+                // means none of it can be trusted, and a batch only ever goes to every copy
+                // of the level or to none.
+                thread_local std::vector<EditOp> ops;
+                thread_local std::vector<std::pair<uint32_t, uint32_t>> extents;
+                ops.clear();
+                extents.clear();
+                for (uint16_t i = 0; i < header.count; ++i) {
+                    size_t begin = reader.position();
+                    EditOp op;
+                    if (!EditOp::read(static_cast<MsgType>(reader.u8()), reader, op)) {
+                        if (from) from->stats.decodeErrors++;
+                        return;
+                    }
+                    op.stamp = header.stamp;
+                    ops.push_back(std::move(op));
+                    extents.emplace_back((uint32_t)begin, (uint32_t)reader.position());
+                }
+                observe(header.stamp);
+                m_log.append(frame.bytes);
+                thread_local std::vector<RecordSpan> records;
+                records.clear();
+                for (size_t i = 0; i < ops.size(); ++i) {
+                    if (auto state = std::get_if<ObjectStateMsg>(&ops[i].msg)) observe(state->stamps.newest());
+                    if (m_isHost) records.push_back(locate(ops[i], extents[i].first, extents[i].second));
+                    applyRecord(std::move(ops[i]), from);
+                }
+                relay(frame, from, records);
+                return;
+            }
+            default:
+                return;
+        }
+    }
+
+    // Encodes the frame once and shares it with every recipient that wants all of it. The
+    // peer it came from already has it and is skipped. A TransformBlock passes its decoded
+    // transforms, since its records can't be cut out of the frame.
+    void relay(Frame const& frame, Connection* from, std::span<const RecordSpan> records, std::span<const TransformObjectMsg> transforms = {}, uint64_t stamp = 0) {
+        if (!m_isHost && from) return;
+        Packet packet;
+        for (auto* links : {&m_clients, &m_parked}) {
+            for (auto& c : *links) {
+                if (c.get() == from || c->closed || c->connecting || c->resuming) continue;
+                if (m_isHost && !c->joined) continue;
+                if (m_isHost && c->hasViewport) {
+                    bool whole = transforms.empty() ? relayFiltered(*c, frame, records) : relayTransforms(*c, records, transforms, stamp);
+                    if (!whole) continue;
+                }
+                if (!packet) packet = makePacket(frame.bytes);
+                enqueue(*c, packet);
+            }
+        }
+    }
+
+    void applyRecord(EditOp&& op, Connection* from) {
+        m_state.apply(op);
+        if (from && m_config.deliverInbound) deliver(std::move(op));
+    }
+
+    // Remote edits that arrive while our snapshot is still streaming belong after it.
+    void deliver(EditOp&& op) {
+        if (m_awaitingSnapshot) m_heldOps.push_back(std::move(op));
+        else pushInbound(std::move(op));
+    }
+
+    // --- INTEREST MANAGEMENT ---
+
+    RecordSpan locate(EditOp const& op, size_t begin, size_t end) const {
+        RecordSpan span;
+        span.netId = op.netId();
+        span.begin = (uint32_t)begin;
+        span.end = (uint32_t)end;
+        if (auto obj = m_state.find(span.netId)) {
+            span.hasFrom = true;
+            span.fromX = obj->x;
+            span.fromY = obj->y;
+        }
+        std::visit([&](auto const& m) {
+            using M = std::decay_t<decltype(m)>;
+            if constexpr (std::is_same_v<M, CreateObjectMsg>) {
+                span.hasTo = true;
+                span.toX = m.object.x;
+                span.toY = m.object.y;
+            }
+            else if constexpr (std::is_same_v<M, TransformObjectMsg>) {
+                span.hasTo = true;
+                span.toX = m.x;
+                span.toY = m.y;
+            }
+        }, op.msg);
+        return span;
+    }
+
+    // Collects the records the peer should get now in `kept` and holds back the rest.
+    // Returns true if it wants every record unchanged and can take the shared packet.
+    bool keepVisible(Connection& c, std::span<const RecordSpan> records, std::vector<uint32_t>& kept) {
+        kept.clear();
+        bool refresh = false;
+        for (uint32_t i = 0; i < records.size(); ++i) {
+            auto const& r = records[i];
+            if (!r.visibleIn(c.viewport)) {
+                if (c.deferred.empty()) c.nextDeferredFlush = m_transport->now() + kDeferredFlushInterval;
+                c.deferred.insert(r.netId, 0);
+                continue;
+            }
+            kept.push_back(i);
+            // An object with held-back edits needs its whole record, not just this change.
+            refresh |= c.deferred.contains(r.netId);
+        }
+        return kept.size() == records.size() && !refresh;
+    }
+
+    // Queues the peer's share of a batch. Returns true if it can take the shared packet instead.
+    bool relayFiltered(Connection& c, Frame const& frame, std::span<const RecordSpan> records) {
+        thread_local std::vector<uint32_t> kept;
+        if (keepVisible(c, records, kept)) return true;
+        if (kept.empty()) return false;
+
+        PacketReader reader(frame.payload);
+        BatchHeader header;
+        BatchHeader::read(reader, header);
+        PacketBuffer buffer;
+        PacketWriter w(buffer.bytes());
+        BatchHeader{uint16_t(kept.size()), 0, header.stamp}.write(w);
+        for (uint32_t i : kept) {
+            auto const& r = records[i];
+            if (c.deferred.erase(r.netId)) writeCurrent(w, r.netId);
+            else w.bytes(frame.payload.data() + r.begin, r.end - r.begin);
+        }
+        w.finish();
+        enqueue(c, buffer.take());
+        return false;
+    }
+
+    // The same for a TransformBlock: the visible transforms are packed again, and objects
+    // with held-back edits get their whole record in a refresh.
+    bool relayTransforms(Connection& c, std::span<const RecordSpan> records, std::span<const TransformObjectMsg> transforms, uint64_t stamp) {
+        thread_local std::vector<uint32_t> kept, refresh;
+        thread_local std::vector<TransformObjectMsg> visible;
+        if (keepVisible(c, records, kept)) return true;
+        visible.clear();
+        refresh.clear();
+        for (uint32_t i : kept) {
+            if (c.deferred.contains(records[i].netId)) refresh.push_back(records[i].netId);
+            else visible.push_back(transforms[i]);
+        }
+        if (!visible.empty()) {
+            PacketBuffer buffer;
+            writeTransformBlock(visible, stamp, buffer.bytes());
+            enqueue(c, buffer.take());
+        }
+        sendRefresh(c, refresh);
+        return false;
+    }
+
+    // The object as the host has it now, stamps and all, or a delete if it is gone.
+    void writeCurrent(PacketWriter& w, uint32_t netId) const {
+        if (auto obj = m_state.find(netId)) ObjectStateMsg{*obj, *m_state.stamps(netId)}.writeRecord(w);
+        else DeleteObjectMsg{netId}.writeRecord(w);
+    }
+
+    // Sends the current state of `ids` and forgets that they were deferred.
+    void sendRefresh(Connection& c, std::span<const uint32_t> ids) {
+        for (size_t start = 0; start < ids.size(); start += kMaxBatchRecords) {
+            size_t count = std::min(kMaxBatchRecords, ids.size() - start);
+            PacketBuffer buffer;
+            PacketWriter w(buffer.bytes());
+            BatchHeader{uint16_t(count), 0, 0}.write(w);
+            for (size_t i = start; i < start + count; ++i) {
+                c.deferred.erase(ids[i]);
+                writeCurrent(w, ids[i]);
+            }
+            w.finish();
+            enqueue(c, buffer.take());
+        }
+    }
+
+    // A new viewport first catches up on whatever was held back inside it. The grid is
+    // walked rather than the deferred set, so a long backlog elsewhere costs nothing here.
+    void setPeerViewport(Connection& c, Rect const& area) {
+        c.viewport = area;
+        c.hasViewport = true;
+        if (c.deferred.empty()) return;
+        thread_local std::vector<uint32_t> due;
+        due.clear();
+        m_state.grid().forEachIn(area, [&](uint32_t netId) {
+            if (c.deferred.contains(netId)) due.push_back(netId);
+        });
+        sendRefresh(c, due);
+    }
+
+    // Off-screen objects still converge, a slice per peer every kDeferredFlushInterval
+    // and only while nothing more urgent is queued for it.
+    void pumpDeferred() {
+        auto now = m_transport->now();
+        thread_local std::vector<uint32_t> due;
+        for (auto& c : m_clients) {
+            if (c->deferred.empty() || c->closed || c->snapshot || now < c->nextDeferredFlush) continue;
+            if (c->pendingBytes() > kSnapshotWindowBytes) continue;
+            due.clear();
+            c->deferred.forEach([&](uint32_t netId, uint8_t) {
+                if (due.size() < kDeferredFlushRecords) due.push_back(netId);
+            });
+            sendRefresh(*c, due);
+            c->nextDeferredFlush = now + kDeferredFlushInterval;
+        }
+    }
+
+    ViewportMsg viewportMsg() const { return {m_viewport.minX, m_viewport.minY, m_viewport.maxX, m_viewport.maxY}; }
+
+    // --- VERIFICATION ---
+
+    // Client: once the snapshot is in, sends our root every verifyIntervalMs.
+    void startVerify() {
+        if (m_isHost || !m_config.verifyIntervalMs || !m_snapshotComplete || m_awaitingSnapshot) return;
+        auto now = m_transport->now();
+        if (now < m_nextVerify) return;
+        m_nextVerify = now + std::chrono::milliseconds(m_config.verifyIntervalMs);
+        TreeDigestMsg digest{0, {{0, m_state.tree().root()}}};
+        for (auto& c : m_clients) if (!c->connecting && !c->closed && !c->resuming) queueMessage(*c, digest);
+    }
+
+    // Host: asks for the children of every node that differs from ours, or for the objects
+    // of leaves that differ. A peer that is still streaming its snapshot or has deferred
+    // edits differs for a known reason and is left alone until it catches up.
+    void checkDigest(Connection& c, TreeDigestMsg const& msg) {
+        if (!c.joined || c.snapshot || !c.deferred.empty() || msg.level > kTreeDepth) return;
+        TreeQueryMsg query{uint8_t(msg.level + 1), {}};
+        for (auto const& n : msg.nodes) {
+            if (n.index >= treeLevelSize(msg.level) || m_state.tree().node(msg.level, n.index) == n.hash) continue;
+            if (msg.level == kTreeDepth) {
+                if (query.indices.size() < kMaxTreeNodes) query.indices.push_back(n.index);
+                continue;
+            }
+            for (uint32_t i = 0; i < (1u << kTreeFanoutBits) && query.indices.size() < kMaxTreeNodes; ++i) {
+                query.indices.push_back(uint16_t((uint32_t(n.index) << kTreeFanoutBits) | i));
+            }
+        }
+        if (!query.indices.empty()) queueMessage(c, query);
+    }
+
+    // Client: our hashes for the nodes asked about, or our objects' hashes for the leaves.
+    void answerQuery(Connection& c, TreeQueryMsg const& msg) {
+        if (msg.level == kTreeObjectLevel) {
+            std::bitset<kTreeLeaves> leaves;
+            BucketDigestMsg digest;
+            for (uint16_t i : msg.indices) {
+                if (i >= kTreeLeaves || leaves[i]) continue;
+                leaves.set(i);
+                digest.buckets.push_back(i);
+            }
+            m_state.forEachInLeaves(leaves, [&](ObjectRecord const& record, ObjectStamps const& stamps) {
+                if (digest.objects.size() < kMaxBucketObjects) digest.objects.push_back({record.netId, objectHash(record, stamps)});
+            });
+            queueMessage(c, digest);
+            return;
+        }
+        if (msg.level > kTreeDepth) return;
+        TreeDigestMsg digest{msg.level, {}};
+        for (uint16_t i : msg.indices) {
+            if (i < treeLevelSize(msg.level)) digest.nodes.push_back({i, m_state.tree().node(msg.level, i)});
+        }
+        queueMessage(c, digest);
+    }
+
+    // Host: resends every object in the client's buckets that it is missing or has
+    // differently, and a delete for whatever it has that we don't.
+    void repairBuckets(Connection& c, BucketDigestMsg const& msg) {
+        thread_local FlatMap<uint32_t, uint64_t> theirs;
+        thread_local std::vector<uint32_t> due;
+        theirs.clear();
+        due.clear();
+        for (auto const& o : msg.objects) {
+            if (!o.netId) continue;
+            theirs.insert(o.netId, o.hash);
+            auto obj = m_state.find(o.netId);
+            if (!obj || objectHash(*obj, *m_state.stamps(o.netId)) != o.hash) due.push_back(o.netId);
+        }
+        std::bitset<kTreeLeaves> leaves;
+        for (uint16_t b : msg.buckets) if (b < kTreeLeaves) leaves.set(b);
+        m_state.forEachInLeaves(leaves, [&](ObjectRecord const& record, ObjectStamps const&) {
+            if (!theirs.contains(record.netId)) due.push_back(record.netId);
+        });
+        c.stats.repairedObjects += due.size();
+        sendRefresh(c, due);
+    }
+
+    // --- RESUME ---
+
+    // A link that dropped without us meaning it to, once its session has started.
+    bool canPark(Connection const& c) const {
+        if (!m_running || !c.resumable || !c.token || c.resuming) return false;
+        return !m_isHost || c.joined;
+    }
+
+    void park(std::unique_ptr<Connection> c) {
+        // What never reached the wire is numbered now and goes out on resume.
+        c->sendQueue.drainLanes([&](Packet const& packet, Lane lane) { commit(*c, packet, lane); });
+        c->sendQueue.clear();
+        c->closed = false;
+        c->parked = true;
+        c->parkedUntil = m_transport->now() + std::chrono::milliseconds(m_config.resumeWindowMs);
+        c->stats.queueBytes = 0;
+        if (!m_isHost) {
+            m_reconnectDelay = kReconnectMinDelay;
+            m_nextReconnect = m_transport->now();
+            emit(SyncEvent::Reconnecting);
+        }
+        m_parked.push_back(std::move(c));
+    }
+
+    void retire(Connection& c) {
+        c.stats.queueBytes = 0;
+        m_retired.add(c.stats);
+    }
+
+    // Host: a parked session is dropped once its window is over, or as soon as it lost a
+    // frame the peer hasn't acked, since it could only be resumed with a snapshot anyway.
+    void expireParked() {
+        if (!m_isHost) return;
+        auto now = m_transport->now();
+        std::erase_if(m_parked, [&](auto const& c) {
+            if (!c->closed && now < c->parkedUntil && c->unacked.covers(c->ackedSeq)) return false;
+            retire(*c);
+            return true;
+        });
+    }
+
+    // Client: while our session is parked and no attempt is in flight, dials the host
+    // again, backing off, until the host can't have kept the session any longer.
+    void pumpReconnect() {
+        if (m_isHost || m_parked.empty() || !m_clients.empty()) return;
+        auto now = m_transport->now();
+        if (now >= m_parked.front()->parkedUntil) {
+            retire(*m_parked.front());
+            m_parked.clear();
+            emit(SyncEvent::ConnectionLost);
+            return;
+        }
+        if (now < m_nextReconnect) return;
+        m_nextReconnect = now + m_reconnectDelay;
+        m_reconnectDelay = std::min<std::chrono::milliseconds>(m_reconnectDelay * 2, kReconnectMaxDelay);
+        openLink(true);
+    }
+
+    // Tells each peer how far we got, if that moved since the last Ack.
+    void pumpAcks() {
+        for (auto& c : m_clients) {
+            if (c->connecting || c->closed || c->resuming || c->receivedSeq == c->ackSentSeq) continue;
+            c->ackSentSeq = c->receivedSeq;
+            queueMessage(*c, AckMsg{c->receivedSeq});
+        }
+    }
+
+    // Moves the peer's session from `from` onto the new link `to`. The socket, decoder,
+    // send queue and transient address stay with `to`.
+    static void adoptSession(Connection& to, Connection& from) {
+        to.joined = from.joined;
+        to.peerId = from.peerId;
+        to.snapshot = std::move(from.snapshot);
+        to.chunkOrder = std::move(from.chunkOrder);
+        to.chunkPos = from.chunkPos;
+        to.viewport = from.viewport;
+        to.hasViewport = from.hasViewport;
+        to.deferred = std::move(from.deferred);
+        to.nextDeferredFlush = from.nextDeferredFlush;
+        to.token = std::exchange(from.token, 0);
+        to.sentSeq = from.sentSeq;
+        to.receivedSeq = from.receivedSeq;
+        to.ackedSeq = from.ackedSeq;
+        to.ackSentSeq = from.ackSentSeq;
+        to.unacked = std::move(from.unacked);
+        to.stats.resumes++;
+    }
+
+    // Queues again every packet after `received`, under the numbers it was first sent with.
+    void resend(Connection& c, uint64_t received) {
+        c.ackedSeq = std::max(c.ackedSeq, received);
+        c.unacked.ack(received);
+        c.unacked.forEachAfter(received, [&](Packet const& packet) {
+            c.sendQueue.push(packet);
+            c.stats.packetsOut++;
+            c.stats.resentPackets++;
+        });
+    }
+
+    // Host: a client is back on a new link. If we still hold its session and every frame
+    // it missed, the session moves onto the link and carries on where it stopped. The old
+    // link may not have noticed the drop yet, so live links are searched too.
+    void resumeSession(Connection& c, ResumeMsg const& msg) {
+        Connection* old = nullptr;
+        for (auto* links : {&m_parked, &m_clients}) {
+            for (auto& p : *links) if (p.get() != &c && p->token && p->token == msg.token) old = p.get();
+        }
+        if (old) {
+            old->closed = true;
+            old->resumable = false;
+        }
+        if (!old || !old->unacked.covers(msg.received)) {
+            // The client starts over; it resends whatever of its own we never received.
+            queueMessage(c, ResumedMsg{false, old ? old->receivedSeq : 0});
+            return;
+        }
+        adoptSession(c, *old);
+        queueMessage(c, ResumedMsg{true, c.receivedSeq});
+        resend(c, msg.received);
+    }
+
+    // Client: the host's answer to our Resume. Either way our edits it never received go
+    // out again; without the session they follow a fresh SnapshotRequest.
+    void finishResume(Connection& c, ResumedMsg const& msg) {
+        c.resuming = false;
+        if (m_parked.empty()) {
+            beginSession(c);
+            emit(SyncEvent::Connected);
+            return;
+        }
+        auto old = std::move(m_parked.front());
+        m_parked.clear();
+        retire(*old);
+        if (msg.ok) {
+            adoptSession(c, *old);
+            resend(c, msg.received);
+            if (m_hasViewport) queueMessage(c, viewportMsg());
+            sendOwnTransient();
+            emit(SyncEvent::Resumed);
+            return;
+        }
+        beginSession(c);
+        emit(SyncEvent::Connected);
+        old->unacked.forEachAfter(msg.received, [&](Packet const& packet) {
+            if (isEditFrame(MsgType((*packet)[5]))) enqueue(c, packet);
+        });
+    }
+
+    // --- SESSION LOG ---
+
+    // Writes this round's edits out, adding a snapshot marker when enough has piled up.
+    void pumpLog() {
+        if (!m_log.isOpen()) return;
+        auto now = m_transport->now();
+        uint64_t pending = m_log.bytesSinceMarker();
+        if (pending >= kLogMarkerBytes || (pending && now >= m_nextLogMarker)) writeLogMarker();
+        m_log.flush();
+    }
+
+    // The marker doubles as the snapshot for the next joiner.
+    void writeLogMarker() {
+        m_log.appendSnapshot(*currentSnapshot());
+        m_log.flush();
+        m_nextLogMarker = m_transport->now() + kLogMarkerInterval;
+    }
+
+    // --- TRANSIENT CHANNEL ---
+
+    void openUdp(uint16_t port) {
+        m_udpSocket = m_transport->openDatagram(port, false);
+        // Without it TCP still works; peers just fall back to sending drags as edits.
+        if (IS_VALID(m_udpSocket)) m_transientReady = true;
+    }
+
+    // Sends our latest transient state with the next sequence number. With nothing to
+    // show yet an empty state still goes out, so the host learns where to reach us.
+    void sendOwnTransient() {
+        if (!IS_VALID(m_udpSocket) || m_localPeer == 0) return;
+        thread_local std::vector<uint8_t> datagram;
+        datagram.clear();
+        PacketWriter w(datagram);
+        TransientHeader{m_localPeer, ++m_transientSeq}.write(w);
+        if (m_transientBody.empty()) TransientState{}.write(w, kMaxDatagramSize - kTransientHeaderSize);
+        else w.bytes(m_transientBody.data(), m_transientBody.size());
+        if (m_isHost) {
+            for (auto& c : m_clients) if (c->udpKnown && !c->closed) sendDatagram(datagram, c->udpAddr);
+        }
+        else if (m_connected) sendDatagram(datagram, m_udpHost);
+    }
+
+    void sendDatagram(std::span<const uint8_t> bytes, sockaddr_in const& to) {
+        m_transport->sendTo(m_udpSocket, bytes, to);
+    }
+
+    void readTransient() {
+        uint8_t buffer[kMaxDatagramSize];
+        while (true) {
+            sockaddr_in from;
+            long n = m_transport->recvFrom(m_udpSocket, buffer, from);
+            if (n <= 0) return;
+            std::span<const uint8_t> datagram(buffer, (size_t)n);
+            PacketReader reader(datagram);
+            if (n >= 4 && PacketReader::load32(buffer) == kProbeMagic) {
+                if (m_isHost) answerProbe(reader, from);
+                continue;
+            }
+            TransientHeader header;
+            if (!TransientHeader::read(reader, header) || header.peerId == m_localPeer) continue;
+
+            Connection* sender = nullptr;
+            if (m_isHost) {
+                // Only accept a peer's datagrams from the machine its TCP link comes from.
+                for (auto& c : m_clients) {
+                    if (c->joined && !c->closed && c->peerId == header.peerId && c->remoteIp.s_addr == from.sin_addr.s_addr) sender = c.get();
+                }
+                if (!sender) continue;
+                sender->udpAddr = from;
+                sender->udpKnown = true;
+            }
+            else if (from.sin_addr.s_addr != m_udpHost.sin_addr.s_addr || from.sin_port != m_udpHost.sin_port) continue;
+
+            // Latest wins: anything not newer than what we already have from this peer is stale.
+            if (m_peerTransientSeen[header.peerId] && !seqNewer(header.seq, m_peerTransientSeq[header.peerId])) continue;
+            m_peerTransientSeen[header.peerId] = true;
+            m_peerTransientSeq[header.peerId] = header.seq;
+            if (sender) {
+                for (auto& c : m_clients) {
+                    if (c.get() != sender && c->udpKnown && !c->closed) sendDatagram(datagram, c->udpAddr);
+                }
+            }
+            if (!m_config.deliverInbound) continue;
+            TransientState state;
+            if (!TransientState::read(reader, state)) continue;
+            std::lock_guard<std::mutex> lock(m_transientMutex);
+            m_transientIn[header.peerId] = std::move(state);
+        }
+    }
+
+    // Filled in place, so the link list keeps its storage from one publish to the next.
+    void publishMetrics() {
+        std::lock_guard<std::mutex> lock(m_metricsMutex);
+        NetMetrics& m = m_metrics;
+        m.timeSec = double(nowUs()) / 1e6;
+        m.host = m_isHost;
+        m.localPeer = m_localPeer;
+        m.links.clear();
+        m.total = m_retired;
+        double rttSum = 0.0;
+        int rttCount = 0;
+        for (auto& c : m_clients) {
+            c->stats.peerId = c->peerId;
+            c->stats.queueBytes = c->pendingBytes();
+            m.links.push_back(c->stats);
+            m.total.add(c->stats);
+            if (c->stats.rttMs >= 0) {
+                rttSum += c->stats.rttMs;
+                rttCount++;
+            }
+        }
+        m.total.rttMs = rttCount ? rttSum / rttCount : -1.0;
+    }
+
+    // --- LATE JOIN ---
+
+    void startSnapshot(Connection& c, SnapshotRequestMsg const& request) {
+        if (!c.peerId) {
+            // Peer ids are never reused within a session, so net ids stay unique. A peer
+            // resuming its session keeps its id; a new one is turned away once they ran out.
+            if (m_nextPeerId > 0xFF) {
+                refuse(c, HelloStatus::SessionFull);
+                emit(SyncEvent::SessionFull);
+                return;
+            }
+            c.peerId = (uint8_t)m_nextPeerId++;
+        }
+        while (!c.token) c.token = m_tokens();
+        queueMessage(c, WelcomeMsg{c.peerId, c.token});
+        currentSnapshot();
+        uint16_t first = 0;
+        if (request.resumeSnapshotId == m_lastSnapshot->id) first = std::min(request.nextChunk, m_lastSnapshot->chunkCount());
+        c.snapshot = m_lastSnapshot;
+        c.chunkOrder = c.snapshot->sendOrder(first, c.hasViewport ? &c.viewport : nullptr);
+        c.chunkPos = 0;
+        c.joined = true;
+        queueMessage(c, SnapshotBeginMsg{c.snapshot->id, c.snapshot->objectCount(), c.snapshot->chunkCount(), first});
+    }
+
+    // The newest snapshot, taken again only if the level changed since.
+    std::shared_ptr<Snapshot> const& currentSnapshot() {
+        if (!m_lastSnapshot || m_lastSnapshot->stateVersion != m_state.version()) {
+            m_lastSnapshot = std::make_shared<Snapshot>(m_nextSnapshotId++, m_state);
+        }
+        return m_lastSnapshot;
+    }
+
+    // Streams the next chunks to every peer that is mid-transfer and has room in its send queue.
+    void pumpSnapshots() {
+        for (auto& c : m_clients) {
+            if (!c->snapshot || c->closed) continue;
+            while (c->chunkPos < c->chunkOrder.size() && c->pendingBytes() < kSnapshotWindowBytes) {
+                enqueue(*c, c->snapshot->chunkFrame(c->chunkOrder[c->chunkPos++]));
+            }
+            if (c->chunkPos == c->chunkOrder.size()) {
+                queueMessage(*c, SnapshotEndMsg{c->snapshot->id});
+                c->snapshot.reset();
+            }
+        }
+    }
+
+    void receiveSnapshot(MsgType type, PacketReader& reader) {
+        if (type == MsgType::SnapshotBegin) {
+            SnapshotBeginMsg msg;
+            if (!SnapshotBeginMsg::read(reader, msg)) return;
+            // A resumed transfer keeps whatever arrived out of order last time.
+            if (msg.snapshotId != m_snapshotId || m_snapshotReceived.size() != msg.chunkCount) m_snapshotReceived.assign(msg.chunkCount, false);
+            for (uint16_t i = 0; i < msg.firstChunk && i < msg.chunkCount; ++i) m_snapshotReceived[i] = true;
+            m_snapshotId = msg.snapshotId;
+            m_snapshotNextChunk = msg.firstChunk;
+            m_snapshotComplete = false;
+        }
+        else if (type == MsgType::SnapshotChunk) {
+            SnapshotChunkHeader header;
+            if (!SnapshotChunkHeader::read(reader, header)) return;
+            if (header.snapshotId != m_snapshotId || header.index >= m_snapshotReceived.size() || m_snapshotReceived[header.index]) return;
+            thread_local std::vector<ObjectRecord> records;
+            thread_local std::vector<ObjectStamps> stamps;
+            records.clear();
+            stamps.clear();
+            if (!decodeSnapshotChunk(header, reader.rest(), records, stamps)) return;
+            for (size_t i = 0; i < records.size(); ++i) {
+                observe(stamps[i].newest());
+                EditOp op{ObjectStateMsg{records[i], stamps[i]}};
+                m_state.apply(op);
+                if (m_config.deliverInbound) pushInbound(std::move(op));
+            }
+            m_snapshotReceived[header.index] = true;
+            while (m_snapshotNextChunk < m_snapshotReceived.size() && m_snapshotReceived[m_snapshotNextChunk]) m_snapshotNextChunk++;
+        }
+        else {
+            SnapshotEndMsg msg;
+            if (!SnapshotEndMsg::read(reader, msg) || msg.snapshotId != m_snapshotId) return;
+            m_snapshotComplete = true;
+            m_awaitingSnapshot = false;
+            m_nextVerify = m_transport->now() + std::chrono::milliseconds(m_config.verifyIntervalMs);
+            for (auto& op : m_heldOps) pushInbound(std::move(op));
+            m_heldOps.clear();
+            emit(SyncEvent::LevelSynced);
+        }
+    }
+
+    void pushInbound(EditOp&& op) {
+        if (!m_inboundOverflow.empty() || !m_inbound.push(std::move(op))) {
+            m_inboundOverflow.push_back(std::move(op));
+            m_inboundOverflowSize.store(m_inboundOverflow.size(), std::memory_order_relaxed);
+        }
+    }
+
+    // Returns true once everything parked in the overflow has made it into the ring.
+    bool retryInboundOverflow() {
+        size_t moved = 0;
+        while (moved < m_inboundOverflow.size() && m_inbound.push(std::move(m_inboundOverflow[moved]))) ++moved;
+        m_inboundOverflow.erase(m_inboundOverflow.begin(), m_inboundOverflow.begin() + moved);
+        m_inboundOverflowSize.store(m_inboundOverflow.size(), std::memory_order_relaxed);
+        return m_inboundOverflow.empty();
+    }
+};
+
+} // namespace devious
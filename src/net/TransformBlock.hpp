@@ -0,0 +1,327 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <vector>
+#include "Protocol.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define DEVIOUS_X86 1
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+    #if defined(__GNUC__) || defined(__clang__)
+        #define DEVIOUS_TARGET(features) __attribute__((target(features)))
+    #else
+        #define DEVIOUS_TARGET(features)
+    #endif
+#endif
+
+namespace devious {
+
+// TransformBlock payload := u64 stamp | u16 count | netIds | x | y | rotation | scaleX | scaleY
+// netIds := count varints: the first id, then the gap to each next one (ids ascending)
+// column := u8 mode | varints: mode 0 is one zigzag delta per object, mode 1 a single
+//           delta because every object shares the first object's value
+//
+// A moved selection sends the same five values for many objects. Each is quantized to a
+// fixed step (kPositionStep etc.) and coded as the difference to the previous object in
+// the block, so neighbours with similar transforms cost a byte or two per value and a
+// column shared by the whole selection costs nothing per object. Deltas are taken within
+// the block only: the host relays one encoding to every peer, and peers that joined at
+// different times or merged concurrent edits have no common earlier state to refer to.
+//
+// Quantizing is done the same way on every machine (round to nearest even). The sender
+// snaps its own objects to quantized(), which is what every receiver decodes, so all
+// copies of the level hold the same values.
+constexpr size_t kMaxTransformBlock = 4096;
+// Below this many moves per flush a plain batch record is about as small.
+constexpr size_t kMinTransformBlock = 4;
+constexpr float kPositionSteps = 64.f;   // per level unit
+constexpr float kRotationSteps = 64.f;   // per degree
+constexpr float kScaleSteps = 4096.f;
+// Quantized values are clamped to +-2^30 steps; deltas wrap in 32 bits.
+constexpr float kQuantizeLimit = 1073741824.f;
+
+namespace transform_detail {
+    constexpr uint32_t zigzag(uint32_t d) { return (d << 1) ^ uint32_t(int32_t(d) >> 31); }
+    constexpr uint32_t unzigzag(uint32_t z) { return (z >> 1) ^ (0u - (z & 1)); }
+
+    inline int32_t quantize(float v, float steps) {
+        float s = v == v ? v * steps : 0.f;
+        return (int32_t)std::nearbyint(std::max(-kQuantizeLimit, std::min(s, kQuantizeLimit)));
+    }
+
+    // out[i] = zigzag(q[i] - q[i - 1]) with q = quantize(in) and q[-1] = 0. The vector
+    // versions round with the default MXCSR mode, which is what nearbyint uses too.
+    inline void deltaScalar(float const* in, size_t n, float steps, uint32_t* out, size_t from = 0) {
+        uint32_t prev = from ? uint32_t(quantize(in[from - 1], steps)) : 0;
+        for (size_t i = from; i < n; ++i) {
+            uint32_t q = uint32_t(quantize(in[i], steps));
+            out[i] = zigzag(q - prev);
+            prev = q;
+        }
+    }
+
+    // The inverse: out[i] = (sum of unzigzag(in[0..i])) / steps.
+    inline void undeltaScalar(uint32_t const* in, size_t n, float steps, float* out, size_t from = 0, uint32_t prev = 0) {
+        float inv = 1.f / steps;
+        for (size_t i = from; i < n; ++i) {
+            prev += unzigzag(in[i]);
+            out[i] = float(int32_t(prev)) * inv;
+        }
+    }
+
+    #ifdef DEVIOUS_X86
+    inline __m128i quantize4(__m128 v, __m128 steps) {
+        v = _mm_and_ps(v, _mm_cmpord_ps(v, v));
+        v = _mm_mul_ps(v, steps);
+        v = _mm_max_ps(_mm_set1_ps(-kQuantizeLimit), _mm_min_ps(v, _mm_set1_ps(kQuantizeLimit)));
+        return _mm_cvtps_epi32(v);
+    }
+
+    inline void deltaSse2(float const* in, size_t n, float steps, uint32_t* out) {
+        __m128 s = _mm_set1_ps(steps);
+        __m128i prev = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128i q = quantize4(_mm_loadu_ps(in + i), s);
+            __m128i d = _mm_sub_epi32(q, _mm_or_si128(_mm_slli_si128(q, 4), _mm_srli_si128(prev, 12)));
+            __m128i z = _mm_xor_si128(_mm_slli_epi32(d, 1), _mm_srai_epi32(d, 31));
+            _mm_storeu_si128((__m128i*)(out + i), z);
+            prev = q;
+        }
+        deltaScalar(in, n, steps, out, i);
+    }
+
+    inline void undeltaSse2(uint32_t const* in, size_t n, float steps, float* out) {
+        __m128 inv = _mm_set1_ps(1.f / steps);
+        __m128i one = _mm_set1_epi32(1);
+        __m128i carry = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            __m128i z = _mm_loadu_si128((__m128i const*)(in + i));
+            __m128i d = _mm_xor_si128(_mm_srli_epi32(z, 1), _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(z, one)));
+            d = _mm_add_epi32(d, _mm_slli_si128(d, 4));
+            d = _mm_add_epi32(d, _mm_slli_si128(d, 8));
+            d = _mm_add_epi32(d, carry);
+            carry = _mm_shuffle_epi32(d, 0xFF);
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(d), inv));
+        }
+        undeltaScalar(in, n, steps, out, i, uint32_t(_mm_cvtsi128_si32(carry)));
+    }
+
+    DEVIOUS_TARGET("avx2")
+    inline void deltaAvx2(float const* in, size_t n, float steps, uint32_t* out) {
+        __m256 s = _mm256_set1_ps(steps);
+        __m256 lo = _mm256_set1_ps(-kQuantizeLimit), hi = _mm256_set1_ps(kQuantizeLimit);
+        __m256i rotate = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+        __m256i prev = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256 v = _mm256_loadu_ps(in + i);
+            v = _mm256_and_ps(v, _mm256_cmp_ps(v, v, _CMP_ORD_Q));
+            v = _mm256_max_ps(lo, _mm256_min_ps(_mm256_mul_ps(v, s), hi));
+            __m256i q = _mm256_cvtps_epi32(v);
+            // q shifted up one lane, with the last value of the previous vector in lane 0.
+            __m256i shifted = _mm256_blend_epi32(_mm256_permutevar8x32_epi32(q, rotate), _mm256_permutevar8x32_epi32(prev, rotate), 0x01);
+            __m256i d = _mm256_sub_epi32(q, shifted);
+            __m256i z = _mm256_xor_si256(_mm256_slli_epi32(d, 1), _mm256_srai_epi32(d, 31));
+            _mm256_storeu_si256((__m256i*)(out + i), z);
+            prev = q;
+        }
+        deltaScalar(in, n, steps, out, i);
+    }
+
+    DEVIOUS_TARGET("avx2")
+    inline void undeltaAvx2(uint32_t const* in, size_t n, float steps, float* out) {
+        __m256 inv = _mm256_set1_ps(1.f / steps);
+        __m256i one = _mm256_set1_epi32(1);
+        __m256i lane3 = _mm256_set1_epi32(3), lane7 = _mm256_set1_epi32(7);
+        __m256i carry = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m256i z = _mm256_loadu_si256((__m256i const*)(in + i));
+            __m256i d = _mm256_xor_si256(_mm256_srli_epi32(z, 1), _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_and_si256(z, one)));
+            // Prefix sum within each 128-bit half, then carry the low half's total up.
+            d = _mm256_add_epi32(d, _mm256_slli_si256(d, 4));
+            d = _mm256_add_epi32(d, _mm256_slli_si256(d, 8));
+            d = _mm256_add_epi32(d, _mm256_blend_epi32(_mm256_setzero_si256(), _mm256_permutevar8x32_epi32(d, lane3), 0xF0));
+            d = _mm256_add_epi32(d, carry);
+            carry = _mm256_permutevar8x32_epi32(d, lane7);
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(d), inv));
+        }
+        undeltaScalar(in, n, steps, out, i, uint32_t(_mm256_cvtsi256_si32(carry)));
+    }
+
+    DEVIOUS_TARGET("xsave")
+    inline bool cpuHasAvx2() {
+        #ifdef _WIN32
+        int info[4];
+        __cpuid(info, 1);
+        if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6) return false;  // the OS must save YMM state
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 5)) != 0;
+        #else
+        return __builtin_cpu_supports("avx2");
+        #endif
+    }
+    #endif
+
+    struct Kernels {
+        void (*delta)(float const*, size_t, float, uint32_t*);
+        void (*undelta)(uint32_t const*, size_t, float, float*);
+    };
+
+    // Picked once: AVX2 where the CPU has it, else SSE2 on x86, else plain C++.
+    inline Kernels const& kernels() {
+        static Kernels const k = [] {
+            #ifdef DEVIOUS_X86
+            if (cpuHasAvx2()) return Kernels{deltaAvx2, undeltaAvx2};
+            return Kernels{deltaSse2, undeltaSse2};
+            #else
+            return Kernels{[](float const* in, size_t n, float steps, uint32_t* out) { deltaScalar(in, n, steps, out); },
+                           [](uint32_t const* in, size_t n, float steps, float* out) { undeltaScalar(in, n, steps, out); }};
+            #endif
+        }();
+        return k;
+    }
+
+    inline void putVarint(std::vector<uint8_t>& out, uint32_t v) {
+        while (v >= 0x80) {
+            out.push_back(uint8_t(v | 0x80));
+            v >>= 7;
+        }
+        out.push_back(uint8_t(v));
+    }
+
+    inline bool getVarint(uint8_t const*& p, uint8_t const* end, uint32_t& v) {
+        v = 0;
+        for (int shift = 0; shift < 35; shift += 7) {
+            if (p == end) return false;
+            uint8_t b = *p++;
+            v |= uint32_t(b & 0x7F) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    // One quantized column: every delta, or just the first when the rest are all zero.
+    inline void putColumn(std::vector<uint8_t>& out, std::span<const uint32_t> deltas) {
+        bool shared = std::all_of(deltas.begin() + 1, deltas.end(), [](uint32_t z) { return z == 0; });
+        out.push_back(shared ? 1 : 0);
+        if (shared) putVarint(out, deltas[0]);
+        else for (uint32_t z : deltas) putVarint(out, z);
+    }
+
+    inline bool getColumn(uint8_t const*& p, uint8_t const* end, std::span<uint32_t> deltas) {
+        if (p == end || *p > 1) return false;
+        if (*p++ == 1) {
+            std::fill(deltas.begin(), deltas.end(), 0);
+            return getVarint(p, end, deltas[0]);
+        }
+        for (uint32_t& z : deltas) if (!getVarint(p, end, z)) return false;
+        return true;
+    }
+
+    struct Columns {
+        std::vector<float> values[5];
+        std::vector<uint32_t> codes;
+    };
+
+    inline constexpr float kSteps[5] = {kPositionSteps, kPositionSteps, kRotationSteps, kScaleSteps, kScaleSteps};
+}
+
+// Writes one TransformBlock frame for at most kMaxTransformBlock transforms with distinct
+// net ids, sorted by id.
+inline void writeTransformBlock(std::span<const TransformObjectMsg> transforms, uint64_t stamp, std::vector<uint8_t>& out) {
+    using namespace transform_detail;
+    thread_local Columns columns;
+    size_t n = transforms.size();
+    PacketWriter w(out);
+    w.begin(MsgType::TransformBlock);
+    w.u64(stamp);
+    w.u16(uint16_t(n));
+    uint32_t prevId = 0;
+    for (auto const& t : transforms) {
+        putVarint(out, t.netId - prevId);
+        prevId = t.netId;
+    }
+    for (auto& column : columns.values) column.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        columns.values[0][i] = transforms[i].x;
+        columns.values[1][i] = transforms[i].y;
+        columns.values[2][i] = transforms[i].rotation;
+        columns.values[3][i] = transforms[i].scaleX;
+        columns.values[4][i] = transforms[i].scaleY;
+    }
+    columns.codes.resize(n);
+    for (size_t c = 0; c < 5; ++c) {
+        if (!n) break;
+        kernels().delta(columns.values[c].data(), n, kSteps[c], columns.codes.data());
+        putColumn(out, columns.codes);
+    }
+    w.finish();
+}
+
+inline bool readTransformBlock(PacketReader& r, std::vector<TransformObjectMsg>& out, uint64_t& stamp) {
+    using namespace transform_detail;
+    thread_local Columns columns;
+    stamp = r.u64();
+    uint16_t n = r.u16();
+    if (!r.ok() || n > kMaxTransformBlock) return false;
+    auto rest = r.rest();
+    uint8_t const* p = rest.data();
+    uint8_t const* end = p + rest.size();
+    out.resize(n);
+    uint32_t id = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint32_t gap;
+        if (!getVarint(p, end, gap) || (i && !gap)) return false;
+        id += gap;
+        out[i].netId = id;
+    }
+    columns.codes.resize(n);
+    for (size_t c = 0; c < 5; ++c) {
+        if (!n) break;
+        if (!getColumn(p, end, columns.codes)) return false;
+        columns.values[c].resize(n);
+        kernels().undelta(columns.codes.data(), n, kSteps[c], columns.values[c].data());
+    }
+    for (size_t i = 0; i < n; ++i) {
+        out[i].x = columns.values[0][i];
+        out[i].y = columns.values[1][i];
+        out[i].rotation = columns.values[2][i];
+        out[i].scaleX = columns.values[3][i];
+        out[i].scaleY = columns.values[4][i];
+    }
+    return p == end;
+}
+
+// `t` as it comes out of a TransformBlock on the other end.
+inline TransformObjectMsg quantized(TransformObjectMsg t) {
+    using namespace transform_detail;
+    auto snap = [](float v, float steps) { return float(quantize(v, steps)) * (1.f / steps); };
+    t.x = snap(t.x, kPositionSteps);
+    t.y = snap(t.y, kPositionSteps);
+    t.rotation = snap(t.rotation, kRotationSteps);
+    t.scaleX = snap(t.scaleX, kScaleSteps);
+    t.scaleY = snap(t.scaleY, kScaleSteps);
+    return t;
+}
+
+// Sorts `transforms` by net id and appends them to `out` as TransformBlock frames of at
+// most kMaxTransformBlock each. Net ids must be unique, as EditBatcher keys its queue by
+// them; a plain sort then gives the same order as a stable one without its buffer.
+inline void writeTransformBlocks(std::vector<TransformObjectMsg>& transforms, uint64_t stamp, std::vector<uint8_t>& out) {
+    std::sort(transforms.begin(), transforms.end(), [](auto const& a, auto const& b) { return a.netId < b.netId; });
+    for (size_t start = 0; start < transforms.size(); start += kMaxTransformBlock) {
+        size_t count = std::min(kMaxTransformBlock, transforms.size() - start);
+        writeTransformBlock(std::span(transforms).subspan(start, count), stamp, out);
+    }
+}
+
+} // namespace devious
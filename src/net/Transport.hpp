@@ -0,0 +1,185 @@
+#pragma once
+
+#include "Socket.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+namespace devious {
+
+// Every socket call and clock read the engine makes goes through a Transport, so a session
+// can run over the real network (SystemTransport) or a simulated one (see SimNetwork.hpp).
+// Handles are SocketTypes either way and every socket is non-blocking.
+//
+// Reads and writes return the bytes moved, 0 from recv() once the peer closed the stream,
+// or one of these:
+constexpr long kWouldBlock = -1;
+constexpr long kSocketError = -2;
+
+class Transport {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    virtual ~Transport() = default;
+
+    virtual Clock::time_point now() = 0;
+
+    // A stream socket listening on `port`, or INVALID_SOCK if the port is taken.
+    virtual SocketType openListener(uint16_t port) = 0;
+    // INVALID_SOCK once no connection is waiting.
+    virtual SocketType accept(SocketType listener, sockaddr_in& from) = 0;
+    // Starts connecting to `to`. With `pending` set the outcome comes later: the socket
+    // polls writable (or errors) and connectError() tells which. INVALID_SOCK if it failed at once.
+    virtual SocketType connect(sockaddr_in const& to, bool& pending) = 0;
+    virtual int connectError(SocketType s) = 0;
+    // Writes the parts in order, as much as the socket takes, in one call.
+    virtual long send(SocketType s, std::span<const std::span<const uint8_t>> parts) = 0;
+    virtual long recv(SocketType s, std::span<uint8_t> into) = 0;
+
+    // A datagram socket bound to `port` (0 for any free one). A broadcast socket may send
+    // to INADDR_BROADCAST and shares its port with the others on the machine that share
+    // it too. INVALID_SOCK if the port is taken.
+    virtual SocketType openDatagram(uint16_t port, bool broadcast) = 0;
+    virtual long sendTo(SocketType s, std::span<const uint8_t> datagram, sockaddr_in const& to) = 0;
+    virtual long recvFrom(SocketType s, std::span<uint8_t> into, sockaddr_in& from) = 0;
+
+    // The port a socket is bound to, e.g. one opened on port 0.
+    virtual uint16_t localPort(SocketType s) = 0;
+
+    // Fills in revents. Returns how many sockets are ready, or -1 on failure.
+    virtual int poll(std::span<PollFd> fds, int timeoutMs) = 0;
+    virtual void close(SocketType s) = 0;
+};
+
+// The operating system's sockets and the steady clock.
+class SystemTransport final : public Transport {
+    static constexpr int kListenBacklog = 16;
+    static constexpr size_t kMaxParts = 64;
+
+    static long result(long n) {
+        if (n >= 0) return n;
+        return sock::wouldBlock() ? kWouldBlock : kSocketError;
+    }
+
+public:
+    SystemTransport() { sock::startup(); }
+
+    Clock::time_point now() override { return Clock::now(); }
+
+    SocketType openListener(uint16_t port) override {
+        SocketType s = socket(AF_INET, SOCK_STREAM, 0);
+        if (!IS_VALID(s)) return INVALID_SOCK;
+        sock::setReuseAddr(s);
+        auto addr = sock::address(INADDR_ANY, port);
+        if (bind(s, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(s, kListenBacklog) < 0) {
+            sock::closeIfValid(s);
+            return INVALID_SOCK;
+        }
+        sock::setNonBlocking(s);
+        return s;
+    }
+
+    SocketType accept(SocketType listener, sockaddr_in& from) override {
+        SockLen len = sizeof(from);
+        SocketType s = ::accept(listener, (sockaddr*)&from, &len);
+        if (!IS_VALID(s)) return INVALID_SOCK;
+        sock::setNonBlocking(s);
+        sock::setNoDelay(s);
+        return s;
+    }
+
+    SocketType connect(sockaddr_in const& to, bool& pending) override {
+        pending = false;
+        SocketType s = socket(AF_INET, SOCK_STREAM, 0);
+        if (!IS_VALID(s)) return INVALID_SOCK;
+        sock::setNonBlocking(s);
+        sock::setNoDelay(s);
+        if (::connect(s, (sockaddr const*)&to, sizeof(to)) < 0) {
+            if (!sock::wouldBlock()) {
+                sock::closeIfValid(s);
+                return INVALID_SOCK;
+            }
+            pending = true;
+        }
+        return s;
+    }
+
+    int connectError(SocketType s) override {
+        int err = 0;
+        SockLen len = sizeof(err);
+        getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&err, &len);
+        return err;
+    }
+
+    long send(SocketType s, std::span<const std::span<const uint8_t>> parts) override {
+        size_t count = std::min(parts.size(), kMaxParts);
+        #ifdef _WIN32
+        WSABUF bufs[kMaxParts];
+        for (size_t i = 0; i < count; ++i) {
+            bufs[i].buf = (char*)parts[i].data();
+            bufs[i].len = (ULONG)parts[i].size();
+        }
+        DWORD sent = 0;
+        int rc = WSASend(s, bufs, (DWORD)count, &sent, 0, nullptr, nullptr);
+        return result(rc == 0 ? (long)sent : -1);
+        #else
+        iovec iov[kMaxParts];
+        for (size_t i = 0; i < count; ++i) {
+            iov[i].iov_base = (void*)parts[i].data();
+            iov[i].iov_len = parts[i].size();
+        }
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        return result((long)sendmsg(s, &msg, SEND_FLAGS));
+        #endif
+    }
+
+    long recv(SocketType s, std::span<uint8_t> into) override {
+        return result((long)::recv(s, (char*)into.data(), (int)into.size(), 0));
+    }
+
+    SocketType openDatagram(uint16_t port, bool broadcast) override {
+        SocketType s = socket(AF_INET, SOCK_DGRAM, 0);
+        if (!IS_VALID(s)) return INVALID_SOCK;
+        if (broadcast) {
+            int one = 1;
+            setsockopt(s, SOL_SOCKET, SO_BROADCAST, (char*)&one, sizeof(one));
+            if (port) sock::setReuseAddr(s);
+        }
+        auto addr = sock::address(INADDR_ANY, port);
+        if (bind(s, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            sock::closeIfValid(s);
+            return INVALID_SOCK;
+        }
+        sock::setNonBlocking(s);
+        return s;
+    }
+
+    long sendTo(SocketType s, std::span<const uint8_t> datagram, sockaddr_in const& to) override {
+        return result((long)sendto(s, (char const*)datagram.data(), (int)datagram.size(), 0, (sockaddr const*)&to, sizeof(to)));
+    }
+
+    long recvFrom(SocketType s, std::span<uint8_t> into, sockaddr_in& from) override {
+        SockLen len = sizeof(from);
+        return result((long)recvfrom(s, (char*)into.data(), (int)into.size(), 0, (sockaddr*)&from, &len));
+    }
+
+    uint16_t localPort(SocketType s) override {
+        sockaddr_in addr{};
+        SockLen len = sizeof(addr);
+        if (getsockname(s, (sockaddr*)&addr, &len) < 0) return 0;
+        return ntohs(addr.sin_port);
+    }
+
+    int poll(std::span<PollFd> fds, int timeoutMs) override {
+        return ::POLL_SOCKETS(fds.data(), (unsigned long)fds.size(), timeoutMs);
+    }
+
+    void close(SocketType s) override { sock::closeIfValid(s); }
+};
+
+} // namespace devious